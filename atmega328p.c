@@ -1,6 +1,140 @@
 #include <stdlib.h>
 #include <string.h>
 #include "atmega328p.h"
+#include "defines.h"
+
+static const struct timer_config timer_configs[ATMEGA328P_TIMER_COUNT] = {
+    { /* Timer/Counter0; clock sources 6 and 7 are the external T0 pin */
+        .bits = 8,
+        .prescalers = { 0, 1, 8, 64, 256, 1024, 0, 0 },
+        .tccra = 0x44, .tccrb = 0x45, .tcnt = 0x46,
+        .ocra = 0x47, .ocrb = 0x48,
+        .timsk = 0x6e, .tifr = 0x35,
+        .vectors = { [TIMER_TOV] = 16, [TIMER_OCFA] = 14, [TIMER_OCFB] = 15 },
+    },
+    { /* Timer/Counter1 */
+        .bits = 16,
+        .prescalers = { 0, 1, 8, 64, 256, 1024, 0, 0 },
+        .tccra = 0x80, .tccrb = 0x81, .tccrc = 0x82, .tcnt = 0x84,
+        .icr = 0x86, .ocra = 0x88, .ocrb = 0x8a,
+        .timsk = 0x6f, .tifr = 0x36,
+        .vectors = { [TIMER_TOV] = 13, [TIMER_OCFA] = 11, [TIMER_OCFB] = 12,
+                     [TIMER_ICF] = 10 },
+    },
+    { /* Timer/Counter2 */
+        .bits = 8,
+        .prescalers = { 0, 1, 8, 32, 64, 128, 256, 1024 },
+        .tccra = 0xb0, .tccrb = 0xb1, .tcnt = 0xb2,
+        .ocra = 0xb3, .ocrb = 0xb4,
+        .timsk = 0x70, .tifr = 0x37,
+        .vectors = { [TIMER_TOV] = 9, [TIMER_OCFA] = 7, [TIMER_OCFB] = 8 },
+    },
+};
+
+static const struct usart_config usart_config = {
+    .ucsra = 0xc0, .ucsrb = 0xc1, .ucsrc = 0xc2,
+    .ubrr = 0xc4, .udr = 0xc6,
+    .rx_vector = 18, .udre_vector = 19, .tx_vector = 20,
+};
+
+static const struct gpio_config gpio_config = {
+    .port_count = 3,
+    .ports = {
+        { .name = 'B', .pin = 0x23, .ddr = 0x24, .port = 0x25, .pins = 0xff,
+          .pcmsk = 0x6b, .vector = 3 },
+        /* PC6 is RESET. */
+        { .name = 'C', .pin = 0x26, .ddr = 0x27, .port = 0x28, .pins = 0x7f,
+          .pcmsk = 0x6c, .vector = 4 },
+        { .name = 'D', .pin = 0x29, .ddr = 0x2a, .port = 0x2b, .pins = 0xff,
+          .pcmsk = 0x6d, .vector = 5 },
+    },
+    .pcicr = 0x68, .pcifr = 0x3b,
+};
+
+/* Programming times from the datasheet, in cycles of ATMEGA328P_CLOCK_HZ. */
+#define MS_TO_CYCLES(ms) ((uint32_t) ((ms) * (ATMEGA328P_CLOCK_HZ / 1000)))
+
+static const struct nvm_config nvm_config = {
+    .eecr = 0x3f, .eedr = 0x40, .eear = 0x41,
+    .spmcsr = 0x57,
+    .ee_ready_vector = 22, .spm_ready_vector = 25,
+    .eeprom_size = ATMEGA328P_EEPROM_SIZE,
+    .flash_size = ATMEGA328P_FLASH_SIZE,
+    .page_size = ATMEGA328P_FLASH_PAGE_SIZE,
+    /* The largest boot loader section, 2048 words, and the NRWW section */
+    .boot_start = 0x7000, .nrww_start = 0x7000,
+    .eeprom_cycles = { MS_TO_CYCLES(3.4), MS_TO_CYCLES(1.8),
+                       MS_TO_CYCLES(1.8) },
+    .flash_cycles = MS_TO_CYCLES(4.5),
+};
+
+/* Read and write the register of a peripheral at a data address. */
+static int load_peripheral(struct atmega328p *mcu, unsigned addr,
+                           uint8_t *byte)
+{
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        if (timer_load(&mcu->timers[i], addr, byte)) {
+            return 1;
+        }
+    }
+    return gpio_load(&mcu->gpio, addr, byte) ||
+           usart_load(&mcu->usart0, addr, byte) ||
+           nvm_load(&mcu->nvm, addr, byte);
+}
+
+static int store_peripheral(struct atmega328p *mcu, unsigned addr,
+                            uint8_t byte)
+{
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        if (timer_store(&mcu->timers[i], addr, byte)) {
+            return 1;
+        }
+    }
+    return gpio_store(&mcu->gpio, addr, byte) ||
+           usart_store(&mcu->usart0, addr, byte) ||
+           nvm_store(&mcu->nvm, addr, byte);
+}
+
+/* Clear the flag of an interrupt taken by the CPU. */
+static void ack_interrupt(void *m, unsigned vector)
+{
+    struct atmega328p *mcu = m;
+
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        if (timer_ack(&mcu->timers[i], vector)) {
+            return;
+        }
+    }
+    if (gpio_ack(&mcu->gpio, vector) || usart_ack(&mcu->usart0, vector)) {
+        return;
+    }
+    (void) nvm_ack(&mcu->nvm, vector);
+}
+
+/* Returns when the value of a data address may next change by itself. */
+static uint64_t io_next_change(void *m, unsigned addr)
+{
+    struct atmega328p *mcu = m;
+    uint64_t next = usart_next_change(&mcu->usart0, addr);
+    uint64_t t = nvm_next_change(&mcu->nvm, addr);
+
+    if (t < next) {
+        next = t;
+    }
+    t = gpio_next_change(&mcu->gpio, addr);
+    if (t < next) {
+        next = t;
+    }
+
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        uint64_t t = timer_next_change(&mcu->timers[i], addr);
+
+        if (t < next) {
+            next = t;
+        }
+    }
+    return next;
+}
 
 static int load_io(void *m, unsigned addr, uint8_t *byte)
 {
@@ -14,9 +148,12 @@ static int load_io(void *m, unsigned addr, uint8_t *byte)
         *byte = mcu->cpu.sp >> 8;
         break;
     case 0x3f: /* SREG */
-        memcpy(byte, &mcu->cpu.sreg, 1);
+        *byte = cpu_read_sreg(&mcu->cpu);
         break;
     default:
+        if (load_peripheral(mcu, addr + 0x20, byte)) {
+            break;
+        }
         if (addr < ATMEGA328P_IO_REGISTER_COUNT) {
             *byte = mcu->io_registers[addr];
         }
@@ -41,9 +178,12 @@ static int store_io(void *m, unsigned addr, uint8_t byte)
         mcu->cpu.sp = byte << 8 | mcu->cpu.sp & 0xff;
         break;
     case 0x3f: /* SREG */
-        memcpy(&mcu->cpu.sreg, &byte, 1);
+        cpu_write_sreg(&mcu->cpu, byte);
         break;
     default:
+        if (store_peripheral(mcu, addr + 0x20, byte)) {
+            break;
+        }
         if (addr < ATMEGA328P_IO_REGISTER_COUNT) {
             mcu->io_registers[addr] = byte;
         }
@@ -70,6 +210,9 @@ static int load_data(void *m, unsigned addr, uint8_t *byte)
     }
     else if (addr <= 0xff) {
         /* extended io register */
+        if (!load_peripheral(mcu, addr, byte)) {
+            *byte = mcu->ext_io_registers[addr - 0x60];
+        }
     }
     else if (addr <= 0x8ff) {
         *byte = mcu->sram[addr - 0x100];
@@ -96,6 +239,9 @@ static int store_data(void *m, unsigned addr, uint8_t byte)
     }
     else if (addr <= 0xff) {
         /* extended io register */
+        if (!store_peripheral(mcu, addr, byte)) {
+            mcu->ext_io_registers[addr - 0x60] = byte;
+        }
     }
     else if (addr <= 0x8ff) {
         mcu->sram[addr - 0x100] = byte;
@@ -124,27 +270,424 @@ static int write_flash(void *m, unsigned addr, const void *data, unsigned size)
     if (addr + size > ATMEGA328P_FLASH_SIZE) {
         return -1;
     }
+    if (atmega328p_unshare_flash(mcu) < 0) {
+        return -1;
+    }
     memcpy(&mcu->flash[addr], data, size);
+    cpu_invalidate_icache(&mcu->cpu, addr, size);
     return 0;
 }
 
-void atmega328p_init(struct atmega328p *mcu)
+static void spm(void *m, unsigned pc, uint16_t z, uint16_t data)
 {
-    memset(mcu, 0, sizeof(*mcu));
+    struct atmega328p *mcu = m;
+
+    nvm_spm(&mcu->nvm, pc, z, data);
+}
+
+/* Returns 1 if a watchpoint is set on the data memory page at addr. */
+static int page_watched(const struct atmega328p *mcu, unsigned addr)
+{
+    for (unsigned i = 0; i < DATA_PAGE_SIZE; i++) {
+        if (mcu->watch[addr + i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Map the pages of plain memory that have no watchpoints. */
+static void map_data_memory(struct atmega328p *mcu)
+{
+    _Bool watching = 0;
+
+    for (unsigned addr = 0; addr < ATMEGA328P_DATA_MEMORY_SIZE;
+         addr += DATA_PAGE_SIZE) {
+        uint8_t **page = &mcu->data_pages[addr / DATA_PAGE_SIZE];
+
+        *page = NULL;
+        if (page_watched(mcu, addr)) {
+            watching = 1;
+        }
+        else if (addr == 0) {
+            /* General Purpose Working Registers */
+            *page = mcu->gpwr;
+        }
+        else if (addr >= 0x100) {
+            /* SRAM; pages 0x20..0xff hold I/O registers and stay unmapped. */
+            *page = &mcu->sram[addr - 0x100];
+        }
+    }
+
+    mcu->bus.pages = mcu->data_pages;
+    mcu->bus.page_count = ARRAY_SIZE(mcu->data_pages);
+    mcu->cpu.watch = watching ? mcu->watch : NULL;
+    mcu->cpu.watch_size = ARRAY_SIZE(mcu->watch);
+}
 
+/* Point the buses and the CPU of mcu to its own memories. */
+static void bind(struct atmega328p *mcu)
+{
     mcu->bus.load = load_data;
     mcu->bus.store = store_data;
+    map_data_memory(mcu);
     mcu->io_bus.load = load_io;
     mcu->io_bus.store = store_io;
+    /* PINB, PINC, PIND, TIFR0, TIFR1, TIFR2 and PCIFR */
+    mcu->io_bus.strobe_registers = 1u << 0x03 | 1u << 0x06 | 1u << 0x09 |
+                                   1u << 0x15 | 1u << 0x16 | 1u << 0x17 |
+                                   1u << 0x1b;
     mcu->flash_bus.read = read_flash;
     mcu->flash_bus.write = write_flash;
+    mcu->flash_bus.spm = spm;
+    mcu->flash = mcu->flash_memory->data;
 
-    /* CPU */
     mcu->cpu.mcu = mcu;
-    mcu->cpu.core = CORE_AVREP;
     mcu->cpu.reg_file = mcu->gpwr;
-    mcu->cpu.sp = ATMEGA328P_DATA_MEMORY_SIZE - 1;
     mcu->cpu.bus = &mcu->bus;
     mcu->cpu.io_bus = &mcu->io_bus;
     mcu->cpu.flash_bus = &mcu->flash_bus;
+    mcu->cpu.icache = mcu->flash_memory->icache;
+    mcu->cpu.icache_size = ARRAY_SIZE(mcu->flash_memory->icache);
+    mcu->cpu.irq_ack = ack_interrupt;
+    mcu->cpu.io_next_change = io_next_change;
+
+    mcu->events.cpu = &mcu->cpu;
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        timer_attach(&mcu->timers[i], &timer_configs[i], &mcu->events,
+                     &mcu->cpu);
+    }
+    usart_attach(&mcu->usart0, &usart_config, &mcu->events, &mcu->cpu);
+    nvm_attach(&mcu->nvm, &nvm_config, &mcu->events, &mcu->cpu, mcu->eeprom);
+    gpio_attach(&mcu->gpio, &gpio_config, &mcu->events, &mcu->cpu);
+}
+
+static void release_flash(struct atmega328p_flash *flash)
+{
+    if (atomic_fetch_sub(&flash->refcount, 1) == 1) {
+        free(flash);
+    }
+}
+
+int atmega328p_init(struct atmega328p *mcu)
+{
+    memset(mcu, 0, sizeof(*mcu));
+
+    mcu->flash_memory = calloc(1, sizeof(*mcu->flash_memory));
+    if (!mcu->flash_memory) {
+        return -1;
+    }
+    atomic_init(&mcu->flash_memory->refcount, 1);
+    usart_reset(&mcu->usart0);
+    nvm_reset(&mcu->nvm);
+    gpio_reset(&mcu->gpio);
+    /* Erased EEPROM and flash memory read as 0xff. */
+    memset(mcu->eeprom, 0xff, sizeof(mcu->eeprom));
+    memset(mcu->flash_memory->data, 0xff, sizeof(mcu->flash_memory->data));
+    bind(mcu);
+
+    /* CPU */
+    mcu->cpu.core = CORE_AVREP;
+    mcu->cpu.pc_width = 16;
+    mcu->cpu.sp = ATMEGA328P_DATA_MEMORY_SIZE - 1;
+    mcu->cpu.irq_vector_words = 2;
+
+    return 0;
+}
+
+void atmega328p_destroy(struct atmega328p *mcu)
+{
+    release_flash(mcu->flash_memory);
+    mcu->flash_memory = NULL;
+    mcu->flash = NULL;
+}
+
+void atmega328p_fork(struct atmega328p *child, struct atmega328p *parent)
+{
+    if (!parent->cpu.icache_shared) {
+        /* Children should not have to decode what the parent has not. */
+        cpu_fill_icache(&parent->cpu);
+        parent->cpu.icache_shared = 1;
+    }
+
+    memcpy(child, parent, sizeof(*child));
+    atomic_fetch_add(&parent->flash_memory->refcount, 1);
+    event_queue_move(&child->events, (char *) child - (char *) parent);
+    child->nvm.eeprom_image = NULL;
+    child->nvm.flash_image = NULL;
+    child->gpio.log = NULL;
+    /* A tracer or profile records a single MCU. */
+    child->cpu.tracer = NULL;
+    child->cpu.profile = NULL;
+    bind(child);
+    /* Host streams are not thread-safe; forks run on their own. */
+    usart_connect(&child->usart0, NULL);
+    if (child->cpu.current_inst == &parent->cpu.uncached.inst) {
+        child->cpu.current_inst = &child->cpu.uncached.inst;
+    }
+}
+
+void atmega328p_persist(struct atmega328p *mcu, struct nvm_image *eeprom,
+                        struct nvm_image *flash)
+{
+    if (eeprom) {
+        nvm_image_load(eeprom, mcu->eeprom);
+    }
+    if (flash && atmega328p_unshare_flash(mcu) == 0) {
+        nvm_image_load(flash, mcu->flash);
+        cpu_invalidate_icache(&mcu->cpu, 0, ATMEGA328P_FLASH_SIZE);
+    }
+    else {
+        flash = NULL;
+    }
+    mcu->nvm.eeprom_image = eeprom;
+    mcu->nvm.flash_image = flash;
+}
+
+/* Write out what the MCU has buffered for the host. */
+static void flush(struct atmega328p *mcu)
+{
+    if (mcu->usart0.stream) {
+        usart_stream_flush(mcu->usart0.stream);
+    }
+    if (mcu->nvm.eeprom_image) {
+        nvm_image_sync(mcu->nvm.eeprom_image, mcu->eeprom);
+    }
+    if (mcu->nvm.flash_image) {
+        nvm_image_sync(mcu->nvm.flash_image, mcu->flash);
+    }
+    if (mcu->gpio.log) {
+        gpio_log_flush(mcu->gpio.log);
+    }
+}
+
+/* Bits of the timers that keep running in each sleep mode (SMCR SM2:0). */
+static const uint8_t sleep_mode_timers[8] = {
+    [0] = 0x7, /* Idle */
+    [1] = 0x4, /* ADC noise reduction */
+    [2] = 0x0, /* Power-down */
+    [3] = 0x4, /* Power-save */
+    [6] = 0x0, /* Standby */
+    [7] = 0x4, /* Extended standby */
+};
+
+static void enter_sleep(struct atmega328p *mcu)
+{
+    unsigned mode = mcu->io_registers[0x33] >> 1 & 7; /* SMCR */
+
+    mcu->sleeping = 1;
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        timer_set_stopped(&mcu->timers[i],
+                          !BITVAL(sleep_mode_timers[mode], i));
+    }
+    /* Only the idle mode keeps the I/O clock running. */
+    usart_set_stopped(&mcu->usart0, mode != 0);
+}
+
+static void wake_up(struct atmega328p *mcu)
+{
+    mcu->sleeping = 0;
+    for (unsigned i = 0; i < ATMEGA328P_TIMER_COUNT; i++) {
+        timer_set_stopped(&mcu->timers[i], 0);
+    }
+    usart_set_stopped(&mcu->usart0, 0);
+}
+
+/*
+ * Let the sleeping mcu sleep until end or until an interrupt wakes it,
+ * jumping from one event to the next instead of running idle cycles.
+ * Returns 0 if nothing can wake it.
+ */
+static int sleep_until(struct atmega328p *mcu, uint64_t end)
+{
+    struct cpu *cpu = &mcu->cpu;
+
+    while (cpu->cycle_count < end) {
+        uint64_t next = event_queue_next(&mcu->events);
+
+        if (!cpu->sreg.I || next == EVENT_NEVER) {
+            return 0;
+        }
+        if (next > cpu->cycle_count) {
+            cpu->cycle_count = next < end ? next : end;
+        }
+        event_queue_run(&mcu->events, cpu->cycle_count);
+
+        if (cpu->irq_pending) {
+            wake_up(mcu);
+            break;
+        }
+    }
+
+    return 1;
+}
+
+enum cpu_stop_reason atmega328p_run(struct atmega328p *mcu,
+                                    uint64_t max_cycles)
+{
+    struct cpu *cpu = &mcu->cpu;
+    uint64_t end = cpu->cycle_count + max_cycles;
+    enum cpu_stop_reason reason = CPU_STOP_BUDGET;
+
+    while (cpu->cycle_count < end) {
+        uint64_t until;
+
+        if (mcu->sleeping) {
+            if (cpu->irq_pending && cpu->sreg.I) {
+                wake_up(mcu);
+            }
+            else if (!sleep_until(mcu, end)) {
+                reason = CPU_STOP_SLEEP;
+                break;
+            }
+            continue;
+        }
+
+        until = event_queue_next(&mcu->events);
+        if (until > end) {
+            until = end;
+        }
+        /* Events scheduled while running bring cpu_run() back early. */
+        if (until > cpu->cycle_count) {
+            reason = cpu_run(cpu, until - cpu->cycle_count);
+        }
+        event_queue_run(&mcu->events, cpu->cycle_count);
+
+        if (reason == CPU_STOP_SLEEP) {
+            /* SLEEP does nothing unless SE in SMCR is set. */
+            if (BITVAL(mcu->io_registers[0x33], 0)) {
+                enter_sleep(mcu);
+            }
+            reason = CPU_STOP_BUDGET;
+        }
+        else if (reason != CPU_STOP_BUDGET) {
+            break;
+        }
+    }
+
+    flush(mcu);
+    return reason;
+}
+
+void atmega328p_idle(struct atmega328p *mcu, uint64_t max_cycles)
+{
+    struct cpu *cpu = &mcu->cpu;
+    uint64_t end = cpu->cycle_count + max_cycles;
+
+    while (cpu->cycle_count < end) {
+        uint64_t next = event_queue_next(&mcu->events);
+
+        if (next > cpu->cycle_count) {
+            cpu->cycle_count = next < end ? next : end;
+        }
+        event_queue_run(&mcu->events, cpu->cycle_count);
+    }
+
+    flush(mcu);
+}
+
+enum cpu_stop_reason atmega328p_step(struct atmega328p *mcu)
+{
+    struct cpu *cpu = &mcu->cpu;
+    enum cpu_stop_reason reason;
+
+    if (mcu->sleeping) {
+        return atmega328p_run(mcu, 1);
+    }
+
+    reason = cpu_step(cpu);
+    event_queue_run(&mcu->events, cpu->cycle_count);
+    if (reason == CPU_STOP_SLEEP) {
+        if (BITVAL(mcu->io_registers[0x33], 0)) {
+            enter_sleep(mcu);
+        }
+        reason = CPU_STOP_BUDGET;
+    }
+
+    flush(mcu);
+    return reason;
+}
+
+int atmega328p_add_watchpoint(struct atmega328p *mcu, unsigned addr,
+                              unsigned size, unsigned kinds)
+{
+    if (addr >= ATMEGA328P_DATA_MEMORY_SIZE ||
+        size > ATMEGA328P_DATA_MEMORY_SIZE - addr) {
+        return -1;
+    }
+    for (unsigned i = 0; i < size; i++) {
+        mcu->watch[addr + i] |= kinds;
+    }
+    map_data_memory(mcu);
+    return 0;
+}
+
+void atmega328p_clear_watchpoints(struct atmega328p *mcu)
+{
+    memset(mcu->watch, 0, sizeof(mcu->watch));
+    map_data_memory(mcu);
+}
+
+int atmega328p_unshare_flash(struct atmega328p *mcu)
+{
+    struct atmega328p_flash *copy;
+
+    if (atomic_load(&mcu->flash_memory->refcount) > 1) {
+        copy = malloc(sizeof(*copy));
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy->data, mcu->flash_memory->data, sizeof(copy->data));
+        memcpy(copy->icache, mcu->flash_memory->icache,
+               sizeof(copy->icache));
+        atomic_init(&copy->refcount, 1);
+
+        release_flash(mcu->flash_memory);
+        mcu->flash_memory = copy;
+        mcu->flash = copy->data;
+        mcu->cpu.icache = copy->icache;
+    }
+
+    mcu->cpu.icache_shared = 0;
+    return 0;
+}
+
+void atmega328p_snapshot(struct atmega328p_snapshot *snap,
+                         struct atmega328p *mcu)
+{
+    atmega328p_fork(&snap->mcu, mcu);
+}
+
+void atmega328p_restore(struct atmega328p *mcu,
+                        struct atmega328p_snapshot *snap)
+{
+    struct usart_stream *stream = mcu->usart0.stream;
+    struct nvm_image *eeprom = mcu->nvm.eeprom_image;
+    struct nvm_image *flash = mcu->nvm.flash_image;
+    struct gpio_log *log = mcu->gpio.log;
+    struct tracer *tracer = mcu->cpu.tracer;
+    struct profile *profile = mcu->cpu.profile;
+
+    flush(mcu);
+    atmega328p_destroy(mcu);
+    atmega328p_fork(mcu, &snap->mcu);
+
+    /* Reattach the host, which sees the memories and pins change at once. */
+    mcu->cpu.tracer = tracer;
+    mcu->cpu.profile = profile;
+    if (eeprom) {
+        mcu->nvm.eeprom_image = eeprom;
+        nvm_image_mark(eeprom, 0, ATMEGA328P_EEPROM_SIZE);
+    }
+    if (flash) {
+        mcu->nvm.flash_image = flash;
+        nvm_image_mark(flash, 0, ATMEGA328P_FLASH_SIZE);
+    }
+    gpio_connect(&mcu->gpio, log);
+    usart_connect(&mcu->usart0, stream);
+}
+
+void atmega328p_snapshot_free(struct atmega328p_snapshot *snap)
+{
+    atmega328p_destroy(&snap->mcu);
 }
@@ -1,16 +1,39 @@
 #ifndef ATMEGA328P_H
 #define ATMEGA328P_H
 
+#include <stdatomic.h>
 #include "cpu.h"
+#include "event.h"
+#include "gpio.h"
+#include "nvm.h"
+#include "timer.h"
+#include "usart.h"
 
 #define ATMEGA328P_DATA_MEMORY_SIZE     0x900
 #define ATMEGA328P_SRAM_SIZE            0x800
-#define ATMEGA328P_FLASH_SIZE           0x4000
+#define ATMEGA328P_FLASH_SIZE           0x8000
+#define ATMEGA328P_FLASH_PAGE_SIZE      128
 #define ATMEGA328P_EEPROM_SIZE          0x400
+#define ATMEGA328P_EEPROM_PAGE_SIZE     4
+
+/* Clock of the CPU, which the programming times of NVM are converted to. */
+#define ATMEGA328P_CLOCK_HZ             16000000
 
 /* The number of General Purpose Working Registers. */
 #define ATMEGA328P_GPWR_COUNT           32
 #define ATMEGA328P_IO_REGISTER_COUNT    64
+#define ATMEGA328P_EXT_IO_REGISTER_COUNT 160
+#define ATMEGA328P_TIMER_COUNT          3
+
+/*
+ * Flash memory and its predecoded instructions. MCUs forked from each other
+ * share them until one of them writes to flash.
+ */
+struct atmega328p_flash {
+    atomic_uint refcount; /* Number of MCUs using this */
+    uint8_t data[ATMEGA328P_FLASH_SIZE];
+    struct icache_entry icache[ATMEGA328P_FLASH_SIZE / 2];
+};
 
 struct atmega328p {
     struct cpu cpu;
@@ -20,11 +43,117 @@ struct atmega328p {
 
     uint8_t gpwr[ATMEGA328P_GPWR_COUNT];
     uint8_t io_registers[ATMEGA328P_IO_REGISTER_COUNT];
+    uint8_t ext_io_registers[ATMEGA328P_EXT_IO_REGISTER_COUNT];
     uint8_t sram[ATMEGA328P_SRAM_SIZE];
     uint8_t eeprom[ATMEGA328P_EEPROM_SIZE];
-    uint8_t flash[ATMEGA328P_FLASH_SIZE];
+    uint8_t *flash; /* Flash memory, flash_memory->data */
+
+    /* Data memory map of bus */
+    uint8_t *data_pages[ATMEGA328P_DATA_MEMORY_SIZE / DATA_PAGE_SIZE];
+    /* CPU_WATCH_* bits of the watchpoints on each data address */
+    uint8_t watch[ATMEGA328P_DATA_MEMORY_SIZE];
+
+    struct atmega328p_flash *flash_memory;
+
+    /* Peripherals */
+    struct event_queue events;
+    struct timer timers[ATMEGA328P_TIMER_COUNT];
+    struct usart usart0;
+    struct nvm nvm;
+    struct gpio gpio;
+
+    _Bool sleeping; /* In a sleep mode until an interrupt wakes it */
+};
+
+/* A saved state of an MCU. */
+struct atmega328p_snapshot {
+    struct atmega328p mcu;
 };
 
-void atmega328p_init(struct atmega328p *mcu);
+/*
+ * Initialize mcu to its reset state. Returns 0 on success or a negative
+ * value if memory could not be allocated.
+ */
+int atmega328p_init(struct atmega328p *mcu);
+
+/* Release the resources of an initialized MCU. */
+void atmega328p_destroy(struct atmega328p *mcu);
+
+/*
+ * Run mcu for max_cycles cycles, or until the CPU stops, handling the events
+ * of its peripherals when they are due. Returns why it stopped, as
+ * cpu_run() does. Time spent in a sleep mode is skipped from one event to
+ * the next; CPU_STOP_SLEEP is returned only if nothing can wake the MCU.
+ */
+enum cpu_stop_reason atmega328p_run(struct atmega328p *mcu,
+                                    uint64_t max_cycles);
+
+/*
+ * Execute one instruction of mcu, or enter an interrupt, ignoring any
+ * breakpoint set on it, and handle the events due by then. A sleeping mcu
+ * sleeps for a cycle, or until an event, instead. Returns why it stopped,
+ * as atmega328p_run() does.
+ */
+enum cpu_stop_reason atmega328p_step(struct atmega328p *mcu);
+
+/*
+ * Let mcu, which atmega328p_run() left sleeping with nothing to wake it,
+ * sleep for max_cycles and handle the events due by then, e.g. while
+ * waiting for a value from another MCU.
+ */
+void atmega328p_idle(struct atmega328p *mcu, uint64_t max_cycles);
+
+/*
+ * Watch size data addresses from addr for the CPU_WATCH_* access kinds,
+ * adding to the watchpoints already set. Watched pages of SRAM are taken out
+ * of the memory map of the CPU, and it executes instructions one at a time
+ * until the watchpoints are cleared. Returns 0 on success or a negative
+ * value if the addresses are invalid.
+ */
+int atmega328p_add_watchpoint(struct atmega328p *mcu, unsigned addr,
+                              unsigned size, unsigned kinds);
+void atmega328p_clear_watchpoints(struct atmega328p *mcu);
+
+/*
+ * Persist the EEPROM and flash memory of mcu to images opened with
+ * nvm_image_open(), either of which may be NULL. An image that was not
+ * empty replaces the memory, e.g. the program loaded; otherwise it is
+ * initialized from it. Writes by the MCU are copied into the images whenever
+ * atmega328p_run() or atmega328p_step() returns, as are the pin changes
+ * logged by the GPIO. Copies of mcu made by atmega328p_fork() are neither
+ * persisted nor logged.
+ */
+void atmega328p_persist(struct atmega328p *mcu, struct nvm_image *eeprom,
+                        struct nvm_image *flash);
+
+/*
+ * Initialize child as a copy of parent. The MCUs own their RAM, registers
+ * and EEPROM but share flash memory and its predecoded instructions until
+ * either of them writes to flash. Forking from the same parent on several
+ * threads at once is safe once the parent has been forked before, e.g. if
+ * it is a snapshot. The child is not connected to the host stream of USART0
+ * and is neither traced nor profiled.
+ */
+void atmega328p_fork(struct atmega328p *child, struct atmega328p *parent);
+
+/*
+ * Give mcu a private copy of flash memory if it is shared, e.g. before
+ * setting breakpoints. Returns 0 on success or a negative value if memory
+ * could not be allocated.
+ */
+int atmega328p_unshare_flash(struct atmega328p *mcu);
+
+/*
+ * Save the state of mcu in snap, which must be freed with
+ * atmega328p_snapshot_free(), and restore a saved state, any number of
+ * times. Restoring keeps mcu connected to its host stream, images, pin log,
+ * tracer and profile: the restored memories are written to the images and
+ * the restored pin levels are logged.
+ */
+void atmega328p_snapshot(struct atmega328p_snapshot *snap,
+                         struct atmega328p *mcu);
+void atmega328p_restore(struct atmega328p *mcu,
+                        struct atmega328p_snapshot *snap);
+void atmega328p_snapshot_free(struct atmega328p_snapshot *snap);
 
 #endif
@@ -0,0 +1,510 @@
+/*
+ * Throughput benchmark. Runs a fixed set of AVR programs on an ATmega328P,
+ * checks their results and reports simulated MIPS, host nanoseconds per
+ * instruction and cycles per instruction.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atmega328p.h"
+#include "cpu.h"
+#include "defines.h"
+#include "log.h"
+
+/* Encoders for the instructions used by the workloads. */
+#define TWO_REG(base, d, r) \
+    ((base) | (((r) & 0x10) << 5) | (((d) & 0x1f) << 4) | ((r) & 0xf))
+#define ONE_REG(base, d)    ((base) | (((d) & 0x1f) << 4))
+#define REG_IMM(base, d, K) \
+    ((base) | (((K) & 0xf0) << 4) | (((d) & 0xf) << 4) | ((K) & 0xf))
+#define BRANCH(base, k)     ((base) | (((k) & 0x7f) << 3))
+
+#define ADC(d, r)       TWO_REG(0x1c00, d, r)
+#define ADD(d, r)       TWO_REG(0x0c00, d, r)
+#define EOR(d, r)       TWO_REG(0x2400, d, r)
+#define MUL(d, r)       TWO_REG(0x9c00, d, r)
+#define CPI(d, K)       REG_IMM(0x3000, d, K)
+#define LDI(d, K)       REG_IMM(0xe000, d, K)
+#define DEC(d)          ONE_REG(0x940a, d)
+#define INC(d)          ONE_REG(0x9403, d)
+#define LSR(d)          ONE_REG(0x9406, d)
+#define SWAP(d)         ONE_REG(0x9402, d)
+#define POP(d)          ONE_REG(0x900f, d)
+#define PUSH(r)         ONE_REG(0x920f, r)
+#define LD_X_INC(d)     ONE_REG(0x900d, d)  /* LD Rd, X+ */
+#define ST_Z_INC(r)     ONE_REG(0x9201, r)  /* ST Z+, Rr */
+#define SBRC(r, b)      ONE_REG(0xfc00 | (b), r)
+#define SBRS(r, b)      ONE_REG(0xfe00 | (b), r)
+/* Registers 16..31 */
+#define MULS(d, r)      (0x0200 | (((d) & 0xf) << 4) | ((r) & 0xf))
+/* Registers 16..23 */
+#define MULSU(d, r)     (0x0300 | (((d) & 0x7) << 4) | ((r) & 0x7))
+#define FMUL(d, r)      (0x0308 | (((d) & 0x7) << 4) | ((r) & 0x7))
+#define FMULS(d, r)     (0x0380 | (((d) & 0x7) << 4) | ((r) & 0x7))
+#define FMULSU(d, r)    (0x0388 | (((d) & 0x7) << 4) | ((r) & 0x7))
+#define BRCC(k)         BRANCH(0xf400, k)
+#define BREQ(k)         BRANCH(0xf001, k)
+#define BRNE(k)         BRANCH(0xf401, k)
+#define BRTS(k)         BRANCH(0xf006, k)
+#define RCALL(k)        (0xd000 | ((k) & 0xfff))
+#define RET             0x9508
+#define SET             0x9468
+#define BREAK           0x9598
+
+/*
+ * Workloads. Each program ends with BREAK; branch offsets are relative to
+ * the word after the branch and the comments give word addresses.
+ */
+
+/* Tight ALU loop: 256 * 256 iterations of add, carry, xor and swap. */
+static const uint16_t alu_program[] = {
+    /* 0 */ LDI(16, 0),
+    /* 1 */ LDI(24, 0),
+    /* 2 */ LDI(25, 0),
+    /* 3 */ LDI(18, 1),
+    /* 4 */ LDI(17, 0),     /* outer: */
+    /* 5 */ ADD(24, 18),    /* inner: */
+    /* 6 */ ADC(25, 24),
+    /* 7 */ EOR(24, 17),
+    /* 8 */ INC(18),
+    /* 9 */ SWAP(25),
+    /* 10 */ DEC(17),
+    /* 11 */ BRNE(-7),      /* inner */
+    /* 12 */ DEC(16),
+    /* 13 */ BRNE(-10),     /* outer */
+    /* 14 */ BREAK
+};
+
+static int check_alu(const struct atmega328p *mcu)
+{
+    uint8_t r16 = 0, r17, r18 = 1, r24 = 0, r25 = 0;
+
+    do {
+        r17 = 0;
+        do {
+            unsigned sum = r24 + r18;
+
+            r24 = sum;
+            r25 = r25 + r24 + (sum >> 8);
+            r24 ^= r17;
+            r18++;
+            r25 = (r25 << 4) | (r25 >> 4);
+        } while (--r17);
+    } while (--r16);
+
+    return mcu->gpwr[24] == r24 && mcu->gpwr[25] == r25 ? 0 : -1;
+}
+
+/* memcpy() of 256 bytes from 0x100 to 0x200, 256 times. */
+static const uint16_t memcpy_program[] = {
+    /* 0 */ LDI(20, 0),
+    /* 1 */ LDI(26, 0x00),  /* outer: X = 0x100 */
+    /* 2 */ LDI(27, 0x01),
+    /* 3 */ LDI(30, 0x00),  /* Z = 0x200 */
+    /* 4 */ LDI(31, 0x02),
+    /* 5 */ LDI(21, 0),
+    /* 6 */ LD_X_INC(0),    /* inner: */
+    /* 7 */ ST_Z_INC(0),
+    /* 8 */ DEC(21),
+    /* 9 */ BRNE(-4),       /* inner */
+    /* 10 */ DEC(20),
+    /* 11 */ BRNE(-11),     /* outer */
+    /* 12 */ BREAK
+};
+
+static void setup_memcpy(struct atmega328p *mcu)
+{
+    for (int i = 0; i < 256; i++) {
+        mcu->sram[i] = i * 7 + 3;
+    }
+}
+
+static int check_memcpy(const struct atmega328p *mcu)
+{
+    const uint8_t *r = mcu->gpwr;
+
+    if (memcmp(&mcu->sram[0x100], &mcu->sram[0], 256) != 0) {
+        return -1;
+    }
+    /* X and Z point past the copied bytes. */
+    return r[26] == 0x00 && r[27] == 0x02 && r[30] == 0x00 && r[31] == 0x03
+           ? 0 : -1;
+}
+
+/* Calls to a function saving and restoring registers on the stack. */
+static const uint16_t stack_program[] = {
+    /* 0 */ LDI(16, 0),
+    /* 1 */ LDI(24, 0),
+    /* 2 */ LDI(25, 0),
+    /* 3 */ LDI(19, 0),
+    /* 4 */ LDI(17, 0),     /* outer: */
+    /* 5 */ RCALL(5),       /* inner: call func */
+    /* 6 */ DEC(17),
+    /* 7 */ BRNE(-3),       /* inner */
+    /* 8 */ DEC(16),
+    /* 9 */ BRNE(-6),       /* outer */
+    /* 10 */ BREAK,
+    /* 11 */ PUSH(16),      /* func: */
+    /* 12 */ PUSH(17),
+    /* 13 */ ADD(24, 17),
+    /* 14 */ ADC(25, 19),
+    /* 15 */ LDI(16, 0xff),
+    /* 16 */ LDI(17, 0xff),
+    /* 17 */ POP(17),
+    /* 18 */ POP(16),
+    /* 19 */ RET
+};
+
+static int check_stack(const struct atmega328p *mcu)
+{
+    uint16_t sum = 0;
+    uint8_t r16 = 0, r17;
+
+    do {
+        r17 = 0;
+        do {
+            sum += r17;
+        } while (--r17);
+    } while (--r16);
+
+    return mcu->gpwr[24] == (sum & 0xff) && mcu->gpwr[25] == sum >> 8 &&
+           mcu->cpu.sp == ATMEGA328P_DATA_MEMORY_SIZE - 1 ? 0 : -1;
+}
+
+/*
+ * Branch-heavy state machine driven by an 8-bit LFSR. T is set so that BRTS
+ * always branches.
+ */
+static const uint16_t branch_program[] = {
+    /* 0 */ LDI(21, 0xb8),
+    /* 1 */ LDI(22, 1),
+    /* 2 */ LDI(20, 0),
+    /* 3 */ LDI(24, 0),
+    /* 4 */ LDI(16, 0),
+    /* 5 */ LDI(17, 0),
+    /* 6 */ SET,
+    /* 7 */ LSR(22),        /* loop: */
+    /* 8 */ BRCC(1),
+    /* 9 */ EOR(22, 21),
+    /* 10 */ CPI(20, 0),
+    /* 11 */ BREQ(6),       /* s0 */
+    /* 12 */ CPI(20, 1),
+    /* 13 */ BREQ(8),       /* s1 */
+    /* 14 */ SBRS(22, 1),   /* s2: */
+    /* 15 */ LDI(20, 0),
+    /* 16 */ INC(24),
+    /* 17 */ BRTS(7),       /* next */
+    /* 18 */ SBRC(22, 2),   /* s0: */
+    /* 19 */ LDI(20, 1),
+    /* 20 */ ADD(24, 22),
+    /* 21 */ BRTS(3),       /* next */
+    /* 22 */ SBRC(22, 3),   /* s1: */
+    /* 23 */ LDI(20, 2),
+    /* 24 */ EOR(24, 22),
+    /* 25 */ DEC(17),       /* next: */
+    /* 26 */ BRNE(-20),     /* loop */
+    /* 27 */ DEC(16),
+    /* 28 */ BRNE(-22),     /* loop */
+    /* 29 */ BREAK
+};
+
+static int check_branch(const struct atmega328p *mcu)
+{
+    uint8_t lfsr = 1, state = 0, r24 = 0, r16 = 0, r17 = 0;
+
+    do {
+        do {
+            _Bool carry = lfsr & 1;
+
+            lfsr >>= 1;
+            if (carry) {
+                lfsr ^= 0xb8;
+            }
+
+            if (state == 0) {
+                if (BITVAL(lfsr, 2)) {
+                    state = 1;
+                }
+                r24 += lfsr;
+            }
+            else if (state == 1) {
+                if (BITVAL(lfsr, 3)) {
+                    state = 2;
+                }
+                r24 ^= lfsr;
+            }
+            else {
+                if (!BITVAL(lfsr, 1)) {
+                    state = 0;
+                }
+                r24++;
+            }
+        } while (--r17);
+    } while (--r16);
+
+    return mcu->gpwr[24] == r24 && mcu->gpwr[20] == state ? 0 : -1;
+}
+
+/* Multiplication kernel using every MUL and FMUL variant. */
+static const uint16_t mul_program[] = {
+    /* 0 */ LDI(16, 0),
+    /* 1 */ LDI(17, 0),
+    /* 2 */ LDI(18, 3),
+    /* 3 */ LDI(19, 5),
+    /* 4 */ LDI(24, 0),
+    /* 5 */ LDI(25, 0),
+    /* 6 */ LDI(23, 0),
+    /* 7 */ MUL(18, 19),    /* loop: */
+    /* 8 */ ADD(24, 0),
+    /* 9 */ ADC(25, 1),
+    /* 10 */ MULS(18, 19),
+    /* 11 */ EOR(24, 1),
+    /* 12 */ FMUL(18, 19),
+    /* 13 */ ADD(25, 1),
+    /* 14 */ FMULS(19, 18),
+    /* 15 */ EOR(24, 0),
+    /* 16 */ FMULSU(18, 19),
+    /* 17 */ ADD(24, 1),
+    /* 18 */ ADC(25, 23),
+    /* 19 */ MULSU(19, 18),
+    /* 20 */ EOR(25, 0),
+    /* 21 */ INC(18),
+    /* 22 */ ADD(19, 18),
+    /* 23 */ DEC(17),
+    /* 24 */ BRNE(-18),     /* loop */
+    /* 25 */ DEC(16),
+    /* 26 */ BRNE(-20),     /* loop */
+    /* 27 */ BREAK
+};
+
+static int check_mul(const struct atmega328p *mcu)
+{
+    uint8_t r16 = 0, r17 = 0, r18 = 3, r19 = 5, r24 = 0, r25 = 0;
+    uint16_t p;
+    unsigned sum;
+
+    do {
+        do {
+            p = r18 * r19;
+            sum = r24 + (p & 0xff);
+            r24 = sum;
+            r25 = r25 + (p >> 8) + (sum >> 8);
+            p = (int8_t)r18 * (int8_t)r19;
+            r24 ^= p >> 8;
+            p = (uint16_t)(r18 * r19) << 1;
+            r25 += p >> 8;
+            p = (uint16_t)((int8_t)r19 * (int8_t)r18) << 1;
+            r24 ^= p & 0xff;
+            p = (uint16_t)((int8_t)r18 * r19) << 1;
+            sum = r24 + (p >> 8);
+            r24 = sum;
+            r25 += sum >> 8;
+            p = (int8_t)r19 * r18;
+            r25 ^= p & 0xff;
+            r18++;
+            r19 += r18;
+        } while (--r17);
+    } while (--r16);
+
+    return mcu->gpwr[24] == r24 && mcu->gpwr[25] == r25 ? 0 : -1;
+}
+
+struct workload {
+    const char *name;
+    const uint16_t *program;
+    unsigned program_words;
+    void (*setup)(struct atmega328p *mcu); /* Optional */
+    int (*check)(const struct atmega328p *mcu); /* Returns 0 if correct */
+};
+
+#define WORKLOAD(name, setup) \
+    { #name, name##_program, ARRAY_SIZE(name##_program), setup, check_##name }
+
+static const struct workload workloads[] = {
+    WORKLOAD(alu, NULL),
+    WORKLOAD(memcpy, setup_memcpy),
+    WORKLOAD(stack, NULL),
+    WORKLOAD(branch, NULL),
+    WORKLOAD(mul, NULL),
+};
+
+/* Cycle budget after which a workload is considered stuck. */
+#define MAX_CYCLES 100000000
+
+struct result {
+    uint64_t instructions; /* Per run */
+    uint64_t cycles; /* Per run */
+    uint64_t runs;
+    double seconds; /* Host time spent in all runs */
+    _Bool passed;
+};
+
+static struct atmega328p mcu;
+static struct atmega328p_snapshot initial; /* mcu with the workload loaded */
+
+static int load_workload(const struct workload *w)
+{
+    if (atmega328p_init(&mcu) < 0) {
+        return -1;
+    }
+    mcu.flash_bus.write(&mcu, 0, w->program, w->program_words * 2);
+    if (w->setup) {
+        w->setup(&mcu);
+    }
+    atmega328p_snapshot(&initial, &mcu);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run a workload once cycle by cycle to count its instructions and check its
+ * results, then repeatedly with atmega328p_run() for at least min_seconds.
+ */
+static void run_workload(const struct workload *w, double min_seconds,
+                         struct result *res)
+{
+    memset(res, 0, sizeof(*res));
+
+    if (load_workload(w) < 0) {
+        return;
+    }
+    while (mcu.cpu.stop_reason == CPU_STOP_NONE &&
+           mcu.cpu.cycle_count < MAX_CYCLES) {
+        if (!mcu.cpu.is_executing_inst) {
+            res->instructions++;
+        }
+        cpu_cycle(&mcu.cpu);
+    }
+    res->cycles = mcu.cpu.cycle_count;
+
+    if (mcu.cpu.stop_reason != CPU_STOP_BREAK || w->check(&mcu) != 0) {
+        goto out;
+    }
+
+    do {
+        double start;
+        enum cpu_stop_reason reason;
+
+        atmega328p_restore(&mcu, &initial);
+        start = now();
+        reason = atmega328p_run(&mcu, MAX_CYCLES);
+        res->seconds += now() - start;
+        res->runs++;
+
+        if (reason != CPU_STOP_BREAK || mcu.cpu.cycle_count != res->cycles ||
+            w->check(&mcu) != 0) {
+            goto out;
+        }
+    } while (res->seconds < min_seconds);
+
+    res->passed = 1;
+
+out:
+    atmega328p_snapshot_free(&initial);
+    atmega328p_destroy(&mcu);
+}
+
+static void print_result(FILE *stream, const char *fmt, const char *label,
+                         const struct workload *w, const struct result *res)
+{
+    double instructions = (double) res->instructions * res->runs;
+    double mips = 0, ns = 0, cpi = 0;
+
+    if (res->passed) {
+        mips = instructions / res->seconds / 1e6;
+        ns = res->seconds * 1e9 / instructions;
+    }
+    if (res->instructions > 0) {
+        cpi = (double) res->cycles / res->instructions;
+    }
+
+    fprintf(stream, fmt, label, w->name, res->passed ? "ok" : "FAIL",
+            (unsigned long long) res->instructions,
+            (unsigned long long) res->cycles,
+            (unsigned long long) res->runs, mips, ns, cpi);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *label = "-";
+    double min_seconds = 1.0;
+    FILE *out = NULL;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "l:o:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            label = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            min_seconds = atof(optarg);
+            break;
+        default:
+            eprintf("usage: %s [-l label] [-o results.tsv] [-s seconds] "
+                    "[workload...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (output) {
+        /* Results are appended so that runs on different commits add up. */
+        out = fopen(output, "a");
+        if (!out) {
+            perror(output);
+            return 1;
+        }
+        if (ftell(out) == 0) {
+            fprintf(out, "label\tworkload\tstatus\tinstructions\tcycles\t"
+                         "runs\tmips\tns_per_inst\tcpi\n");
+        }
+    }
+
+    printf("%-10s %-6s %12s %12s %6s %9s %8s %6s\n", "workload", "status",
+           "instructions", "cycles", "runs", "MIPS", "ns/inst", "CPI");
+
+    for (unsigned i = 0; i < ARRAY_SIZE(workloads); i++) {
+        const struct workload *w = &workloads[i];
+        struct result res;
+
+        if (optind < argc) {
+            int selected = 0;
+
+            for (int j = optind; j < argc; j++) {
+                selected |= strcmp(argv[j], w->name) == 0;
+            }
+            if (!selected) {
+                continue;
+            }
+        }
+
+        run_workload(w, min_seconds, &res);
+        print_result(stdout, "%.0s%-10s %-6s %12llu %12llu %6llu %9.2f %8.2f "
+                     "%6.3f\n", "", w, &res);
+        if (out) {
+            print_result(out, "%s\t%s\t%s\t%llu\t%llu\t%llu\t%.3f\t%.3f\t"
+                         "%.4f\n", label, w, &res);
+        }
+        failed |= !res.passed;
+    }
+
+    if (out) {
+        fclose(out);
+    }
+
+    return failed;
+}
@@ -1,40 +1,338 @@
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "cpu.h"
 #include "defines.h"
 #include "log.h"
+#include "profile.h"
+#include "tracer.h"
 
 #define REG(n) cpu->reg_file[n]
-#define SREG (cpu->sreg)
-#define Rd REG(cpu->current_inst.Rd)
-#define Rr REG(cpu->current_inst.Rr)
-#define A cpu->current_inst.A
-#define K cpu->current_inst.K
-#define k cpu->current_inst.k
-#define s cpu->current_inst.s
-#define b cpu->current_inst.b
+#define SREG (*sreg(cpu))
 #define FAILED(status) ((status) < 0)
 
+/*
+ * Instruction dispatch methods. CPU_DISPATCH may be defined at build time to
+ * select one; by default threaded code is used where the compiler supports it.
+ */
+#define CPU_DISPATCH_SWITCH     0 /* switch on the operation */
+#define CPU_DISPATCH_CALL       1 /* call through a handler function pointer */
+#define CPU_DISPATCH_THREADED   2 /* jump through a label address (GNU C) */
+
+#ifndef CPU_DISPATCH
+#ifdef __GNUC__
+#define CPU_DISPATCH CPU_DISPATCH_THREADED
+#else
+#define CPU_DISPATCH CPU_DISPATCH_CALL
+#endif
+#endif
+
+/*
+ * With lazy flags (the default), arithmetic instructions only record their
+ * operands and result, and the flags they affect are computed when SREG is
+ * next accessed. Define CPU_LAZY_FLAGS to 0 to update SREG eagerly.
+ */
+#ifndef CPU_LAZY_FLAGS
+#define CPU_LAZY_FLAGS 1
+#endif
+
+/* SREG bits written by each kind of flag-setting operation. */
+#define FLAG_C  BIT2MASK(0)
+#define FLAG_Z  BIT2MASK(1)
+#define FLAG_N  BIT2MASK(2)
+#define FLAG_V  BIT2MASK(3)
+#define FLAG_S  BIT2MASK(4)
+#define FLAG_H  BIT2MASK(5)
+
+static const uint8_t flags_written[] = {
+    [FLAGS_NONE]    = 0,
+    [FLAGS_ADD]     = FLAG_H | FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+    [FLAGS_COMPARE] = FLAG_H | FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+    [FLAGS_LOGIC]   = FLAG_V | FLAG_N | FLAG_S | FLAG_Z,
+    [FLAGS_COM]     = FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+    [FLAGS_NEG]     = FLAG_H | FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+    [FLAGS_INC]     = FLAG_V | FLAG_N | FLAG_S | FLAG_Z,
+    [FLAGS_DEC]     = FLAG_V | FLAG_N | FLAG_S | FLAG_Z,
+    [FLAGS_ADIW]    = FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+    [FLAGS_SBIW]    = FLAG_V | FLAG_N | FLAG_S | FLAG_Z | FLAG_C,
+};
+
+/* Update the flags in sreg for the operation recorded in f. */
+static void evaluate_flags(struct sreg *sreg, const struct lazy_flags *f)
+{
+    uint8_t Rd = f->rd;
+    uint8_t Rr = f->rr;
+    uint16_t R = f->r;
+
+    switch (f->op) {
+    case FLAGS_NONE:
+        break;
+    case FLAGS_ADD:
+        /* H <=> there was a carry from bit 3. */
+        sreg->H = BITVAL(Rd, 3) && BITVAL(Rr, 3) ||
+                  BITVAL(Rr, 3) && !BITVAL(R, 3) ||
+                  !BITVAL(R, 3) && BITVAL(Rd, 3);
+        /* V <=> two's complement overflow resulted from the operation. */
+        sreg->V = BITVAL(Rd, 7) && BITVAL(Rr, 7) && !BITVAL(R, 7) ||
+                  !BITVAL(Rd, 7) && !BITVAL(Rr, 7) && BITVAL(R, 7);
+        /* N <=> MSB of the result is set. */
+        sreg->N = BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        sreg->Z = R == 0;
+        /* C <=> there was a carry from the MSB of the result. */
+        sreg->C = BITVAL(Rd, 7) && BITVAL(Rr, 7) ||
+                  BITVAL(Rr, 7) && !BITVAL(R, 7) ||
+                  !BITVAL(R, 7) && BITVAL(Rd, 7);
+        break;
+    case FLAGS_COMPARE:
+        sreg->Z = R == 0;
+        sreg->H = !BITVAL(Rd, 3) && BITVAL(Rr, 3) ||
+                  BITVAL(Rr, 3) && BITVAL(R, 3) ||
+                  BITVAL(R, 3) && !BITVAL(Rd, 3);
+        sreg->N = BITVAL(R, 7);
+        /* V <=> two's complement overflow resulted from the operation. */
+        sreg->V = BITVAL(Rd, 7) && !BITVAL(Rr, 7) && !BITVAL(R, 7) ||
+                  !BITVAL(Rd, 7) && BITVAL(Rr, 7) && BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        /*
+         * CP: C <=> absolute value of the contents of Rr is larger than the
+         *       absolute value of Rd.
+         * CPC: C <=> absolute value of the contents of Rr plus previous carry
+         *        is larger than the absolute value of Rd.
+         * CPI: C <=> absolute value of K is larger than the absolute value
+         *        of Rd.
+         */
+        sreg->C = !BITVAL(Rd, 7) && BITVAL(Rr, 7) ||
+                  BITVAL(Rr, 7) && BITVAL(R, 7) ||
+                  BITVAL(R, 7) && !BITVAL(Rd, 7);
+        break;
+    case FLAGS_LOGIC:
+        sreg->V = 0;
+        /* N <=> MSB of the result is set. */
+        sreg->N = BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        sreg->Z = R == 0;
+        break;
+    case FLAGS_COM:
+        sreg->V = 0;
+        sreg->C = 1;
+        sreg->N = BITVAL(R, 7);
+        sreg->Z = R == 0;
+        sreg->S = sreg->N ^ sreg->V;
+        break;
+    case FLAGS_NEG:
+        sreg->H = BITVAL(R, 3) | BITVAL(Rd, 3);
+        /* V <=> two's complement overflow resulted from the operation. */
+        sreg->V = (R & 0xff) == 0x80;
+        /* N <=> MSB of the result is set. */
+        sreg->N = BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        sreg->Z = R == 0;
+        sreg->C = R != 0;
+        break;
+    case FLAGS_INC:
+        sreg->V = Rd == 0x7f;
+        sreg->Z = R == 0;
+        sreg->N = BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        break;
+    case FLAGS_DEC:
+        /* V <=> two's complement overflow resulted from the operation. */
+        sreg->V = Rd == 0x80;
+        sreg->Z = R == 0;
+        sreg->N = BITVAL(R, 7);
+        sreg->S = sreg->N ^ sreg->V;
+        break;
+    case FLAGS_ADIW:
+        /* Rd holds the high byte of the register pair. */
+        /* V <=> two's complement overflow resulted from the operation. */
+        sreg->V = BITVAL(R, 15) && !BITVAL(Rd, 7);
+        /* N <=> MSB of the result is set. */
+        sreg->N = BITVAL(R, 15);
+        sreg->S = sreg->N ^ sreg->V;
+        sreg->Z = R == 0;
+        sreg->C = !BITVAL(R, 15) && BITVAL(Rd, 7);
+        break;
+    case FLAGS_SBIW:
+        /* Rd holds the high byte of the register pair. */
+        sreg->V = !BITVAL(R, 15) && BITVAL(Rd, 7);
+        sreg->N = BITVAL(R, 15);
+        sreg->S = sreg->N ^ sreg->V;
+        sreg->Z = R == 0;
+        sreg->C = BITVAL(R, 15) && !BITVAL(Rd, 7);
+        break;
+    }
+}
+
+/* Bring SREG up to date with a deferred flag update. */
+static inline void sync_flags(struct cpu *cpu)
+{
+#if CPU_LAZY_FLAGS
+    if (cpu->lazy_flags.op != FLAGS_NONE) {
+        evaluate_flags(&cpu->sreg, &cpu->lazy_flags);
+        cpu->lazy_flags.op = FLAGS_NONE;
+    }
+#endif
+}
+
+/* Returns the up to date status register. */
+static inline struct sreg *sreg(struct cpu *cpu)
+{
+    sync_flags(cpu);
+    return &cpu->sreg;
+}
+
+/* Set the flags affected by a flag-setting operation, possibly lazily. */
+static inline void set_flags(struct cpu *cpu, enum flags_op op,
+                             uint8_t rd, uint8_t rr, uint16_t r)
+{
+    struct lazy_flags f = { op, rd, rr, r };
+
+#if CPU_LAZY_FLAGS
+    /* A deferred update must not be lost if op leaves some of its flags. */
+    if (flags_written[cpu->lazy_flags.op] & ~flags_written[op]) {
+        sync_flags(cpu);
+    }
+    cpu->lazy_flags = f;
+#else
+    evaluate_flags(&cpu->sreg, &f);
+#endif
+}
+
+/* Z and C flags, without bringing all of SREG up to date if possible. */
+static inline _Bool flag_Z(struct cpu *cpu)
+{
+#if CPU_LAZY_FLAGS
+    /* Every lazily evaluated operation sets Z if its result is zero. */
+    if (cpu->lazy_flags.op != FLAGS_NONE) {
+        return cpu->lazy_flags.r == 0;
+    }
+#endif
+    return cpu->sreg.Z;
+}
+
+static inline _Bool flag_C(struct cpu *cpu)
+{
+    if (flags_written[cpu->lazy_flags.op] & FLAG_C) {
+        sync_flags(cpu);
+    }
+    return cpu->sreg.C;
+}
+
+uint8_t cpu_read_sreg(struct cpu *cpu)
+{
+    uint8_t byte;
+
+    memcpy(&byte, sreg(cpu), 1);
+    return byte;
+}
+
+/*
+ * Let an interrupt be taken after the next instruction, now that I is set.
+ * run() returns so that cpu_run() executes that instruction by itself.
+ */
+static void enable_interrupts(struct cpu *cpu)
+{
+    cpu->irq_delayed = 1;
+    cpu->run_until = 0;
+}
+
+void cpu_write_sreg(struct cpu *cpu, uint8_t byte)
+{
+    _Bool enabled = cpu->sreg.I;
+
+    cpu->lazy_flags.op = FLAGS_NONE;
+    memcpy(&cpu->sreg, &byte, 1);
+    if (cpu->sreg.I && !enabled && cpu->irq_pending) {
+        cpu->run_until = 0;
+    }
+}
+
+/*
+ * Returns a pointer to the memory backing data addresses addr..addr+n-1 if
+ * they all lie in one directly mapped page, otherwise NULL.
+ */
+static inline uint8_t *direct_data(struct cpu *cpu, uint16_t addr, int n)
+{
+    unsigned page = addr >> DATA_PAGE_SHIFT;
+    unsigned offset = addr & (DATA_PAGE_SIZE - 1);
+
+    if (page >= cpu->bus->page_count || offset + n > DATA_PAGE_SIZE) {
+        return NULL;
+    }
+    if (!cpu->bus->pages[page]) {
+        return NULL;
+    }
+
+    return cpu->bus->pages[page] + offset;
+}
+
+static void cpu_stop(struct cpu *cpu, enum cpu_stop_reason reason);
+
+/* Stop after the current instruction if addr is watched for kind access. */
+static inline void check_watch(struct cpu *cpu, uint16_t addr, unsigned kind)
+{
+    if (cpu->watch && addr < cpu->watch_size && (cpu->watch[addr] & kind) &&
+        cpu->stop_reason != CPU_STOP_WATCHPOINT) {
+        /* Report the first address an access hits. */
+        cpu->watch_addr = addr;
+        cpu->watch_kind = kind;
+        cpu_stop(cpu, CPU_STOP_WATCHPOINT);
+    }
+}
+
+static void trace_accesses(struct cpu *cpu, unsigned kind, uint16_t addr,
+                           const uint8_t *bytes, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        tracer_access(cpu->tracer, kind, addr + i, bytes[i]);
+    }
+}
+
 static int cpu_load_data(struct cpu *cpu, uint16_t addr, uint8_t *bytes, int n)
 {
+    uint8_t *mem;
     int rc;
 
-    for (int i = 0; i < n; ++i) {
-        rc = cpu->bus->load(cpu->mcu, addr + i, &bytes[i]);
-        if (FAILED(rc)) {
-            warn("loading data memory failed with code %d\n", rc);
-            return rc;
+    mem = direct_data(cpu, addr, n);
+    if (mem) {
+        memcpy(bytes, mem, n);
+    }
+    else {
+        for (int i = 0; i < n; ++i) {
+            check_watch(cpu, addr + i, CPU_WATCH_LOAD);
+            rc = cpu->bus->load(cpu->mcu, addr + i, &bytes[i]);
+            if (FAILED(rc)) {
+                warn("loading data memory failed with code %d\n", rc);
+                return rc;
+            }
         }
     }
 
+    if (cpu->tracer) {
+        trace_accesses(cpu, TRACE_LOAD, addr, bytes, n);
+    }
     return 0;
 }
 
 static int cpu_store_data(struct cpu *cpu, uint16_t addr, const uint8_t *bytes, int n)
 {
+    uint8_t *mem;
     int rc;
 
+    if (cpu->tracer) {
+        trace_accesses(cpu, TRACE_STORE, addr, bytes, n);
+    }
+
+    mem = direct_data(cpu, addr, n);
+    if (mem) {
+        memcpy(mem, bytes, n);
+        return 0;
+    }
+
     for (int i = 0; i < n; ++i) {
+        check_watch(cpu, addr + i, CPU_WATCH_STORE);
         rc = cpu->bus->store(cpu->mcu, addr + i, bytes[i]);
         if (FAILED(rc)) {
             warn("storing data memory failed with code %d\n", rc);
@@ -45,15 +343,51 @@ static int cpu_store_data(struct cpu *cpu, uint16_t addr, const uint8_t *bytes,
     return 0;
 }
 
+/* Load a 16-bit little-endian value from data memory. */
+static uint16_t cpu_load_word(struct cpu *cpu, uint16_t addr)
+{
+    uint8_t bytes[2] = { 0, 0 };
+    const uint8_t *mem;
+
+    mem = direct_data(cpu, addr, 2);
+    if (!mem || cpu->tracer) {
+        (void) cpu_load_data(cpu, addr, bytes, 2);
+        mem = bytes;
+    }
+
+    return mem[0] | mem[1] << 8;
+}
+
+/* Store a 16-bit little-endian value into data memory. */
+static void cpu_store_word(struct cpu *cpu, uint16_t addr, uint16_t word)
+{
+    uint8_t bytes[2] = { word, word >> 8 };
+    uint8_t *mem;
+
+    mem = direct_data(cpu, addr, 2);
+    if (mem && !cpu->tracer) {
+        mem[0] = bytes[0];
+        mem[1] = bytes[1];
+    }
+    else {
+        (void) cpu_store_data(cpu, addr, bytes, 2);
+    }
+}
+
 static uint8_t cpu_io_in(struct cpu *cpu, uint8_t io_addr)
 {
     uint8_t reg_contents = 0;
     int rc;
 
+    check_watch(cpu, io_addr + 0x20, CPU_WATCH_LOAD);
     rc = cpu->io_bus->load(cpu->mcu, io_addr, &reg_contents);
     if (FAILED(rc)) {
         warn("loading I/O memory failed with code %d\n", rc);
     }
+    if (cpu->tracer) {
+        /* Traced by data address. */
+        tracer_access(cpu->tracer, TRACE_LOAD, io_addr + 0x20, reg_contents);
+    }
 
     return reg_contents;
 }
@@ -62,22 +396,94 @@ static void cpu_io_out(struct cpu *cpu, uint8_t io_addr, uint8_t val)
 {
     int rc;
 
+    check_watch(cpu, io_addr + 0x20, CPU_WATCH_STORE);
+    if (cpu->tracer) {
+        tracer_access(cpu->tracer, TRACE_STORE, io_addr + 0x20, val);
+    }
     rc = cpu->io_bus->store(cpu->mcu, io_addr, val);
     if (FAILED(rc)) {
         warn("storing I/O memory failed with code %d\n", rc);
     }
 }
 
-static void stack_push(struct cpu *cpu, const void *data, int size)
+/* Load a byte from data memory, directly if it lies in plain memory. */
+static inline uint8_t cpu_load_byte(struct cpu *cpu, uint16_t addr)
+{
+    uint8_t byte = 0;
+    const uint8_t *mem;
+
+    mem = direct_data(cpu, addr, 1);
+    if (mem && !cpu->tracer) {
+        return *mem;
+    }
+    (void) cpu_load_data(cpu, addr, &byte, 1);
+    return byte;
+}
+
+/* Store a byte into data memory, directly if it lies in plain memory. */
+static inline void cpu_store_byte(struct cpu *cpu, uint16_t addr, uint8_t byte)
+{
+    uint8_t *mem;
+
+    mem = direct_data(cpu, addr, 1);
+    if (mem && !cpu->tracer) {
+        *mem = byte;
+    }
+    else {
+        (void) cpu_store_data(cpu, addr, &byte, 1);
+    }
+}
+
+/*
+ * The stack grows down and SP points to the first free byte below it: a push
+ * stores at SP and then decrements it.
+ */
+static void stack_push(struct cpu *cpu, uint8_t byte)
+{
+    cpu_store_byte(cpu, cpu->sp, byte);
+    cpu->sp--;
+}
+
+static uint8_t stack_pop(struct cpu *cpu)
+{
+    cpu->sp++;
+    return cpu_load_byte(cpu, cpu->sp);
+}
+
+/*
+ * Push and pop return addresses as a single access. The low byte is pushed
+ * first, so the address is stored big-endian just above the new SP.
+ */
+static void stack_push_word(struct cpu *cpu, uint16_t word)
+{
+    cpu->sp -= 2;
+    cpu_store_word(cpu, cpu->sp + 1, word << 8 | word >> 8);
+}
+
+static uint16_t stack_pop_word(struct cpu *cpu)
+{
+    uint16_t word = cpu_load_word(cpu, cpu->sp + 1);
+
+    cpu->sp += 2;
+    return word << 8 | word >> 8;
+}
+
+/*
+ * The pointer registers X, Y and Z are the register pairs r27:r26, r29:r28
+ * and r31:r30, accessed as 16-bit values in place.
+ */
+static inline uint16_t pointer(struct cpu *cpu, enum base_pointer bp)
 {
-    cpu->sp -= size;
-    (void) cpu_store_data(cpu, cpu->sp, data, size);
+    uint16_t value;
+
+    memcpy(&value, &REG(26 + 2 * bp), 2);
+    return value;
 }
 
-static void stack_pop(struct cpu *cpu, void *data, int size)
+static inline void set_pointer(struct cpu *cpu, enum base_pointer bp,
+                               uint16_t value)
 {
-    (void) cpu_load_data(cpu, cpu->sp, data, size);
-    cpu->sp += size;
+    memcpy(&REG(26 + 2 * bp), &value, 2);
 }
 
 /*
@@ -107,427 +513,1715 @@ static int fetch_instruction(struct cpu *cpu, uint16_t *opcode)
     }
 }
 
-void cpu_cycle(struct cpu *cpu)
+static void resolve_handler(struct cpu *cpu, struct icache_entry *entry);
+
+/*
+ * Returns the decoded instruction at program counter pc, decoding it on
+ * a cache miss. Returns NULL on flash bus error.
+ */
+static const struct icache_entry *fetch_decoded(struct cpu *cpu, uint16_t pc)
 {
+    struct icache_entry *entry;
     uint16_t opcode[2];
-    uint16_t R = 0;
+    uint16_t saved_pc;
     int rc;
 
-    if (!cpu->is_executing_inst) {
-        /* Fetch next instruction. */
-        rc = fetch_instruction(cpu, opcode);
-        if (FAILED(rc)) {
-            // flash bus error
+    if (pc < cpu->icache_size) {
+        entry = &cpu->icache[pc];
+        if (entry->length) {
+            return entry;
         }
+    }
+    if (pc >= cpu->icache_size || cpu->icache_shared) {
+        entry = &cpu->uncached;
+    }
 
-        /* Update program counter. */
-        cpu->pc += rc;
-
-        /* Decode instruction. */
-        rc = decode_instruction(opcode, &cpu->current_inst);
-        if (FAILED(rc)) {
-            // decode error
-        }
+    saved_pc = cpu->pc;
+    cpu->pc = pc;
+    rc = fetch_instruction(cpu, opcode);
+    cpu->pc = saved_pc;
+    if (FAILED(rc)) {
+        warn("fetching instruction failed with code %d\n", rc);
+        return NULL;
     }
 
-    /* Execute. */
-    cpu->is_executing_inst = 1;
+    if (FAILED(decode_instruction(opcode, &entry->inst))) {
+        /* Not an operation: exec_unimplemented() stops at it if it is run. */
+        entry->inst.op = OPERATION_COUNT;
+    }
+    entry->length = rc;
+    entry->cycles = instruction_cycles(&entry->inst, cpu->core, cpu->pc_width);
+    resolve_handler(cpu, entry);
 
-    debug("cpu->current_inst.op = %d\n", cpu->current_inst.op);
-    switch (cpu->current_inst.op) {
-    case OP_ADC:
-        R += SREG.C;
-        /* fallthrough */
-    case OP_ADD:
-        R += Rd + Rr;
+    return entry;
+}
 
-        /* H <=> there was a carry from bit 3. */
-        SREG.H = BITVAL(Rd, 3) && BITVAL(Rr, 3) ||
-                 BITVAL(Rr, 3) && !BITVAL(R, 3) ||
-                 !BITVAL(R, 3) && BITVAL(Rd, 3);
-        /* V <=> two's complement overflow resulted from the operation. */
-        SREG.V = BITVAL(Rd, 7) && BITVAL(Rr, 7) && !BITVAL(R, 7) ||
-                 !BITVAL(Rd, 7) && !BITVAL(Rr, 7) && BITVAL(R, 7);
-        /* N <=> MSB of the result is set. */
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        /* C <=> there was a carry from the MSB of the result. */
-        SREG.C = BITVAL(Rd, 7) && BITVAL(Rr, 7) ||
-                 BITVAL(Rr, 7) && !BITVAL(R, 7) ||
-                 !BITVAL(R, 7) && BITVAL(Rd, 7);
-        Rd = R;
-        break;
+void cpu_invalidate_icache(struct cpu *cpu, unsigned addr, unsigned size)
+{
+    unsigned first, last;
 
-    case OP_ADIW:
-        R = (int)Rd + K;
+    if (size == 0) {
+        return;
+    }
 
-        /* V <=> two's complement overflow resulted from the operation. */
-        SREG.V = BITVAL(R, 15) && !BITVAL(1[&Rd], 7);
-        /* N <=> MSB of the result is set. */
-        SREG.N = BITVAL(R, 15);
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        SREG.C = !BITVAL(R, 15) && BITVAL(1[&Rd], 7);
+    /* A two-word instruction may start one word before the modified area. */
+    first = addr / 2;
+    first = first > 0 ? first - 1 : 0;
+    last = (addr + size - 1) / 2;
 
-        memcpy(&Rd, &R, 2);
-        break;
+    for (unsigned i = first; i <= last && i < cpu->icache_size; ++i) {
+        cpu->icache[i].length = 0;
+    }
+}
 
-    case OP_AND:
-    case OP_ANDI:
-        if (cpu->current_inst.op == OP_AND) {
-            R = Rd & Rr;
-        }
-        else {
-            R = Rd & K;
-        }
-        SREG.V = 0;
-        /* N <=> MSB of the result is set. */
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        Rd = R;
-        break;
+void cpu_fill_icache(struct cpu *cpu)
+{
+    struct instruction inst;
+    uint16_t opcode[2] = { 0, 0 };
 
-    case OP_ASR:
-        R = Rd >> 1;
-        R |= Rd & BIT2MASK(7); /* bit 7 is held constant. */
-        SREG.C = Rd & 1; /* Bit 0 is loaded into the C flag. */
-        /* N <=> MSB of the result is set. */
-        SREG.N = BITVAL(R, 7);
-        SREG.V = SREG.N ^ SREG.C;
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        Rd = R;
-        break;
-    case OP_BCLR:
-        /* CLC, CLH, CLI, CLN, CLS, CLT, CLV and CLZ are handled here. */
-        BITCLR(*(unsigned char *)&SREG, s);
-        break;
-    case OP_BLD:
-        if (SREG.T) {
-            BITSET(Rd, b);
-        }
-        else {
-            BITCLR(Rd, b);
-        }
-        break;
-    case OP_BRBC:
-        if (BITVAL(*(unsigned char *)&SREG, s) == 0) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRBS:
-        if (BITVAL(*(unsigned char *)&SREG, s) == 1) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRCC:
-        if (!SREG.C) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRCS:
-        if (SREG.C) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BREQ:
-        if (SREG.Z) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRGE:
-        if (!SREG.S) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRHC:
-        if (!SREG.H) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRHS:
-        if (SREG.H) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRID:
-        if (!SREG.I) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRIE:
-        if (SREG.I) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRLO:
-        if (SREG.C) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRLT:
-        if (SREG.S) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRMI:
-        if (SREG.N) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRNE:
-        if (!SREG.Z) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRSH:
-        if (!SREG.C) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRTC:
-        if (!SREG.T) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRTS:
-        if (SREG.T) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRVC:
-        if (!SREG.V) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BRVS:
-        if (SREG.V) {
-            cpu->pc += k;
-        }
-        break;
-    case OP_BSET:
-        /* SEC, SEH, SEI, SEN, SES, SET, SEV and SEZ are handled here. */
-        BITSET(*(unsigned char *)&SREG, s);
-        if (s == 7) {
-            /* NOTE: This is the interrupt flag. The following instruction is
-             to be executed before any pending interrupt. */
+    for (unsigned pc = 0; pc < cpu->icache_size; ++pc) {
+        if (cpu->icache[pc].length) {
+            continue;
         }
-        break;
-    case OP_BST:
-        SREG.T = BITVAL(Rd, b);
-        break;
 
-    case OP_CALL:
-        stack_push(cpu, &cpu->pc, 2);
-        /* fallthrough */
-    case OP_JMP:
-        cpu->pc = k;
-        break;
-    case OP_CBI:
-        /* Clear bit b at I/O address specified by A. */
-        cpu_io_out(cpu, A, cpu_io_in(cpu, A) & ~BIT2MASK(b));
-        break;
-    case OP_COM:
-        R = 0xff - Rd;
-        SREG.V = 0;
-        SREG.C = 1;
-        SREG.N = BITVAL(R, 7);
-        SREG.Z = R == 0;
-        SREG.S = SREG.N ^ SREG.V;
-        Rd = R;
-        break;
-    case OP_CPC:
-        R = SREG.C;
-        goto case_OP_CP;
-    case OP_CPI:
-        Rr = K;/*bug*/
-        goto case_OP_CP;
-    case OP_CP:
-case_OP_CP:
-        R = (uint8_t)(Rd - Rr - R);
-        SREG.Z = R == 0;
-        SREG.H = !BITVAL(Rd, 3) && BITVAL(Rr, 3) ||
-                 BITVAL(Rr, 3) && BITVAL(R, 3) ||
-                 BITVAL(R, 3) && !BITVAL(Rd, 3);
-        SREG.N = BITVAL(R, 7);
-        /* V <=> two's complement overflow resulted from the operation. */
-        SREG.V = BITVAL(Rd, 7) && !BITVAL(Rr, 7) && !BITVAL(R, 7) ||
-                 !BITVAL(Rd, 7) && BITVAL(Rr, 7) && BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
         /*
-         * CP: C <=> absolute value of the contents of Rr is larger than the
-         *       absolute value of Rd.
-         * CPC: C <=> absolute value of the contents of Rr plus previous carry
-         *        is larger than the absolute value of Rd.
-         * CPI: C <=> absolute value of K is larger than the absolute value
-         *        of Rd.
+         * Words that do not start a legal instruction, such as data, are
+         * left to be decoded and reported if they are ever executed.
          */
-        SREG.C = !BITVAL(Rd, 7) && BITVAL(Rr, 7) ||
-                 BITVAL(Rr, 7) && BITVAL(R, 7) ||
-                 BITVAL(R, 7) && !BITVAL(Rd, 7);
-        break;
+        if (FAILED(cpu->flash_bus->read(cpu->mcu, pc * 2, &opcode[0], 2)) ||
+            pc + opcode_length(opcode[0]) > cpu->icache_size ||
+            FAILED(decode_instruction(opcode, &inst))) {
+            continue;
+        }
+        (void) fetch_decoded(cpu, pc);
+    }
+}
 
-    case OP_CPSE:
-        if (Rd == Rr) {
-            uint16_t opcode[2];
-            int next_opcode_len;
+int cpu_set_breakpoint(struct cpu *cpu, uint16_t pc, _Bool enable)
+{
+    struct icache_entry *entry;
 
-            /* Skip next instruction */
-            next_opcode_len = fetch_instruction(cpu, opcode);
-            if (!FAILED(next_opcode_len)) {
-                cpu->pc += next_opcode_len;
-            }
-            else {
-                debug("fetch_instruction failure at OP_CPSE.\n");
-            }
-        }
-        break;
+    if (pc >= cpu->icache_size || cpu->icache_shared) {
+        return -1;
+    }
 
-    case OP_DEC:
-        R = (uint8_t)(Rd - 1);
-        /* V <=> two's complement overflow resulted from the operation. */
-        SREG.V = Rd == 0x80;
-        SREG.Z = R == 0;
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        Rd = R;
+    entry = &cpu->icache[pc];
+    entry->breakpoint = enable;
+    if (entry->length) {
+        resolve_handler(cpu, entry);
+    }
+
+    return 0;
+}
+
+/*
+ * Make cpu_run() return with the given reason at the end of the current
+ * basic block, unless it is already stopping for another reason.
+ */
+static void cpu_stop(struct cpu *cpu, enum cpu_stop_reason reason)
+{
+    if (cpu->stop_reason == CPU_STOP_NONE) {
+        cpu->stop_reason = reason;
+    }
+    cpu->run_until = 0;
+}
+
+void cpu_request_stop(struct cpu *cpu, enum cpu_stop_reason reason)
+{
+    cpu_stop(cpu, reason);
+}
+
+void cpu_set_deadline(struct cpu *cpu, uint64_t cycle)
+{
+    if (cycle < cpu->run_end) {
+        cpu->run_end = cycle;
+    }
+    if (cycle < cpu->run_until) {
+        cpu->run_until = cycle;
+    }
+}
+
+void cpu_set_irq(struct cpu *cpu, unsigned vector, _Bool pending)
+{
+    uint64_t mask = (uint64_t) 1 << vector;
+
+    if (!pending) {
+        cpu->irq_pending &= ~mask;
+    }
+    else if (!(cpu->irq_pending & mask)) {
+        cpu->irq_pending |= mask;
+        if (cpu->sreg.I) {
+            /* Have run() return so that the interrupt is taken. */
+            cpu->run_until = 0;
+        }
+    }
+}
+
+/*
+ * Instruction handlers. A handler is called after the program counter has
+ * been advanced past the instruction it executes.
+ */
+#define Rd REG(inst->Rd)
+#define Rr REG(inst->Rr)
+#define A inst->A
+#define K inst->K
+#define k inst->k
+#define s inst->s
+#define b inst->b
+
+/* Take a relative branch, which costs one cycle more than not taking it. */
+static void branch(struct cpu *cpu, int32_t offset)
+{
+    cpu->pc += offset;
+    cpu->cycle_count++;
+}
+
+/*
+ * Skip the next instruction. This costs one extra cycle per word skipped.
+ */
+static void skip_next(struct cpu *cpu)
+{
+    const struct icache_entry *next;
+
+    next = fetch_decoded(cpu, cpu->pc);
+    if (next) {
+        cpu->pc += next->length;
+        cpu->cycle_count += next->length;
+    }
+    else {
+        debug("fetch_decoded failure while skipping.\n");
+    }
+}
+
+/* ADD and ADC: Rd <- Rd + Rr + carry. */
+static void add(struct cpu *cpu, const struct instruction *inst, uint8_t carry)
+{
+    uint16_t R = carry;
+
+    R += Rd + Rr;
+    set_flags(cpu, FLAGS_ADD, Rd, Rr, R);
+    Rd = R;
+}
+
+static void exec_adc(struct cpu *cpu, const struct instruction *inst)
+{
+    add(cpu, inst, flag_C(cpu));
+}
+
+static void exec_add(struct cpu *cpu, const struct instruction *inst)
+{
+    add(cpu, inst, 0);
+}
+
+static void exec_adiw(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t R;
+
+    memcpy(&R, &Rd, 2);
+    R += K;
+    set_flags(cpu, FLAGS_ADIW, 1[&Rd], 0, R);
+    memcpy(&Rd, &R, 2);
+}
+
+/* AND and ANDI: Rd <- Rd & mask. */
+static void and(struct cpu *cpu, const struct instruction *inst, uint8_t mask)
+{
+    uint8_t R = Rd & mask;
+
+    set_flags(cpu, FLAGS_LOGIC, Rd, mask, R);
+    Rd = R;
+}
+
+static void exec_and(struct cpu *cpu, const struct instruction *inst)
+{
+    and(cpu, inst, Rr);
+}
+
+static void exec_andi(struct cpu *cpu, const struct instruction *inst)
+{
+    and(cpu, inst, K);
+}
+
+static void exec_asr(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd >> 1;
+
+    R |= Rd & BIT2MASK(7); /* bit 7 is held constant. */
+    SREG.C = Rd & 1; /* Bit 0 is loaded into the C flag. */
+    /* N <=> MSB of the result is set. */
+    SREG.N = BITVAL(R, 7);
+    SREG.V = SREG.N ^ SREG.C;
+    SREG.S = SREG.N ^ SREG.V;
+    SREG.Z = R == 0;
+    Rd = R;
+}
+
+static void exec_bclr(struct cpu *cpu, const struct instruction *inst)
+{
+    /* CLC, CLH, CLI, CLN, CLS, CLT, CLV and CLZ are handled here. */
+    BITCLR(*(unsigned char *)&SREG, s);
+}
+
+static void exec_bld(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.T) {
+        BITSET(Rd, b);
+    }
+    else {
+        BITCLR(Rd, b);
+    }
+}
+
+static void exec_brbc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (BITVAL(*(unsigned char *)&SREG, s) == 0) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brbs(struct cpu *cpu, const struct instruction *inst)
+{
+    if (BITVAL(*(unsigned char *)&SREG, s) == 1) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brcc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!flag_C(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brcs(struct cpu *cpu, const struct instruction *inst)
+{
+    if (flag_C(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_break(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu_stop(cpu, CPU_STOP_BREAK);
+}
+
+static void exec_breq(struct cpu *cpu, const struct instruction *inst)
+{
+    if (flag_Z(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brge(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!SREG.S) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brhc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!SREG.H) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brhs(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.H) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brid(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!SREG.I) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brie(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.I) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brlo(struct cpu *cpu, const struct instruction *inst)
+{
+    if (flag_C(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brlt(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.S) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brmi(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.N) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brne(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!flag_Z(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brsh(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!flag_C(cpu)) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brtc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!SREG.T) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brts(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.T) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brvc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!SREG.V) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_brvs(struct cpu *cpu, const struct instruction *inst)
+{
+    if (SREG.V) {
+        branch(cpu, k);
+    }
+}
+
+static void exec_bset(struct cpu *cpu, const struct instruction *inst)
+{
+    /* SEC, SEH, SEI, SEN, SES, SET, SEV and SEZ are handled here. */
+    if (s == 7 && !cpu->sreg.I) {
+        /* SEI: the following instruction is executed before any pending
+         interrupt. */
+        enable_interrupts(cpu);
+    }
+    BITSET(*(unsigned char *)&SREG, s);
+}
+
+static void exec_bst(struct cpu *cpu, const struct instruction *inst)
+{
+    SREG.T = BITVAL(Rd, b);
+}
+
+static void exec_call(struct cpu *cpu, const struct instruction *inst)
+{
+    stack_push_word(cpu, cpu->pc);
+    cpu->pc = k;
+}
+
+static void exec_cbi(struct cpu *cpu, const struct instruction *inst)
+{
+    /* Clear bit b at I/O address specified by A. */
+    if (BITVAL(cpu->io_bus->strobe_registers, A)) {
+        cpu_io_out(cpu, A, 0);
+    }
+    else {
+        cpu_io_out(cpu, A, cpu_io_in(cpu, A) & ~BIT2MASK(b));
+    }
+}
+
+static void exec_com(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = 0xff - Rd;
+
+    set_flags(cpu, FLAGS_COM, Rd, 0, R);
+    Rd = R;
+}
+
+/* CP, CPC and CPI: compare rd with rr + carry. */
+static void compare(struct cpu *cpu, uint8_t rd, uint8_t rr, uint8_t carry)
+{
+    uint8_t R = rd - rr - carry;
+
+    set_flags(cpu, FLAGS_COMPARE, rd, rr, R);
+}
+
+static void exec_cp(struct cpu *cpu, const struct instruction *inst)
+{
+    compare(cpu, Rd, Rr, 0);
+}
+
+static void exec_cpc(struct cpu *cpu, const struct instruction *inst)
+{
+    compare(cpu, Rd, Rr, flag_C(cpu));
+}
+
+static void exec_cpi(struct cpu *cpu, const struct instruction *inst)
+{
+    compare(cpu, Rd, K, 0);
+}
+
+static void exec_cpse(struct cpu *cpu, const struct instruction *inst)
+{
+    if (Rd == Rr) {
+        skip_next(cpu);
+    }
+}
+
+static void exec_dec(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd - 1;
+
+    set_flags(cpu, FLAGS_DEC, Rd, 0, R);
+    Rd = R;
+}
+
+static void exec_eor(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd ^ Rr;
+
+    set_flags(cpu, FLAGS_LOGIC, Rd, Rr, R);
+    Rd = R;
+}
+
+/* MUL family: R1:R0 <- product, shifted left once if fractional. */
+static void multiply(struct cpu *cpu, uint16_t R, _Bool fractional)
+{
+    SREG.C = BITVAL(R, 15);
+    if (fractional) {
+        R <<= 1;
+    }
+    SREG.Z = R == 0;
+    /* Store in R1:R0. */
+    memcpy(&REG(0), &R, 2);
+}
+
+static void exec_fmul(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, Rd * Rr, 1);
+}
+
+static void exec_fmuls(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, (int8_t)Rd * (int8_t)Rr, 1);
+}
+
+static void exec_fmulsu(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, (int8_t)Rd * Rr, 1);
+}
+
+static void exec_icall(struct cpu *cpu, const struct instruction *inst)
+{
+    stack_push_word(cpu, cpu->pc);
+    /* fixme: put bounds checking */
+    memcpy(&cpu->pc, &REG(30), 2);
+}
+
+static void exec_ijmp(struct cpu *cpu, const struct instruction *inst)
+{
+    /* fixme: put bounds checking */
+    memcpy(&cpu->pc, &REG(30), 2);
+}
+
+static void exec_in(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = cpu_io_in(cpu, A);
+}
+
+static void exec_inc(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd + 1;
+
+    set_flags(cpu, FLAGS_INC, Rd, 0, R);
+    Rd = R;
+}
+
+static void exec_jmp(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu->pc = k;
+}
+
+/*
+ * Returns the data address accessed by LD or ST through its pointer,
+ * pre-decrementing or post-incrementing the pointer.
+ */
+static uint16_t indirect_address(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t addr = pointer(cpu, inst->bp);
+
+    switch (inst->bp_operation) {
+    case BP_NO_OP:
         break;
+    case BP_PRE_DEC:
+        set_pointer(cpu, inst->bp, --addr);
+        break;
+    case BP_POST_INC:
+        set_pointer(cpu, inst->bp, addr + 1);
+        break;
+    }
+    return addr;
+}
+
+static void exec_ld(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t addr = indirect_address(cpu, inst);
+
+    Rd = cpu_load_byte(cpu, addr);
+}
+
+static void exec_ldd(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = cpu_load_byte(cpu, pointer(cpu, inst->bp) + inst->q);
+}
+
+static void exec_ldi(struct cpu *cpu, const struct instruction *inst)
+{
+    /* SER is handled here. */
+    Rd = K;
+}
+
+static void exec_lds(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = cpu_load_byte(cpu, k);
+}
+
+/* Returns the byte of program memory at Z. */
+static uint8_t load_program_byte(struct cpu *cpu)
+{
+    uint8_t byte = 0xff;
+
+    (void) cpu->flash_bus->read(cpu->mcu, pointer(cpu, BP_Z), &byte, 1);
+    return byte;
+}
+
+static void exec_lpm_r0(struct cpu *cpu, const struct instruction *inst)
+{
+    REG(0) = load_program_byte(cpu);
+}
+
+static void exec_lpm(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = load_program_byte(cpu);
+    if (inst->bp_operation == BP_POST_INC) {
+        set_pointer(cpu, BP_Z, pointer(cpu, BP_Z) + 1);
+    }
+}
+
+static void exec_lsr(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd >> 1;
+
+    SREG.C = Rd & 1;
+    SREG.N = 0;
+    SREG.V = SREG.V ^ SREG.C;
+    SREG.S = SREG.N ^ SREG.V;
+    SREG.Z = R == 0;
+    Rd = R;
+}
+
+static void exec_mov(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = Rr;
+}
+
+static void exec_movw(struct cpu *cpu, const struct instruction *inst)
+{
+    memmove(&Rd, &Rr, 2);
+}
+
+static void exec_mul(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, Rd * Rr, 0);
+}
+
+static void exec_muls(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, (int8_t)Rd * (int8_t)Rr, 0);
+}
+
+static void exec_mulsu(struct cpu *cpu, const struct instruction *inst)
+{
+    multiply(cpu, (int8_t)Rd * Rr, 0);
+}
+
+static void exec_neg(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t R = -Rd;
+
+    set_flags(cpu, FLAGS_NEG, Rd, 0, R);
+    Rd = R;
+}
+
+static void exec_nop(struct cpu *cpu, const struct instruction *inst)
+{
+}
+
+static void exec_or(struct cpu *cpu, const struct instruction *inst)
+{
+    uint8_t R = Rd | Rr;
+
+    set_flags(cpu, FLAGS_LOGIC, Rd, Rr, R);
+    Rd = R;
+}
+
+static void exec_out(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu_io_out(cpu, A, Rr);
+}
+
+static void exec_pop(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = stack_pop(cpu);
+}
+
+static void exec_push(struct cpu *cpu, const struct instruction *inst)
+{
+    stack_push(cpu, Rd);
+}
+
+static void exec_rcall(struct cpu *cpu, const struct instruction *inst)
+{
+    stack_push_word(cpu, cpu->pc);
+    cpu->pc += k;
+}
+
+static void exec_ret(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu->pc = stack_pop_word(cpu);
+}
+
+static void exec_reti(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu->pc = stack_pop_word(cpu);
+    /* One instruction of the interrupted code runs before the next
+     interrupt is taken. */
+    enable_interrupts(cpu);
+    SREG.I = 1;
+}
+
+static void exec_rjmp(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu->pc += k;
+}
+
+static void exec_sbiw(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t R;
+
+    memcpy(&R, &Rd, 2);
+    R -= K;
+    set_flags(cpu, FLAGS_SBIW, 1[&Rd], 0, R);
+    memcpy(&Rd, &R, 2);
+}
+
+static void exec_sbi(struct cpu *cpu, const struct instruction *inst)
+{
+    /* Set bit b at I/O address specified by A. */
+    if (BITVAL(cpu->io_bus->strobe_registers, A)) {
+        cpu_io_out(cpu, A, BIT2MASK(b));
+    }
+    else {
+        cpu_io_out(cpu, A, cpu_io_in(cpu, A) | BIT2MASK(b));
+    }
+}
+
+static void exec_sbic(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!BITVAL(cpu_io_in(cpu, A), b)) {
+        skip_next(cpu);
+    }
+}
+
+static void exec_sbis(struct cpu *cpu, const struct instruction *inst)
+{
+    if (BITVAL(cpu_io_in(cpu, A), b)) {
+        skip_next(cpu);
+    }
+}
+
+static void exec_sbrc(struct cpu *cpu, const struct instruction *inst)
+{
+    if (!BITVAL(Rd, b)) {
+        skip_next(cpu);
+    }
+}
+
+static void exec_sbrs(struct cpu *cpu, const struct instruction *inst)
+{
+    if (BITVAL(Rd, b)) {
+        skip_next(cpu);
+    }
+}
+
+static void exec_sleep(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu_stop(cpu, CPU_STOP_SLEEP);
+}
+
+static void exec_spm(struct cpu *cpu, const struct instruction *inst)
+{
+    /* The program counter has moved past SPM already. */
+    if (cpu->flash_bus->spm) {
+        cpu->flash_bus->spm(cpu->mcu, (cpu->pc - 1) * 2, pointer(cpu, BP_Z),
+                            REG(0) | REG(1) << 8);
+    }
+}
+
+static void exec_st(struct cpu *cpu, const struct instruction *inst)
+{
+    /* ST X+, r26 and the like store the pointer as it was. */
+    uint8_t value = Rr;
+
+    cpu_store_byte(cpu, indirect_address(cpu, inst), value);
+}
+
+static void exec_std(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu_store_byte(cpu, pointer(cpu, inst->bp) + inst->q, Rr);
+}
+
+static void exec_sts(struct cpu *cpu, const struct instruction *inst)
+{
+    cpu_store_byte(cpu, k, Rr);
+}
+
+static void exec_swap(struct cpu *cpu, const struct instruction *inst)
+{
+    Rd = (Rd << 4) | (Rd >> 4);
+}
+
+#undef Rd
+#undef Rr
+#undef A
+#undef K
+#undef k
+#undef s
+#undef b
+
+/*
+ * Operations the CPU executes, their handlers and whether the operation ends
+ * a basic block. cpu_run() checks whether it should return only after
+ * operations that end a basic block: those that may transfer control, stop
+ * the CPU or change the global interrupt enable bit.
+ */
+#define CPU_OPERATIONS(X)               \
+    X(OP_ADC,       exec_adc,       0)  \
+    X(OP_ADD,       exec_add,       0)  \
+    X(OP_ADIW,      exec_adiw,      0)  \
+    X(OP_AND,       exec_and,       0)  \
+    X(OP_ANDI,      exec_andi,      0)  \
+    X(OP_ASR,       exec_asr,       0)  \
+    X(OP_BCLR,      exec_bclr,      1)  \
+    X(OP_BLD,       exec_bld,       0)  \
+    X(OP_BRBC,      exec_brbc,      1)  \
+    X(OP_BRBS,      exec_brbs,      1)  \
+    X(OP_BRCC,      exec_brcc,      1)  \
+    X(OP_BRCS,      exec_brcs,      1)  \
+    X(OP_BREAK,     exec_break,     1)  \
+    X(OP_BREQ,      exec_breq,      1)  \
+    X(OP_BRGE,      exec_brge,      1)  \
+    X(OP_BRHC,      exec_brhc,      1)  \
+    X(OP_BRHS,      exec_brhs,      1)  \
+    X(OP_BRID,      exec_brid,      1)  \
+    X(OP_BRIE,      exec_brie,      1)  \
+    X(OP_BRLO,      exec_brlo,      1)  \
+    X(OP_BRLT,      exec_brlt,      1)  \
+    X(OP_BRMI,      exec_brmi,      1)  \
+    X(OP_BRNE,      exec_brne,      1)  \
+    X(OP_BRSH,      exec_brsh,      1)  \
+    X(OP_BRTC,      exec_brtc,      1)  \
+    X(OP_BRTS,      exec_brts,      1)  \
+    X(OP_BRVC,      exec_brvc,      1)  \
+    X(OP_BRVS,      exec_brvs,      1)  \
+    X(OP_BSET,      exec_bset,      1)  \
+    X(OP_BST,       exec_bst,       0)  \
+    X(OP_CALL,      exec_call,      1)  \
+    X(OP_CBI,       exec_cbi,       0)  \
+    X(OP_COM,       exec_com,       0)  \
+    X(OP_CP,        exec_cp,        0)  \
+    X(OP_CPC,       exec_cpc,       0)  \
+    X(OP_CPI,       exec_cpi,       0)  \
+    X(OP_CPSE,      exec_cpse,      1)  \
+    X(OP_DEC,       exec_dec,       0)  \
+    X(OP_EOR,       exec_eor,       0)  \
+    X(OP_FMUL,      exec_fmul,      0)  \
+    X(OP_FMULS,     exec_fmuls,     0)  \
+    X(OP_FMULSU,    exec_fmulsu,    0)  \
+    X(OP_ICALL,     exec_icall,     1)  \
+    X(OP_IJMP,      exec_ijmp,      1)  \
+    X(OP_IN,        exec_in,        0)  \
+    X(OP_INC,       exec_inc,       0)  \
+    X(OP_JMP,       exec_jmp,       1)  \
+    X(OP_LD,        exec_ld,        0)  \
+    X(OP_LDD,       exec_ldd,       0)  \
+    X(OP_LDI,       exec_ldi,       0)  \
+    X(OP_LDS,       exec_lds,       0)  \
+    X(OP_LPM_R0,    exec_lpm_r0,    0)  \
+    X(OP_LPM,       exec_lpm,       0)  \
+    X(OP_LSR,       exec_lsr,       0)  \
+    X(OP_MOV,       exec_mov,       0)  \
+    X(OP_MOVW,      exec_movw,      0)  \
+    X(OP_MUL,       exec_mul,       0)  \
+    X(OP_MULS,      exec_muls,      0)  \
+    X(OP_MULSU,     exec_mulsu,     0)  \
+    X(OP_NEG,       exec_neg,       0)  \
+    X(OP_NOP,       exec_nop,       0)  \
+    X(OP_OR,        exec_or,        0)  \
+    X(OP_OUT,       exec_out,       1)  \
+    X(OP_POP,       exec_pop,       0)  \
+    X(OP_PUSH,      exec_push,      0)  \
+    X(OP_RCALL,     exec_rcall,     1)  \
+    X(OP_RET,       exec_ret,       1)  \
+    X(OP_RETI,      exec_reti,      1)  \
+    X(OP_RJMP,      exec_rjmp,      1)  \
+    X(OP_SBI,       exec_sbi,       0)  \
+    X(OP_SBIC,      exec_sbic,      1)  \
+    X(OP_SBIS,      exec_sbis,      1)  \
+    X(OP_SBIW,      exec_sbiw,      0)  \
+    X(OP_SBRC,      exec_sbrc,      1)  \
+    X(OP_SBRS,      exec_sbrs,      1)  \
+    X(OP_SLEEP,     exec_sleep,     1)  \
+    X(OP_SPM,       exec_spm,       1)  \
+    X(OP_ST,        exec_st,        0)  \
+    X(OP_STD,       exec_std,       0)  \
+    X(OP_STS,       exec_sts,       0)  \
+    X(OP_SWAP,      exec_swap,      0)
+
+/*
+ * Straight-line code is split into basic blocks of at most this many words,
+ * which bounds how far cpu_run() may overrun its budget.
+ */
+#define MAX_BLOCK_WORDS 32
+
+/* Pseudo operations dispatched to, numbered after the real operations. */
+enum {
+    DISPATCH_UNIMPLEMENTED = OPERATION_COUNT,
+    DISPATCH_BREAKPOINT,
+    DISPATCH_BLOCK_LIMIT, /* Real operation that ends a block by its position */
+    DISPATCH_LOOP, /* Branch that closes a loop whose iterations may be skipped */
+    DISPATCH_COUNT
+};
+
+/* Handlers of the real operations. */
+static const instruction_handler handlers[OPERATION_COUNT] = {
+#define X(op, handler, ends_block) [op] = handler,
+    CPU_OPERATIONS(X)
+#undef X
+};
+
+static const _Bool op_ends_block[OPERATION_COUNT] = {
+#define X(op, handler, ends_block) [op] = ends_block,
+    CPU_OPERATIONS(X)
+#undef X
+};
+
+static int step(struct cpu *cpu);
+
+/*
+ * Busy-wait loops. A conditional branch back over at most LOOP_MAX_WORDS
+ * words of code that only changes registers closes a loop that may be run
+ * without executing each iteration: a delay loop counting a register down to
+ * zero, or a loop that keeps coming back to the same state until something
+ * it reads from I/O changes.
+ */
+#define LOOP_MAX_WORDS 8
+
+enum loop_kind {
+    LOOP_NONE,
+    LOOP_DELAY, /* DEC Rd or SBIW Rd,1 and NOPs, closed by BRNE */
+    LOOP_POLL   /* Register operations including IN or LDS, or none */
+};
+
+static _Bool is_branch(enum operation op)
+{
+    switch (op) {
+    case OP_BRBC: case OP_BRBS: case OP_BRCC: case OP_BRCS: case OP_BREQ:
+    case OP_BRGE: case OP_BRHC: case OP_BRHS: case OP_BRID: case OP_BRIE:
+    case OP_BRLO: case OP_BRLT: case OP_BRMI: case OP_BRNE: case OP_BRPL:
+    case OP_BRSH: case OP_BRTC: case OP_BRTS: case OP_BRVC: case OP_BRVS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Returns the kind of loop closed by the branch or RJMP at pc, whose target
+ * is stored in start. For a delay loop, counter is set to the decrementing
+ * instruction.
+ */
+static enum loop_kind loop_kind(struct cpu *cpu, uint16_t pc, uint16_t *start,
+                                const struct icache_entry **counter)
+{
+    const struct instruction *closer = &cpu->icache[pc].inst;
+    unsigned counters = 0, others = 0, reads = 0;
+    unsigned addr;
+
+    if (!is_branch(closer->op) && closer->op != OP_RJMP || closer->k >= 0 ||
+        -closer->k - 1 > LOOP_MAX_WORDS) {
+        return LOOP_NONE;
+    }
+
+    *start = pc + 1 + closer->k;
+    for (addr = *start; addr < pc; addr += cpu->icache[addr].length) {
+        const struct icache_entry *entry = &cpu->icache[addr];
+
+        /* Skipped iterations must not pass a breakpoint or a block end. */
+        if (!entry->length || entry->breakpoint ||
+            addr % MAX_BLOCK_WORDS == MAX_BLOCK_WORDS - 1 ||
+            entry->inst.op >= OPERATION_COUNT || !handlers[entry->inst.op]) {
+            return LOOP_NONE;
+        }
+
+        switch (entry->inst.op) {
+        case OP_NOP:
+            break;
+        case OP_DEC:
+        case OP_SBIW:
+            if (entry->inst.op == OP_DEC || entry->inst.K == 1) {
+                *counter = entry;
+                counters++;
+            }
+            else {
+                others++;
+            }
+            break;
+        case OP_IN:
+        case OP_LDS:
+            reads++;
+            others++;
+            break;
+        case OP_ADC: case OP_ADD: case OP_ADIW: case OP_AND: case OP_ANDI:
+        case OP_ASR: case OP_BLD: case OP_BST: case OP_COM: case OP_CP:
+        case OP_CPC: case OP_CPI: case OP_EOR: case OP_INC:
+        case OP_LDI: case OP_LSR: case OP_MOV: case OP_MOVW: case OP_NEG:
+        case OP_OR: case OP_ORI: case OP_ROR: case OP_SBC: case OP_SBCI:
+        case OP_SUB: case OP_SUBI: case OP_SWAP:
+            others++;
+            break;
+        default:
+            return LOOP_NONE;
+        }
+    }
+    if (addr != pc) {
+        return LOOP_NONE;
+    }
 
-    case OP_EOR:
-        R = Rd ^ Rr;
-        SREG.V = 0;
-        SREG.Z = R == 0;
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        Rd = R;
-        break;
+    if (counters == 1 && others == 0 &&
+        (closer->op == OP_BRNE || closer->op == OP_BRBC && closer->s == 1)) {
+        return LOOP_DELAY;
+    }
+    /*
+     * Other loops only come back to the same state if they wait for input,
+     * or spin on a branch to itself. Trying every loop would slow down
+     * those that compute.
+     */
+    if (reads > 0 || *start == pc) {
+        return LOOP_POLL;
+    }
+    return LOOP_NONE;
+}
 
-    case OP_FMUL:
-        R = Rd * Rr;
-        SREG.C = BITVAL(R, 15);
-        R <<= 1;
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
-        break;
-    case OP_FMULS:
-        R = (int8_t)Rd * (int8_t)Rr;
-        SREG.C = BITVAL(R, 15);
-        R <<= 1;
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
-        break;
-    case OP_FMULSU:
-        R = (int8_t)Rd * Rr;
-        SREG.C = BITVAL(R, 15);
-        R <<= 1;
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
+/* Returns the cycles an iteration takes if the branch at pc is taken. */
+static uint64_t loop_period(struct cpu *cpu, uint16_t start, uint16_t pc)
+{
+    uint64_t cycles = 0;
 
-    case OP_ICALL:
-        stack_push(cpu, &cpu->pc, 2);
-        /* fallthrough */
-    case OP_IJMP:
-        /* fixme: put bounds checking */
-        memcpy(&cpu->pc, &REG(30), 2);
-        break;
+    for (unsigned addr = start; addr <= pc; addr += cpu->icache[addr].length) {
+        cycles += cpu->icache[addr].cycles;
+    }
+    /* A taken branch takes a cycle more; RJMP always jumps. */
+    return cycles + (cpu->icache[pc].inst.op != OP_RJMP);
+}
 
-    case OP_IN:
-        Rd = cpu_io_in(cpu, A);
-        break;
+/* Returns the number of iterations of period cycles until run_until. */
+static uint64_t iterations_left(struct cpu *cpu, uint64_t period)
+{
+    return (cpu->run_until - cpu->cycle_count + period - 1) / period;
+}
 
-    case OP_INC:
-        R = (uint8_t)(Rd + 1);
-        SREG.V = Rd == 0x7f;
-        SREG.Z = R == 0;
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        Rd = R;
-        break;
+/*
+ * Run the iterations of a delay loop but the last, as far as the budget
+ * allows, by decrementing its counter at once.
+ */
+static void skip_delay(struct cpu *cpu, uint16_t start, uint16_t pc,
+                       const struct icache_entry *counter)
+{
+    const struct instruction *inst = &counter->inst;
+    uint8_t *reg = &REG(inst->Rd);
+    uint64_t period = loop_period(cpu, start, pc);
+    uint64_t n = iterations_left(cpu, period);
+    uint16_t value = *reg;
 
-    case OP_LD:
-        break;
+    if (inst->op == OP_SBIW) {
+        memcpy(&value, reg, 2);
+    }
+    /* The branch was taken, so value is not zero. */
+    if (n > value - 1u) {
+        n = value - 1u;
+    }
+    if (n == 0) {
+        return;
+    }
 
-    case OP_LDD:
-        break;
+    /* Set the flags by the last decrement skipped. */
+    value -= n - 1;
+    if (inst->op == OP_SBIW) {
+        memcpy(reg, &value, 2);
+    }
+    else {
+        *reg = value;
+    }
+    handlers[inst->op](cpu, inst);
+    cpu->cycle_count += n * period;
+}
 
-    case OP_LDI:
-        /* SER is handled here. */
-        Rd = K;
-        break;
+/*
+ * Run an iteration of a polling loop, and if it left the registers and SREG
+ * as they were, skip the iterations until an I/O register it reads may
+ * change, as far as the budget allows. SRAM it reads with LDS only changes
+ * in interrupt handlers, which are not entered before run_until.
+ */
+static void skip_poll(struct cpu *cpu, uint16_t start, uint16_t pc)
+{
+    uint8_t regs[32];
+    uint8_t sreg = cpu_read_sreg(cpu);
+    uint64_t begin = cpu->cycle_count;
+    uint64_t changes = UINT64_MAX;
+    uint64_t period, n;
 
-    case OP_LSR:
-        R = Rd >> 1;
-        SREG.C = Rd & 1;
-        SREG.N = 0;
-        SREG.V = SREG.V ^ SREG.C;
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        Rd = R;
-        break;
+    memcpy(regs, cpu->reg_file, sizeof(regs));
+    do {
+        step(cpu);
+    } while (cpu->pc != start && cpu->pc >= start && cpu->pc <= pc);
 
-    case OP_MOV:
-        Rd = Rr;
-        break;
-    case OP_MOVW:
-        memmove(&Rd, &Rr, 2);
-        break;
-    case OP_MUL:
-        R = Rd * Rr;
-        SREG.C = BITVAL(R, 15);
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
-        break;
-    case OP_MULS:
-        R = (int8_t)Rd * (int8_t)Rr;
-        SREG.C = BITVAL(R, 15);
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
-        break;
-    case OP_MULSU:
-        R = (int8_t)Rd * Rr;
-        SREG.C = BITVAL(R, 15);
-        SREG.Z = R == 0;
-        /* Store in R1:R0. */
-        memcpy(&REG(0), &R, 2);
-        break;
-    case OP_NEG:
-        R = -Rd;
-        SREG.H = BITVAL(R, 3) | BITVAL(Rd, 3);
-        /* V <=> two's complement overflow resulted from the operation. */
-        SREG.V = (R & 0xff) == 0x80;
-        /* N <=> MSB of the result is set. */
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        SREG.C = R != 0;
-        Rd = R;
-        break;
-    case OP_NOP:
-        break;
-    case OP_OR:
-        R = Rd | Rr;
-        SREG.V = 0;
-        SREG.N = BITVAL(R, 7);
-        SREG.S = SREG.N ^ SREG.V;
-        SREG.Z = R == 0;
-        Rd = R;
+    if (cpu->pc != start || cpu->cycle_count >= cpu->run_until ||
+        memcmp(regs, cpu->reg_file, sizeof(regs)) != 0 ||
+        cpu_read_sreg(cpu) != sreg) {
+        return;
+    }
+
+    for (unsigned addr = start; addr < pc; addr += cpu->icache[addr].length) {
+        const struct instruction *inst = &cpu->icache[addr].inst;
+        uint64_t t;
+
+        if (inst->op != OP_IN && inst->op != OP_LDS) {
+            continue;
+        }
+        if (!cpu->io_next_change) {
+            return;
+        }
+        t = cpu->io_next_change(cpu->mcu, inst->op == OP_IN ? inst->A + 0x20 :
+                                                              inst->k);
+        if (t < changes) {
+            changes = t;
+        }
+    }
+
+    period = cpu->cycle_count - begin;
+    n = iterations_left(cpu, period);
+    if (changes != UINT64_MAX) {
+        /* Every skipped read must come before the change. */
+        if (changes <= cpu->cycle_count) {
+            return;
+        }
+        if ((changes - cpu->cycle_count) / period < n) {
+            n = (changes - cpu->cycle_count) / period;
+        }
+    }
+    cpu->cycle_count += n * period;
+}
+
+/* A conditional branch or RJMP that closes a loop; see loop_kind(). */
+static void exec_loop(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t pc = cpu->pc - 1;
+    const struct icache_entry *counter = NULL;
+    uint16_t start;
+    uint8_t cycles = cpu->icache[pc].cycles;
+
+    handlers[inst->op](cpu, inst);
+    if (cpu->pc == pc + 1) {
+        return;
+    }
+
+    /* Work from the start of the next iteration, as run() will count. */
+    cpu->cycle_count += cycles;
+    if (cpu->cycle_count < cpu->run_until) {
+        switch (loop_kind(cpu, pc, &start, &counter)) {
+        case LOOP_DELAY:
+            skip_delay(cpu, start, pc, counter);
+            break;
+        case LOOP_POLL:
+            skip_poll(cpu, start, pc);
+            break;
+        case LOOP_NONE:
+            break;
+        }
+    }
+    cpu->cycle_count -= cycles;
+}
+
+/* Returns the cache entry that holds inst, which must be cached. */
+static inline struct icache_entry *cached_entry(const struct instruction *inst)
+{
+    return (struct icache_entry *) ((char *) inst -
+                                    offsetof(struct icache_entry, inst));
+}
+
+/* Returns the pseudo or real operation the entry is dispatched to. */
+static unsigned dispatch_index(struct cpu *cpu, const struct icache_entry *entry)
+{
+    _Bool cached = entry >= cpu->icache &&
+                   entry < cpu->icache + cpu->icache_size;
+
+    if (entry->breakpoint) {
+        return DISPATCH_BREAKPOINT;
+    }
+    if (entry->inst.op >= OPERATION_COUNT || !handlers[entry->inst.op]) {
+        return DISPATCH_UNIMPLEMENTED;
+    }
+    if (!op_ends_block[entry->inst.op] &&
+        (!cached || (entry - cpu->icache) % MAX_BLOCK_WORDS == MAX_BLOCK_WORDS - 1)) {
+        return DISPATCH_BLOCK_LIMIT;
+    }
+    if (cached && !cpu->icache_shared) {
+        const struct icache_entry *counter;
+        uint16_t start;
+
+        if (loop_kind(cpu, entry - cpu->icache, &start, &counter) != LOOP_NONE) {
+            return DISPATCH_LOOP;
+        }
+    }
+    return entry->inst.op;
+}
+
+/*
+ * Fetch the instruction at the program counter and advance the program
+ * counter past it. Evaluates to NULL on flash bus error.
+ */
+static inline const struct icache_entry *next_instruction(struct cpu *cpu)
+{
+    const struct icache_entry *entry;
+
+    if (cpu->pc < cpu->icache_size && cpu->icache[cpu->pc].length) {
+        entry = &cpu->icache[cpu->pc];
+    }
+    else {
+        entry = fetch_decoded(cpu, cpu->pc);
+        if (!entry) {
+            return NULL;
+        }
+    }
+
+    trace("pc=0x%x op=%u\n", cpu->pc, entry->inst.op);
+    cpu->pc += entry->length;
+    cpu->current_inst = &entry->inst;
+
+    return entry;
+}
+
+/* Stop at a breakpoint before executing the instruction it is set on. */
+static void hit_breakpoint(struct cpu *cpu, const struct icache_entry *entry)
+{
+    cpu->pc -= entry->length;
+    cpu_stop(cpu, CPU_STOP_BREAKPOINT);
+}
+
+/*
+ * Stop at an illegal or reserved opcode, or an operation without a handler,
+ * leaving the program counter at it.
+ */
+static void exec_unimplemented(struct cpu *cpu, const struct instruction *inst)
+{
+    uint16_t opcode[2];
+
+    cpu->pc -= cached_entry(inst)->length;
+    if (inst->op < OPERATION_COUNT) {
+        warn("unimplemented instruction %s at 0x%x\n",
+             operation_name(inst->op), cpu->pc);
+    }
+    else if (!FAILED(fetch_instruction(cpu, opcode))) {
+        warn("illegal opcode 0x%x at 0x%x\n", opcode[0], cpu->pc);
+    }
+    cpu_stop(cpu, CPU_STOP_ERROR);
+}
+
+#if CPU_DISPATCH == CPU_DISPATCH_SWITCH
+
+static void resolve_handler(struct cpu *cpu, struct icache_entry *entry)
+{
+    entry->handler.index = dispatch_index(cpu, entry);
+}
+
+/* Execute instructions until a stop is requested at a basic block end. */
+static void run(struct cpu *cpu)
+{
+    const struct icache_entry *entry;
+
+    for (;;) {
+        entry = next_instruction(cpu);
+        if (!entry) {
+            cpu_stop(cpu, CPU_STOP_ERROR);
+            return;
+        }
+
+        switch (entry->handler.index) {
+#define X(op, handler, ends_block)                  \
+        case op:                                    \
+            handler(cpu, &entry->inst);             \
+            cpu->cycle_count += entry->cycles;      \
+            if (ends_block &&                       \
+                cpu->cycle_count >= cpu->run_until) { \
+                return;                             \
+            }                                       \
+            break;
+        CPU_OPERATIONS(X)
+#undef X
+        case DISPATCH_BREAKPOINT:
+            hit_breakpoint(cpu, entry);
+            return;
+        case DISPATCH_BLOCK_LIMIT:
+            handlers[entry->inst.op](cpu, &entry->inst);
+            cpu->cycle_count += entry->cycles;
+            if (cpu->cycle_count >= cpu->run_until) {
+                return;
+            }
+            break;
+        case DISPATCH_LOOP:
+            exec_loop(cpu, &entry->inst);
+            cpu->cycle_count += entry->cycles;
+            if (cpu->cycle_count >= cpu->run_until) {
+                return;
+            }
+            break;
+        default:
+            exec_unimplemented(cpu, &entry->inst);
+            cpu->cycle_count += entry->cycles;
+            if (cpu->cycle_count >= cpu->run_until) {
+                return;
+            }
+            break;
+        }
+    }
+}
+
+#elif CPU_DISPATCH == CPU_DISPATCH_CALL
+
+/* Handlers and block ends of the real and pseudo operations. */
+static const instruction_handler dispatch_handlers[DISPATCH_COUNT] = {
+#define X(op, handler, ends_block) [op] = handler,
+    CPU_OPERATIONS(X)
+#undef X
+    [DISPATCH_UNIMPLEMENTED] = exec_unimplemented,
+    [DISPATCH_BREAKPOINT] = NULL, /* handled by run() */
+    [DISPATCH_LOOP] = exec_loop,
+};
+
+static void resolve_handler(struct cpu *cpu, struct icache_entry *entry)
+{
+    unsigned index = dispatch_index(cpu, entry);
+
+    if (index == DISPATCH_BLOCK_LIMIT) {
+        entry->handler.func = handlers[entry->inst.op];
+        entry->ends_block = 1;
+    }
+    else {
+        entry->handler.func = dispatch_handlers[index];
+        entry->ends_block = index >= OPERATION_COUNT || op_ends_block[index];
+    }
+}
+
+/* Execute instructions until a stop is requested at a basic block end. */
+static void run(struct cpu *cpu)
+{
+    const struct icache_entry *entry;
+
+    for (;;) {
+        entry = next_instruction(cpu);
+        if (!entry) {
+            cpu_stop(cpu, CPU_STOP_ERROR);
+            return;
+        }
+        if (!entry->handler.func) {
+            hit_breakpoint(cpu, entry);
+            return;
+        }
+
+        entry->handler.func(cpu, &entry->inst);
+
+        cpu->cycle_count += entry->cycles;
+        if (entry->ends_block && cpu->cycle_count >= cpu->run_until) {
+            return;
+        }
+    }
+}
+
+#elif CPU_DISPATCH == CPU_DISPATCH_THREADED
+
+/* Label addresses of run(), indexed by pseudo or real operation. */
+static const void *const *thread_labels;
+static pthread_once_t thread_labels_once = PTHREAD_ONCE_INIT;
+
+static void run(struct cpu *cpu);
+
+/* Let run() publish its labels without running anything. */
+static void publish_labels(void)
+{
+    run(NULL);
+}
+
+static void resolve_handler(struct cpu *cpu, struct icache_entry *entry)
+{
+    pthread_once(&thread_labels_once, publish_labels);
+
+    entry->handler.label = thread_labels[dispatch_index(cpu, entry)];
+}
+
+/*
+ * Execute instructions until a stop is requested at a basic block end.
+ * Each handler jumps directly to the handler of the next instruction instead
+ * of returning to a central dispatch point, and only handlers of operations
+ * that end a basic block check whether to stop.
+ */
+static void run(struct cpu *cpu)
+{
+    static const void *const labels[DISPATCH_COUNT] = {
+#define X(op, handler, ends_block) [op] = &&do_##op,
+        CPU_OPERATIONS(X)
+#undef X
+        [DISPATCH_UNIMPLEMENTED] = &&do_unimplemented,
+        [DISPATCH_BREAKPOINT] = &&do_breakpoint,
+        [DISPATCH_BLOCK_LIMIT] = &&do_block_limit,
+        [DISPATCH_LOOP] = &&do_loop,
+    };
+    const struct icache_entry *entry;
+
+    if (!cpu) {
+        thread_labels = labels;
+        return;
+    }
+
+#define DISPATCH()                                  \
+    do {                                            \
+        entry = next_instruction(cpu);              \
+        if (!entry) {                               \
+            cpu_stop(cpu, CPU_STOP_ERROR);          \
+            return;                                 \
+        }                                           \
+        goto *entry->handler.label;                 \
+    } while (0)
+
+    DISPATCH();
+
+#define X(op, handler, ends_block)                  \
+do_##op:                                            \
+    handler(cpu, &entry->inst);                     \
+    cpu->cycle_count += entry->cycles;              \
+    if (ends_block && cpu->cycle_count >= cpu->run_until) { \
+        return;                                     \
+    }                                               \
+    DISPATCH();
+    CPU_OPERATIONS(X)
+#undef X
+
+do_unimplemented:
+    exec_unimplemented(cpu, &entry->inst);
+    cpu->cycle_count += entry->cycles;
+    if (cpu->cycle_count >= cpu->run_until) {
+        return;
+    }
+    DISPATCH();
+
+do_breakpoint:
+    hit_breakpoint(cpu, entry);
+    return;
+
+do_block_limit:
+    handlers[entry->inst.op](cpu, &entry->inst);
+    cpu->cycle_count += entry->cycles;
+    if (cpu->cycle_count >= cpu->run_until) {
+        return;
+    }
+    DISPATCH();
+
+do_loop:
+    exec_loop(cpu, &entry->inst);
+    cpu->cycle_count += entry->cycles;
+    if (cpu->cycle_count >= cpu->run_until) {
+        return;
+    }
+    DISPATCH();
+
+#undef DISPATCH
+}
+
+#else
+#error "unknown CPU_DISPATCH"
+#endif
+
+/*
+ * Account an instruction executed at pc from cycle start in the profile,
+ * following calls and returns if it ends a basic block.
+ */
+static inline void profile_step(struct cpu *cpu, const struct instruction *inst,
+                                uint16_t pc, uint64_t start, _Bool ends_block)
+{
+    profile_instruction(cpu->profile, pc, cpu->cycle_count - start);
+    if (!ends_block) {
+        return;
+    }
+
+    switch (inst->op) {
+    case OP_RCALL:
+        /* RCALL .+0 only reserves stack space. */
+        if (inst->k == 0) {
+            break;
+        }
+        /* fall through */
+    case OP_CALL:
+    case OP_ICALL:
+    case OP_EICALL:
+        profile_call(cpu->profile, cpu->pc, cpu->sp, cpu->cycle_count);
         break;
-    case OP_SWAP:
-        Rd = (Rd << 4) | (Rd >> 4);
+    case OP_RET:
+    case OP_RETI:
+        profile_return(cpu->profile, cpu->sp, cpu->cycle_count);
         break;
     default:
-        warn("unimplemented instruction\n");
         break;
     }
+}
+
+/*
+ * Execute one instruction, ignoring any breakpoint set on it. Returns 0, or
+ * a negative value if the instruction could not be fetched.
+ */
+static int step(struct cpu *cpu)
+{
+    const struct icache_entry *entry;
+    instruction_handler handler = NULL;
+    uint16_t pc = cpu->pc;
+    uint64_t start = cpu->cycle_count;
+
+    /* This is the instruction after SEI or RETI, if any, or a later one. */
+    cpu->irq_delayed = 0;
+    entry = next_instruction(cpu);
+    if (!entry) {
+        // flash bus error
+        cpu->cycle_count++;
+        return -1;
+    }
+
+    if (cpu->tracer) {
+        tracer_instruction(cpu->tracer, pc, entry->inst.op, entry->length,
+                           start);
+    }
+
+    if (entry->inst.op < OPERATION_COUNT) {
+        handler = handlers[entry->inst.op];
+    }
+    if (!handler) {
+        handler = exec_unimplemented;
+    }
+    handler(cpu, &entry->inst);
+    cpu->cycle_count += entry->cycles;
+    if (cpu->profile) {
+        profile_step(cpu, &entry->inst, pc, start, 1);
+    }
+    return 0;
+}
+
+/* Returns the index of the lowest set bit of mask, which must not be 0. */
+static inline unsigned lowest_bit(uint64_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(mask);
+#else
+    unsigned n = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/*
+ * Enter the handler of the pending interrupt with the highest priority,
+ * which must be enabled, unless it has to wait for the instruction after SEI
+ * or RETI. Returns 1 if the interrupt was taken.
+ */
+static int interrupt(struct cpu *cpu)
+{
+    unsigned vector;
+
+    if (cpu->irq_delayed) {
+        return 0;
+    }
+
+    vector = lowest_bit(cpu->irq_pending);
+    if (cpu->tracer) {
+        tracer_interrupt(cpu->tracer, vector, cpu->cycle_count);
+    }
+    stack_push_word(cpu, cpu->pc);
+    if (cpu->profile) {
+        profile_call(cpu->profile, PROFILE_IRQ | vector, cpu->sp,
+                     cpu->cycle_count);
+    }
+    SREG.I = 0;
+    cpu->pc = vector * cpu->irq_vector_words;
+    cpu->cycle_count += cpu->pc_width > 16 ? 5 : 4;
+    if (cpu->irq_ack) {
+        cpu->irq_ack(cpu->mcu, vector);
+    }
+    return 1;
+}
+
+void cpu_cycle(struct cpu *cpu)
+{
+    if (!cpu->is_executing_inst) {
+        uint64_t start = cpu->cycle_count;
+
+        /*
+         * Execute the whole instruction, or interrupt response, in its first
+         * cycle and spend the following calls waiting for its remaining
+         * cycles.
+         */
+        if (!cpu->irq_pending || !cpu->sreg.I || !interrupt(cpu)) {
+            step(cpu);
+        }
+        cpu->inst_cycles = cpu->cycle_count - start;
+        cpu->cycle_count = start;
+        cpu->cycle_count_inst_fetch = start;
+        cpu->is_executing_inst = 1;
+    }
 
-    /* TODO: simulate real instruction lengths */
-    cpu->is_executing_inst = 0;
     cpu->cycle_count++;
+    if (cpu->cycle_count - cpu->cycle_count_inst_fetch >= cpu->inst_cycles) {
+        cpu->is_executing_inst = 0;
+    }
+}
+
+/*
+ * Execute instructions one at a time, as run() would, for the tracer, the
+ * profiler and watchpoints. Handlers are called from a switch so that they
+ * are inlined whatever the dispatch method.
+ */
+static void run_stepped(struct cpu *cpu)
+{
+    const struct icache_entry *entry;
+    uint16_t pc;
+    uint64_t start;
+
+    while (cpu->stop_reason == CPU_STOP_NONE &&
+           cpu->cycle_count < cpu->run_until) {
+        pc = cpu->pc;
+        start = cpu->cycle_count;
+        if (pc < cpu->icache_size && cpu->icache[pc].breakpoint) {
+            cpu_stop(cpu, CPU_STOP_BREAKPOINT);
+            return;
+        }
+        cpu->irq_delayed = 0;
+        entry = next_instruction(cpu);
+        if (!entry) {
+            cpu_stop(cpu, CPU_STOP_ERROR);
+            return;
+        }
+        if (cpu->tracer) {
+            tracer_instruction(cpu->tracer, pc, entry->inst.op,
+                               entry->length, start);
+        }
+
+        switch (entry->inst.op) {
+#define X(op, handler, ends_block)                  \
+        case op:                                    \
+            handler(cpu, &entry->inst);             \
+            cpu->cycle_count += entry->cycles;      \
+            if (cpu->profile) {                     \
+                profile_step(cpu, &entry->inst, pc, start, ends_block); \
+            }                                       \
+            break;
+        CPU_OPERATIONS(X)
+#undef X
+        default:
+            exec_unimplemented(cpu, &entry->inst);
+            cpu->cycle_count += entry->cycles;
+            break;
+        }
+    }
+
+    if (cpu->profile) {
+        profile_update(cpu->profile, cpu->cycle_count);
+    }
+}
+
+enum cpu_stop_reason cpu_step(struct cpu *cpu)
+{
+    cpu->stop_reason = CPU_STOP_NONE;
+    if (!cpu->irq_pending || !cpu->sreg.I || !interrupt(cpu)) {
+        if (FAILED(step(cpu))) {
+            cpu_stop(cpu, CPU_STOP_ERROR);
+        }
+    }
+
+    return cpu->stop_reason == CPU_STOP_NONE ? CPU_STOP_BUDGET
+                                             : cpu->stop_reason;
+}
+
+enum cpu_stop_reason cpu_run(struct cpu *cpu, uint64_t max_cycles)
+{
+    cpu->stop_reason = CPU_STOP_NONE;
+    if (max_cycles == 0) {
+        return CPU_STOP_BUDGET;
+    }
+    cpu->run_end = cpu->cycle_count + max_cycles;
+    cpu->run_until = cpu->run_end;
+
+    /* Resume from a breakpoint by executing the instruction it is set on. */
+    if (cpu->pc < cpu->icache_size && cpu->icache[cpu->pc].breakpoint) {
+        step(cpu);
+    }
+
+    while (cpu->stop_reason == CPU_STOP_NONE &&
+           cpu->cycle_count < cpu->run_end) {
+        /*
+         * run() returns after SEI or RETI so that the next instruction runs
+         * by itself, and at a block end when an interrupt becomes pending.
+         */
+        if (cpu->irq_delayed) {
+            cpu->run_until = cpu->cycle_count + 1;
+            run_stepped(cpu);
+            continue;
+        }
+        if (cpu->irq_pending && cpu->sreg.I) {
+            interrupt(cpu);
+            continue;
+        }
+        cpu->run_until = cpu->run_end;
+        if (cpu->tracer || cpu->profile || cpu->watch) {
+            run_stepped(cpu);
+        }
+        else {
+            run(cpu);
+        }
+    }
+
+    return cpu->stop_reason == CPU_STOP_NONE ? CPU_STOP_BUDGET
+                                             : cpu->stop_reason;
 }
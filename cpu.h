@@ -15,8 +15,19 @@ struct flash_bus {
      */
     int (*read)(void *mcu, unsigned addr, void *data, unsigned size);
     int (*write)(void *mcu, unsigned addr, const void *data, unsigned size);
+
+    /*
+     * Called for SPM at byte address pc with the Z pointer z and data R1:R0,
+     * to do what the self-programming controller of the MCU is set up to
+     * do. May be NULL if the MCU cannot program itself.
+     */
+    void (*spm)(void *mcu, unsigned pc, uint16_t z, uint16_t data);
 };
 
+/* Size of a page in the data memory map of a data bus. */
+#define DATA_PAGE_SHIFT 5
+#define DATA_PAGE_SIZE  (1 << DATA_PAGE_SHIFT)
+
 struct data_bus {
     /*
      * These functions are called to access parts of data memory by
@@ -28,6 +39,25 @@ struct data_bus {
      */
     int (*load)(void *mcu, unsigned addr, uint8_t *byte);
     int (*store)(void *mcu, unsigned addr, uint8_t byte);
+
+    /*
+     * Optional memory map with page_count pages of DATA_PAGE_SIZE bytes.
+     * If pages[addr >> DATA_PAGE_SHIFT] is not NULL, it points to plain
+     * memory backing that page, which the CPU reads and writes directly
+     * instead of calling load and store. Pages with side effects on access,
+     * such as I/O registers, must be NULL.
+     */
+    uint8_t *const *pages;
+    unsigned page_count;
+
+    /*
+     * Bit n is set if I/O register n, one of those SBI and CBI reach, acts
+     * on the ones written to it and ignores the zeros, such as a register
+     * of flags cleared by writing ones. SBI and CBI only affect the bit
+     * they name, so they write just that bit to such a register instead of
+     * writing back the value read.
+     */
+    uint32_t strobe_registers;
 };
 
 /* Status REGister */
@@ -42,17 +72,72 @@ struct sreg {
     uint8_t I : 1; /* Global interrupt enable bit */
 };
 
-enum cpu_core {
-    CORE_AVR,   /* AVR */
-    CORE_AVRE,  /* AVRe */
-    CORE_AVREP, /* AVRe+ */
-    CORE_AVRXM, /* AVRxm*/
-    CORE_AVRXT, /* AVRxt */
-    CORE_AVRRC  /* AVRrc */
+struct cpu;
+struct tracer;
+struct profile;
+
+typedef void (*instruction_handler)(struct cpu *cpu,
+                                    const struct instruction *inst);
+
+/*
+ * An entry of the predecoded instruction cache. The cache holds one entry per
+ * flash word; the entry of a word describes the instruction that starts there.
+ */
+struct icache_entry {
+    struct instruction inst;
+    uint8_t length; /* Opcode length in words, 0 if the entry is not valid */
+    uint8_t breakpoint; /* A breakpoint is set on this word */
+    uint8_t ends_block; /* inst ends a basic block */
+    uint8_t cycles; /* Cycles inst takes without branch or skip penalties */
+
+    /* Code executing inst; which member is used depends on CPU_DISPATCH. */
+    union {
+        unsigned index;
+        instruction_handler func;
+        const void *label;
+    } handler;
+};
+
+/* Kinds of operation whose effect on SREG may be computed lazily. */
+enum flags_op {
+    FLAGS_NONE,     /* SREG is up to date */
+    FLAGS_ADD,      /* ADD, ADC */
+    FLAGS_COMPARE,  /* CP, CPC, CPI */
+    FLAGS_LOGIC,    /* AND, ANDI, OR, EOR */
+    FLAGS_COM,
+    FLAGS_NEG,
+    FLAGS_INC,
+    FLAGS_DEC,
+    FLAGS_ADIW,
+    FLAGS_SBIW
+};
+
+/* The last flag-setting operation, whose flags are not yet in SREG. */
+struct lazy_flags {
+    uint8_t op; /* enum flags_op */
+    uint8_t rd; /* Rd before the operation */
+    uint8_t rr; /* Rr or constant operand */
+    uint16_t r; /* Result */
+};
+
+/* Reasons for cpu_run() to return. */
+enum cpu_stop_reason {
+    CPU_STOP_NONE,          /* (not stopping) */
+    CPU_STOP_BUDGET,        /* The cycle budget was used up */
+    CPU_STOP_BREAKPOINT,    /* A breakpoint was reached */
+    CPU_STOP_WATCHPOINT,    /* A watched data address was accessed */
+    CPU_STOP_SLEEP,         /* SLEEP was executed */
+    CPU_STOP_BREAK,         /* BREAK was executed */
+    CPU_STOP_ERROR          /* An instruction was illegal or not fetched */
 };
 
+/* Kinds of data access a watchpoint stops at, which may be combined. */
+#define CPU_WATCH_LOAD  0x1
+#define CPU_WATCH_STORE 0x2
+
 struct cpu {
     enum cpu_core core;
+    uint8_t pc_width; /* Program counter width in bits (16 or 22) */
 
     /* Flash bus with access to program memory and other flash memory */
     const struct flash_bus *flash_bus;
@@ -65,17 +150,144 @@ struct cpu {
     void *mcu; /* Pointer to the MCU which contains this CPU */
 
     uint8_t *reg_file; /* General purpose registers */
-    struct sreg sreg; /* Status register */
+    /*
+     * Status register. Flags of the operation in lazy_flags are not in sreg
+     * yet, so use cpu_read_sreg() and cpu_write_sreg() outside the CPU.
+     */
+    struct sreg sreg;
+    struct lazy_flags lazy_flags;
     uint16_t sp; /* Stack pointer value */
     uint16_t pc; /* Program counter */
 
-    struct instruction current_inst; /* Currently executing instruction */
+    /*
+     * Interrupt requests. Bit n is set while interrupt vector n is requested
+     * and lower vectors have priority. Changed with cpu_set_irq(), and only
+     * looked at between basic blocks when the mask or the I flag changes.
+     */
+    uint64_t irq_pending;
+    uint8_t irq_vector_words; /* Size of an interrupt vector in words */
+    /* Called when an interrupt is taken, e.g. to clear its flag */
+    void (*irq_ack)(void *mcu, unsigned vector);
+    /* Set by SEI or RETI: the next instruction runs before any interrupt */
+    _Bool irq_delayed;
+
+    /*
+     * Returns the cycle at which the value at data address addr may next
+     * change other than by a store, or UINT64_MAX. Busy-wait loops that
+     * read I/O are skipped up to that cycle; they are not skipped if this
+     * is NULL.
+     */
+    uint64_t (*io_next_change)(void *mcu, unsigned addr);
+
+    /*
+     * Record every instruction, interrupt and data access, and profile the
+     * instructions executed, if not NULL. Instructions are then executed
+     * one at a time and busy-wait loops are not skipped.
+     */
+    struct tracer *tracer;
+    struct profile *profile;
+
+    /*
+     * CPU_WATCH_* bits of the watchpoints on each of the first watch_size
+     * data addresses, or NULL if none is set. Watched addresses must be left
+     * out of the memory map of the data bus so that their accesses can be
+     * checked, and instructions are executed one at a time while watch is
+     * set. cpu_run() stops right after an instruction or interrupt entry
+     * accesses a watched address, leaving the access in watch_addr and
+     * watch_kind.
+     */
+    const uint8_t *watch;
+    unsigned watch_size;
+    uint16_t watch_addr;
+    uint8_t watch_kind;
+
+    /*
+     * Predecoded instruction cache with icache_size entries, indexed by
+     * program counter. May be NULL, in which case every instruction is
+     * decoded when fetched. If icache_shared is set, other CPUs use the
+     * same cache and it is not modified; instructions missing from it are
+     * decoded on every fetch.
+     */
+    struct icache_entry *icache;
+    unsigned icache_size;
+    _Bool icache_shared;
+    struct icache_entry uncached; /* Storage for an instruction not cached */
+
+    const struct instruction *current_inst; /* Currently executing instruction */
     _Bool is_executing_inst; /* Instruction is being executed */
-    unsigned cycle_count_inst_fetch; /* cycle_count when current_inst was set */
-    unsigned cycle_count; /* CPU cycles passed */
+    uint64_t cycle_count_inst_fetch; /* cycle_count when current_inst was set */
+    unsigned inst_cycles; /* Cycles current_inst takes in total */
+    uint64_t cycle_count; /* CPU cycles passed */
+
+    /* State of cpu_run() */
+    uint64_t run_end; /* End of the budget, or an earlier deadline */
+    uint64_t run_until; /* Return at a block end once cycle_count reaches this */
+    enum cpu_stop_reason stop_reason; /* Reason to return, if stopping early */
 };
 
-/* Run one CPU cycle. */
+/*
+ * Run one CPU cycle. An instruction takes effect in its first cycle; calls
+ * for its remaining cycles only advance cycle_count.
+ */
 void cpu_cycle(struct cpu *cpu);
 
+/*
+ * Execute instructions until max_cycles have passed, a breakpoint is reached,
+ * SLEEP or BREAK is executed or a stop is requested, and return the reason.
+ * Instructions are executed in whole basic blocks, so the budget may be
+ * exceeded by the rest of the block during which it runs out. A breakpoint
+ * stops execution before its instruction is executed; the next call resumes
+ * from it. Pending interrupts are entered without returning.
+ */
+enum cpu_stop_reason cpu_run(struct cpu *cpu, uint64_t max_cycles);
+
+/*
+ * Execute one instruction, or enter a pending interrupt, ignoring any
+ * breakpoint set on it. Returns CPU_STOP_BUDGET, or why the instruction
+ * would have made cpu_run() stop.
+ */
+enum cpu_stop_reason cpu_step(struct cpu *cpu);
+
+/*
+ * Make a running cpu_run() return with the given reason at the end of the
+ * current basic block. Meant to be called from bus callbacks.
+ */
+void cpu_request_stop(struct cpu *cpu, enum cpu_stop_reason reason);
+
+/*
+ * Make a running cpu_run() return at the end of the basic block during which
+ * cycle_count reaches cycle, if that is before its budget runs out.
+ */
+void cpu_set_deadline(struct cpu *cpu, uint64_t cycle);
+
+/*
+ * Request interrupt vector, or withdraw the request. The CPU takes the
+ * interrupt at the end of the current basic block if interrupts are enabled.
+ */
+void cpu_set_irq(struct cpu *cpu, unsigned vector, _Bool pending);
+
+/* Read and write the status register. */
+uint8_t cpu_read_sreg(struct cpu *cpu);
+void cpu_write_sreg(struct cpu *cpu, uint8_t byte);
+
+/*
+ * Set or clear a breakpoint on the instruction at program address pc.
+ * Returns 0 on success or a negative value if pc is not cached or the cache
+ * is shared.
+ */
+int cpu_set_breakpoint(struct cpu *cpu, uint16_t pc, _Bool enable);
+
+/*
+ * Decode every legal instruction in flash memory into the instruction cache,
+ * e.g. before it is shared.
+ */
+void cpu_fill_icache(struct cpu *cpu);
+
+/*
+ * Discard predecoded instructions overlapping flash bytes addr..addr+size-1.
+ * Must be called whenever flash memory is modified, which a shared cache
+ * must not be.
+ */
+void cpu_invalidate_icache(struct cpu *cpu, unsigned addr, unsigned size);
+
 #endif
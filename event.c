@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include "event.h"
+#include "log.h"
+
+static void place(struct event_queue *queue, unsigned index,
+                  struct event *event)
+{
+    queue->heap[index] = event;
+    event->index = index;
+}
+
+/* Move the event at index up or down the heap to its place. */
+static void sift(struct event_queue *queue, unsigned index)
+{
+    struct event *event = queue->heap[index];
+
+    while (index > 1 && queue->heap[index / 2]->time > event->time) {
+        place(queue, index, queue->heap[index / 2]);
+        index /= 2;
+    }
+
+    for (;;) {
+        unsigned child = 2 * index;
+
+        if (child > queue->count) {
+            break;
+        }
+        if (child + 1 <= queue->count &&
+            queue->heap[child + 1]->time < queue->heap[child]->time) {
+            child++;
+        }
+        if (queue->heap[child]->time >= event->time) {
+            break;
+        }
+        place(queue, index, queue->heap[child]);
+        index = child;
+    }
+
+    place(queue, index, event);
+}
+
+void event_schedule(struct event_queue *queue, struct event *event,
+                    uint64_t time)
+{
+    event->time = time;
+
+    if (!event->index) {
+        if (queue->count == EVENT_QUEUE_SIZE) {
+            warn("event queue full\n");
+            return;
+        }
+        place(queue, ++queue->count, event);
+    }
+    sift(queue, event->index);
+
+    if (queue->cpu) {
+        cpu_set_deadline(queue->cpu, time);
+    }
+}
+
+void event_cancel(struct event_queue *queue, struct event *event)
+{
+    unsigned index = event->index;
+    struct event *last;
+
+    if (!index) {
+        return;
+    }
+
+    event->index = 0;
+    last = queue->heap[queue->count--];
+    if (last != event) {
+        place(queue, index, last);
+        sift(queue, index);
+    }
+}
+
+void event_queue_run(struct event_queue *queue, uint64_t now)
+{
+    while (queue->count && queue->heap[1]->time <= now) {
+        struct event *event = queue->heap[1];
+
+        event_cancel(queue, event);
+        event->handler(event, event->ctx);
+    }
+}
+
+void event_queue_move(struct event_queue *queue, intptr_t delta)
+{
+    for (unsigned i = 1; i <= queue->count; i++) {
+        queue->heap[i] = (struct event *)((char *) queue->heap[i] + delta);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/* Maximum number of events scheduled at once in a queue. */
+#define EVENT_QUEUE_SIZE 16
+
+#define EVENT_NEVER UINT64_MAX
+
+struct event;
+
+typedef void (*event_handler)(struct event *event, void *ctx);
+
+/* Something to be done once cycle_count reaches a given time. */
+struct event {
+    uint64_t time;
+    event_handler handler;
+    void *ctx;
+    unsigned index; /* Position in the queue, 0 if not scheduled */
+};
+
+/*
+ * Events of an MCU, a binary min-heap ordered by time. heap[0] is unused so
+ * that the index of an event is 0 when it is not scheduled.
+ */
+struct event_queue {
+    struct event *heap[EVENT_QUEUE_SIZE + 1];
+    unsigned count;
+
+    /* CPU whose cpu_run() must return when an event is due */
+    struct cpu *cpu;
+};
+
+static inline void event_init(struct event *event, event_handler handler,
+                              void *ctx)
+{
+    event->handler = handler;
+    event->ctx = ctx;
+    event->index = 0;
+}
+
+/* Returns the time of the earliest event, or EVENT_NEVER. */
+static inline uint64_t event_queue_next(const struct event_queue *queue)
+{
+    return queue->count ? queue->heap[1]->time : EVENT_NEVER;
+}
+
+/*
+ * Schedule event at time, or move it there if it is already scheduled. Makes
+ * a running cpu_run() of the CPU of queue return when the event is due.
+ */
+void event_schedule(struct event_queue *queue, struct event *event,
+                    uint64_t time);
+
+void event_cancel(struct event_queue *queue, struct event *event);
+
+/*
+ * Call the handlers of events due at time now, earliest first. Handlers may
+ * schedule events, including their own.
+ */
+void event_queue_run(struct event_queue *queue, uint64_t now);
+
+/*
+ * Adjust the pointers of queue to its events after the queue and the events
+ * have been copied delta bytes away. The owners of the events must update
+ * their ctx.
+ */
+void event_queue_move(struct event_queue *queue, intptr_t delta);
+
+#endif
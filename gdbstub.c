@@ -0,0 +1,687 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "defines.h"
+#include "gdbstub.h"
+#include "log.h"
+
+#define FAILED(status) ((status) < 0)
+
+/* Registers in the order of the g packet, and their sizes in bytes. */
+#define GDB_REG_SREG    32
+#define GDB_REG_SP      33
+#define GDB_REG_PC      34
+#define GDB_REG_COUNT   35
+#define GDB_REGS_SIZE   (32 + 1 + 2 + 4)
+
+/* Not an actual stop of the MCU: GDB interrupted it with ^C. */
+#define STOP_INTERRUPTED (-1)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Decode size bytes of hex into data. Returns 0, or -1 if hex is short. */
+static int decode_hex(const char *hex, uint8_t *data, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_value(hex[2 * i + 1]);
+
+        if (lo < 0) {
+            return -1;
+        }
+        data[i] = hi << 4 | lo;
+    }
+    return 0;
+}
+
+static char *encode_hex(char *hex, const uint8_t *data, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++) {
+        *hex++ = hex_digits[data[i] >> 4];
+        *hex++ = hex_digits[data[i] & 0xf];
+    }
+    *hex = '\0';
+    return hex;
+}
+
+/* Write all of data to fd. Returns 0 on success, -1 on failure. */
+static int write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Returns the next byte from GDB, or -1 if the connection is closed. */
+static int get_byte(struct gdb_stub *stub)
+{
+    if (stub->in_pos == stub->in_len) {
+        ssize_t n;
+
+        do {
+            n = read(stub->in_fd, stub->in, sizeof(stub->in));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return -1;
+        }
+        stub->in_pos = 0;
+        stub->in_len = n;
+    }
+    return stub->in[stub->in_pos++];
+}
+
+/*
+ * Receive a packet into stub->packet and acknowledge it. Bytes outside
+ * packets, such as acknowledgements and interrupts of a stopped MCU, are
+ * ignored. Returns the length of the packet, or -1 if the connection is
+ * closed.
+ */
+static int get_packet(struct gdb_stub *stub)
+{
+    for (;;) {
+        unsigned len = 0;
+        uint8_t sum = 0;
+        int c, hi, lo;
+
+        do {
+            c = get_byte(stub);
+            if (c < 0) {
+                return -1;
+            }
+        } while (c != '$');
+
+        while ((c = get_byte(stub)) != '#') {
+            if (c < 0) {
+                return -1;
+            }
+            if (c == '$') {
+                /* The rest of a packet was lost; this one starts over. */
+                len = 0;
+                sum = 0;
+                continue;
+            }
+            if (len < sizeof(stub->packet) - 1) {
+                stub->packet[len] = c;
+            }
+            len++;
+            sum += c;
+        }
+        hi = get_byte(stub);
+        lo = get_byte(stub);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+
+        if (len < sizeof(stub->packet) &&
+            (stub->no_ack || (hex_value(hi) << 4 | hex_value(lo)) == sum)) {
+            if (!stub->no_ack) {
+                (void) write_all(stub->out_fd, "+", 1);
+            }
+            stub->packet[len] = '\0';
+            return len;
+        }
+        debug("dropped a bad packet from GDB\n");
+        if (!stub->no_ack) {
+            (void) write_all(stub->out_fd, "-", 1);
+        }
+    }
+}
+
+/*
+ * Send data as a packet, again until GDB acknowledges it. Returns 0 on
+ * success or -1 if the connection is lost.
+ */
+static int put_packet(struct gdb_stub *stub, const char *data)
+{
+    size_t len = strlen(data);
+    uint8_t sum = 0;
+    char *p = stub->reply;
+
+    if (len > GDB_PACKET_SIZE) {
+        len = GDB_PACKET_SIZE;
+    }
+    *p++ = '$';
+    for (size_t i = 0; i < len; i++) {
+        sum += data[i];
+        *p++ = data[i];
+    }
+    *p++ = '#';
+    *p++ = hex_digits[sum >> 4];
+    *p++ = hex_digits[sum & 0xf];
+
+    for (;;) {
+        int c;
+
+        if (FAILED(write_all(stub->out_fd, stub->reply, p - stub->reply))) {
+            return -1;
+        }
+        if (stub->no_ack) {
+            return 0;
+        }
+        do {
+            c = get_byte(stub);
+            if (c < 0) {
+                return -1;
+            }
+        } while (c != '+' && c != '-');
+        if (c == '+') {
+            return 0;
+        }
+    }
+}
+
+/* Returns 1 if GDB sent an interrupt, or closed the connection, while running. */
+static int interrupted(struct gdb_stub *stub)
+{
+    struct pollfd pfd = { .fd = stub->in_fd, .events = POLLIN };
+
+    while (stub->in_pos < stub->in_len || poll(&pfd, 1, 0) > 0) {
+        int c = get_byte(stub);
+
+        if (c < 0 || c == 0x03) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void gdb_stub_init(struct gdb_stub *stub, int in_fd, int out_fd)
+{
+    memset(stub, 0, sizeof(*stub));
+    stub->in_fd = in_fd;
+    stub->out_fd = out_fd;
+}
+
+int gdb_stub_listen(struct gdb_stub *stub, unsigned port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd, conn, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    do {
+        conn = accept(fd, NULL, NULL);
+    } while (conn < 0 && errno == EINTR);
+    close(fd);
+    if (conn < 0) {
+        return -1;
+    }
+
+    /* Replies are small and GDB waits for each of them. */
+    (void) setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    gdb_stub_init(stub, conn, conn);
+    stub->owned = 1;
+    return 0;
+}
+
+void gdb_stub_close(struct gdb_stub *stub)
+{
+    if (stub->owned) {
+        close(stub->in_fd);
+    }
+    stub->in_fd = -1;
+    stub->out_fd = -1;
+}
+
+/* Encode the registers in the order of the g packet. */
+static void read_registers(struct cpu *cpu, uint8_t regs[GDB_REGS_SIZE])
+{
+    uint32_t pc = cpu->pc * 2;
+
+    memcpy(regs, cpu->reg_file, 32);
+    regs[32] = cpu_read_sreg(cpu);
+    regs[33] = cpu->sp;
+    regs[34] = cpu->sp >> 8;
+    for (unsigned i = 0; i < 4; i++) {
+        regs[35 + i] = pc >> 8 * i;
+    }
+}
+
+/* Returns the offset and size of register n in the g packet, or -1. */
+static int register_offset(unsigned n, unsigned *size)
+{
+    if (n < 32) {
+        *size = 1;
+        return n;
+    }
+    switch (n) {
+    case GDB_REG_SREG:
+        *size = 1;
+        return 32;
+    case GDB_REG_SP:
+        *size = 2;
+        return 33;
+    case GDB_REG_PC:
+        *size = 4;
+        return 35;
+    default:
+        return -1;
+    }
+}
+
+static void write_registers(struct cpu *cpu, const uint8_t regs[GDB_REGS_SIZE])
+{
+    memcpy(cpu->reg_file, regs, 32);
+    cpu_write_sreg(cpu, regs[32]);
+    cpu->sp = regs[33] | regs[34] << 8;
+    cpu->pc = (regs[35] | regs[36] << 8 | regs[37] << 16 |
+               (uint32_t) regs[38] << 24) / 2;
+}
+
+/*
+ * Read or write size bytes of memory at GDB address addr. Data memory is
+ * accessed through the data bus, so reading an I/O register has the side
+ * effects a load by the CPU has. Returns 0 or a negative value.
+ */
+static int access_memory(struct atmega328p *mcu, uint32_t addr, uint8_t *data,
+                         unsigned size, _Bool write)
+{
+    const struct data_bus *bus = &mcu->bus;
+
+    if (addr >= GDB_EEPROM_OFFSET) {
+        addr -= GDB_EEPROM_OFFSET;
+        if (addr > ATMEGA328P_EEPROM_SIZE ||
+            size > ATMEGA328P_EEPROM_SIZE - addr) {
+            return -1;
+        }
+        if (write) {
+            memcpy(&mcu->eeprom[addr], data, size);
+        }
+        else {
+            memcpy(data, &mcu->eeprom[addr], size);
+        }
+        return 0;
+    }
+
+    if (addr >= GDB_DATA_OFFSET) {
+        addr -= GDB_DATA_OFFSET;
+        for (unsigned i = 0; i < size; i++) {
+            int rc = write ? bus->store(mcu, addr + i, data[i])
+                           : bus->load(mcu, addr + i, &data[i]);
+
+            if (FAILED(rc)) {
+                return rc;
+            }
+        }
+        return 0;
+    }
+
+    if (write) {
+        return mcu->flash_bus.write(mcu, addr, data, size);
+    }
+    return mcu->flash_bus.read(mcu, addr, data, size);
+}
+
+/* Returns the CPU_WATCH_* bits a watchpoint of a Z packet type stops at. */
+static unsigned watch_kinds(unsigned type)
+{
+    switch (type) {
+    case 2:
+        return CPU_WATCH_STORE;
+    case 3:
+        return CPU_WATCH_LOAD;
+    default:
+        return CPU_WATCH_LOAD | CPU_WATCH_STORE;
+    }
+}
+
+/* Tag the data addresses of the watchpoints of stub. */
+static void apply_watchpoints(struct gdb_stub *stub)
+{
+    atmega328p_clear_watchpoints(stub->mcu);
+    for (unsigned i = 0; i < stub->watchpoint_count; i++) {
+        const struct gdb_watchpoint *w = &stub->watchpoints[i];
+
+        (void) atmega328p_add_watchpoint(stub->mcu, w->addr, w->size,
+                                         watch_kinds(w->type));
+    }
+}
+
+/* Handle a Z or z packet. Returns 0 on success or a negative value. */
+static int set_point(struct gdb_stub *stub, const char *packet)
+{
+    struct cpu *cpu = &stub->mcu->cpu;
+    _Bool insert = packet[0] == 'Z';
+    unsigned type, size;
+    unsigned long addr;
+    char *end;
+
+    type = strtoul(packet + 1, &end, 16);
+    if (*end != ',') {
+        return -1;
+    }
+    addr = strtoul(end + 1, &end, 16);
+    if (*end != ',') {
+        return -1;
+    }
+    size = strtoul(end + 1, &end, 16);
+
+    switch (type) {
+    case 0: /* Software breakpoint */
+    case 1: /* Hardware breakpoint */
+        if (addr >= GDB_DATA_OFFSET ||
+            FAILED(atmega328p_unshare_flash(stub->mcu))) {
+            return -1;
+        }
+        return cpu_set_breakpoint(cpu, addr / 2, insert);
+    case 2: /* Write watchpoint */
+    case 3: /* Read watchpoint */
+    case 4: /* Access watchpoint */
+        if (addr < GDB_DATA_OFFSET || addr >= GDB_EEPROM_OFFSET) {
+            return -1;
+        }
+        addr -= GDB_DATA_OFFSET;
+        if (addr >= ATMEGA328P_DATA_MEMORY_SIZE ||
+            size > ATMEGA328P_DATA_MEMORY_SIZE - addr) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    if (insert) {
+        struct gdb_watchpoint *w;
+
+        if (stub->watchpoint_count == GDB_MAX_WATCHPOINTS) {
+            return -1;
+        }
+        w = &stub->watchpoints[stub->watchpoint_count++];
+        w->addr = addr;
+        w->size = size;
+        w->type = type;
+    }
+    else {
+        unsigned i;
+
+        for (i = 0; i < stub->watchpoint_count; i++) {
+            const struct gdb_watchpoint *w = &stub->watchpoints[i];
+
+            if (w->addr == addr && w->size == size && w->type == type) {
+                break;
+            }
+        }
+        if (i == stub->watchpoint_count) {
+            return -1;
+        }
+        stub->watchpoints[i] = stub->watchpoints[--stub->watchpoint_count];
+    }
+    apply_watchpoints(stub);
+    return 0;
+}
+
+/* Write the stop reply packet for a stop of the MCU into buf. */
+static void stop_reply(struct gdb_stub *stub, int reason, char *buf)
+{
+    static const char *const watch_names[] = { "watch", "rwatch", "awatch" };
+    const struct cpu *cpu = &stub->mcu->cpu;
+
+    switch (reason) {
+    case STOP_INTERRUPTED:
+        strcpy(buf, "S02"); /* SIGINT */
+        return;
+    case CPU_STOP_ERROR:
+        strcpy(buf, "S0b"); /* SIGSEGV */
+        return;
+    case CPU_STOP_WATCHPOINT:
+        for (unsigned i = 0; i < stub->watchpoint_count; i++) {
+            const struct gdb_watchpoint *w = &stub->watchpoints[i];
+
+            if (cpu->watch_addr >= w->addr &&
+                cpu->watch_addr < w->addr + w->size &&
+                (watch_kinds(w->type) & cpu->watch_kind)) {
+                sprintf(buf, "T05%s:%x;", watch_names[w->type - 2],
+                        GDB_DATA_OFFSET + cpu->watch_addr);
+                return;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    strcpy(buf, "S05"); /* SIGTRAP */
+}
+
+/*
+ * Continue or step the MCU, from addr if one is given after the command
+ * letter of packet, until it stops, GDB interrupts it or end is reached.
+ * Returns why it stopped, or STOP_INTERRUPTED.
+ */
+static int resume(struct gdb_stub *stub, const char *packet, uint64_t end)
+{
+    struct atmega328p *mcu = stub->mcu;
+    struct cpu *cpu = &mcu->cpu;
+    enum cpu_stop_reason reason;
+
+    if (packet[1]) {
+        cpu->pc = strtoul(packet + 1, NULL, 16) / 2;
+    }
+    if (packet[0] == 's') {
+        return atmega328p_step(mcu);
+    }
+
+    do {
+        uint64_t left = end - cpu->cycle_count;
+
+        reason = atmega328p_run(mcu, left < GDB_POLL_CYCLES ? left
+                                                            : GDB_POLL_CYCLES);
+        if (reason == CPU_STOP_BUDGET && interrupted(stub)) {
+            return STOP_INTERRUPTED;
+        }
+    } while (reason == CPU_STOP_BUDGET && cpu->cycle_count < end);
+
+    return reason;
+}
+
+/*
+ * Handle a packet that needs no more than a reply, which is written into
+ * buf; an empty reply tells GDB the packet is not supported.
+ */
+static void handle_packet(struct gdb_stub *stub, char *packet, char *buf)
+{
+    struct atmega328p *mcu = stub->mcu;
+    struct cpu *cpu = &mcu->cpu;
+    uint8_t data[GDB_PACKET_SIZE / 2];
+    unsigned long addr, size;
+    char *end;
+
+    buf[0] = '\0';
+    switch (packet[0]) {
+    case 'g':
+        read_registers(cpu, data);
+        encode_hex(buf, data, GDB_REGS_SIZE);
+        break;
+    case 'G':
+        if (FAILED(decode_hex(packet + 1, data, GDB_REGS_SIZE))) {
+            strcpy(buf, "E01");
+            break;
+        }
+        write_registers(cpu, data);
+        strcpy(buf, "OK");
+        break;
+    case 'p':
+    case 'P': {
+        unsigned n = strtoul(packet + 1, &end, 16), reg_size;
+        int offset = register_offset(n, &reg_size);
+
+        if (offset < 0 || (packet[0] == 'P' && *end != '=')) {
+            strcpy(buf, "E01");
+            break;
+        }
+        read_registers(cpu, data);
+        if (packet[0] == 'p') {
+            encode_hex(buf, data + offset, reg_size);
+            break;
+        }
+        if (FAILED(decode_hex(end + 1, data + offset, reg_size))) {
+            strcpy(buf, "E01");
+            break;
+        }
+        write_registers(cpu, data);
+        strcpy(buf, "OK");
+        break;
+    }
+    case 'm':
+    case 'M':
+        addr = strtoul(packet + 1, &end, 16);
+        if (*end != ',') {
+            strcpy(buf, "E01");
+            break;
+        }
+        size = strtoul(end + 1, &end, 16);
+        if (size > sizeof(data) - 1) {
+            size = sizeof(data) - 1;
+        }
+        if (packet[0] == 'm') {
+            if (FAILED(access_memory(mcu, addr, data, size, 0))) {
+                strcpy(buf, "E01");
+            }
+            else {
+                encode_hex(buf, data, size);
+            }
+        }
+        else if (*end != ':' || FAILED(decode_hex(end + 1, data, size)) ||
+                 FAILED(access_memory(mcu, addr, data, size, 1))) {
+            strcpy(buf, "E01");
+        }
+        else {
+            strcpy(buf, "OK");
+        }
+        break;
+    case 'Z':
+    case 'z':
+        strcpy(buf, FAILED(set_point(stub, packet)) ? "E01" : "OK");
+        break;
+    case 'H':
+        /* There is only one thread. */
+        strcpy(buf, "OK");
+        break;
+    case 'q':
+        if (strncmp(packet, "qSupported", 10) == 0) {
+            sprintf(buf, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+        }
+        else if (strcmp(packet, "qAttached") == 0) {
+            strcpy(buf, "1");
+        }
+        break;
+    case 'Q':
+        if (strcmp(packet, "QStartNoAckMode") == 0) {
+            strcpy(buf, "OK");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+enum cpu_stop_reason gdb_stub_serve(struct gdb_stub *stub,
+                                    struct atmega328p *mcu,
+                                    uint64_t max_cycles)
+{
+    struct cpu *cpu = &mcu->cpu;
+    uint64_t end = max_cycles ? cpu->cycle_count + max_cycles : UINT64_MAX;
+    int reason = CPU_STOP_BREAKPOINT;
+    char buf[GDB_PACKET_SIZE + 1];
+
+    stub->mcu = mcu;
+    for (;;) {
+        if (get_packet(stub) < 0) {
+            warn("lost the connection to GDB\n");
+            break;
+        }
+
+        switch (stub->packet[0]) {
+        case '?':
+            stop_reply(stub, reason, buf);
+            break;
+        case 'c':
+        case 's':
+            reason = resume(stub, stub->packet, end);
+            if (cpu->cycle_count >= end) {
+                /* The run is over; GDB sees the program exit. */
+                (void) put_packet(stub, "W00");
+                return reason == STOP_INTERRUPTED ? CPU_STOP_BUDGET : reason;
+            }
+            stop_reply(stub, reason, buf);
+            break;
+        case 'k':
+            return reason < 0 ? CPU_STOP_BUDGET : reason;
+        case 'D':
+            (void) put_packet(stub, "OK");
+            goto detach;
+        default:
+            handle_packet(stub, stub->packet, buf);
+            break;
+        }
+
+        if (FAILED(put_packet(stub, buf))) {
+            warn("lost the connection to GDB\n");
+            break;
+        }
+        if (strcmp(stub->packet, "QStartNoAckMode") == 0) {
+            stub->no_ack = 1;
+        }
+    }
+
+detach:
+    /* Run the rest without breakpoints or watchpoints. */
+    stub->watchpoint_count = 0;
+    apply_watchpoints(stub);
+    for (unsigned pc = 0; pc < cpu->icache_size; pc++) {
+        if (cpu->icache[pc].breakpoint) {
+            (void) cpu_set_breakpoint(cpu, pc, 0);
+        }
+    }
+    do {
+        uint64_t left = end - cpu->cycle_count;
+
+        reason = atmega328p_run(mcu, left < GDB_POLL_CYCLES ? left
+                                                            : GDB_POLL_CYCLES);
+    } while (reason == CPU_STOP_BUDGET && cpu->cycle_count < end);
+    return reason;
+}
@@ -0,0 +1,75 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include <stdint.h>
+#include "atmega328p.h"
+
+/* Largest packet received or sent, without framing. */
+#define GDB_PACKET_SIZE     0x1000
+
+/* Most watchpoints set at once. */
+#define GDB_MAX_WATCHPOINTS 16
+
+/* Cycles run between checks for an interrupt from GDB. */
+#define GDB_POLL_CYCLES     0x10000
+
+/*
+ * Address spaces of avr-gdb, which sees flash memory at 0, data memory at
+ * GDB_DATA_OFFSET and EEPROM at GDB_EEPROM_OFFSET.
+ */
+#define GDB_DATA_OFFSET     0x800000
+#define GDB_EEPROM_OFFSET   0x810000
+
+/* A watchpoint set by a Z2 (write), Z3 (read) or Z4 (access) packet. */
+struct gdb_watchpoint {
+    uint16_t addr; /* Data address */
+    uint16_t size;
+    uint8_t type; /* 2, 3 or 4 as in the packet */
+};
+
+/*
+ * A server of the GDB remote serial protocol for an MCU. Breakpoints are
+ * marked in the predecoded instructions of the MCU, so a run with them
+ * set is as fast as one without. Watchpoints take the watched pages of
+ * data memory out of its memory map and have the CPU execute instructions
+ * one at a time while they are set.
+ */
+struct gdb_stub {
+    int in_fd, out_fd; /* Connection to GDB */
+    _Bool owned; /* The stub opened the descriptors and closes them */
+    _Bool no_ack; /* QStartNoAckMode was received */
+
+    struct atmega328p *mcu;
+    struct gdb_watchpoint watchpoints[GDB_MAX_WATCHPOINTS];
+    unsigned watchpoint_count;
+
+    unsigned in_pos, in_len;
+    uint8_t in[GDB_PACKET_SIZE]; /* Bytes received, not yet looked at */
+    char packet[GDB_PACKET_SIZE + 1]; /* The last packet received */
+    char reply[GDB_PACKET_SIZE + 5]; /* Framed packet being sent */
+};
+
+/* Talk to GDB over file descriptors, e.g. standard input and output. */
+void gdb_stub_init(struct gdb_stub *stub, int in_fd, int out_fd);
+
+/*
+ * Wait for GDB to connect to TCP port of localhost and talk to it over the
+ * connection. Returns 0 on success or a negative value on failure.
+ */
+int gdb_stub_listen(struct gdb_stub *stub, unsigned port);
+
+/* Close the connection if the stub opened it. */
+void gdb_stub_close(struct gdb_stub *stub);
+
+/*
+ * Run mcu under the control of GDB for up to max_cycles cycles, or without
+ * limit if max_cycles is 0. The MCU is stopped until GDB continues it.
+ * Returns when GDB kills the program or the cycles run out, with the reason
+ * the MCU last stopped; if GDB detaches or the connection is lost, the
+ * rest of the run continues without it.
+ */
+enum cpu_stop_reason gdb_stub_serve(struct gdb_stub *stub,
+                                    struct atmega328p *mcu,
+                                    uint64_t max_cycles);
+
+#endif
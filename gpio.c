@@ -0,0 +1,380 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "gpio.h"
+#include "log.h"
+
+#define FAILED(status) ((status) < 0)
+
+/* Request the pin change interrupts whose flag is set and enabled. */
+static void gpio_update_irq(struct gpio *gpio)
+{
+    const struct gpio_config *c = gpio->config;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        cpu_set_irq(gpio->cpu, c->ports[i].vector,
+                    BITVAL(gpio->pcifr, i) && BITVAL(gpio->pcicr, i));
+    }
+}
+
+static void log_change(struct gpio_log *log, uint64_t cycle, unsigned port,
+                       uint8_t levels, uint8_t changed)
+{
+    struct gpio_change *change;
+
+    if (log->count == GPIO_LOG_SIZE) {
+        gpio_log_flush(log);
+    }
+    /* An input may be seen a little after a change made by the CPU. */
+    if (cycle < log->last_cycle) {
+        cycle = log->last_cycle;
+    }
+    log->last_cycle = cycle;
+
+    change = &log->changes[log->count++];
+    change->cycle = cycle;
+    change->port = port;
+    change->levels = levels;
+    change->changed = changed;
+}
+
+/* Bring the levels of the pins of port up to date as of cycle. */
+static void update_port(struct gpio *gpio, unsigned port, uint64_t cycle)
+{
+    uint8_t external = gpio->driven[port] & ~gpio->ddr[port];
+    uint8_t levels, changed;
+
+    levels = (gpio->port[port] & ~external | gpio->input[port] & external) &
+             gpio->config->ports[port].pins;
+    changed = levels ^ gpio->levels[port];
+    if (!changed) {
+        return;
+    }
+    gpio->levels[port] = levels;
+
+    if (gpio->log) {
+        log_change(gpio->log, cycle, port, levels, changed);
+    }
+    if (changed & gpio->pcmsk[port]) {
+        BITSET(gpio->pcifr, port);
+        gpio_update_irq(gpio);
+    }
+}
+
+/* Returns the index of the port named name, or -1. */
+static int find_port(const struct gpio_config *c, char name)
+{
+    for (unsigned i = 0; i < c->port_count; i++) {
+        if (c->ports[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Apply the inputs of the stimulus due by now and wait for the next one. */
+static void apply_inputs(struct gpio *gpio)
+{
+    const struct gpio_stimulus *st = gpio->stimulus;
+    uint64_t now = gpio->cpu->cycle_count;
+
+    for (; gpio->next_input < st->count; gpio->next_input++) {
+        const struct gpio_input *in = &st->inputs[gpio->next_input];
+        int port = find_port(gpio->config, in->port);
+
+        if (in->cycle > now) {
+            event_schedule(gpio->queue, &gpio->input_event, in->cycle);
+            return;
+        }
+        if (port < 0) {
+            continue;
+        }
+        if (in->level < 0) {
+            BITCLR(gpio->driven[port], in->pin);
+        }
+        else {
+            BITSET(gpio->driven[port], in->pin);
+            gpio->input[port] = gpio->input[port] & ~BIT2MASK(in->pin) |
+                                in->level << in->pin;
+        }
+        update_port(gpio, port, in->cycle);
+    }
+}
+
+static void input_event(struct event *event, void *ctx)
+{
+    apply_inputs(ctx);
+}
+
+void gpio_reset(struct gpio *gpio)
+{
+    memset(gpio, 0, sizeof(*gpio));
+}
+
+void gpio_attach(struct gpio *gpio, const struct gpio_config *config,
+                 struct event_queue *queue, struct cpu *cpu)
+{
+    gpio->config = config;
+    gpio->queue = queue;
+    gpio->cpu = cpu;
+    gpio->input_event.handler = input_event;
+    gpio->input_event.ctx = gpio;
+}
+
+void gpio_set_stimulus(struct gpio *gpio, const struct gpio_stimulus *stimulus)
+{
+    event_cancel(gpio->queue, &gpio->input_event);
+    gpio->stimulus = stimulus;
+    gpio->next_input = 0;
+    if (stimulus) {
+        apply_inputs(gpio);
+    }
+}
+
+int gpio_drive(struct gpio *gpio, unsigned addr, uint8_t levels, uint8_t mask)
+{
+    const struct gpio_config *c = gpio->config;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        if (addr == c->ports[i].pin) {
+            gpio->driven[i] |= mask;
+            gpio->input[i] = gpio->input[i] & ~mask | levels & mask;
+            update_port(gpio, i, gpio->cpu->cycle_count);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void gpio_connect(struct gpio *gpio, struct gpio_log *log)
+{
+    gpio->log = log;
+    if (!log) {
+        return;
+    }
+
+    log->config = gpio->config;
+    for (unsigned i = 0; i < gpio->config->port_count; i++) {
+        log_change(log, gpio->cpu->cycle_count, i, gpio->levels[i],
+                   gpio->config->ports[i].pins);
+    }
+}
+
+int gpio_load(struct gpio *gpio, unsigned addr, uint8_t *byte)
+{
+    const struct gpio_config *c = gpio->config;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        if (addr == c->ports[i].pin) {
+            *byte = gpio->levels[i];
+            return 1;
+        }
+        if (addr == c->ports[i].ddr) {
+            *byte = gpio->ddr[i];
+            return 1;
+        }
+        if (addr == c->ports[i].port) {
+            *byte = gpio->port[i];
+            return 1;
+        }
+        if (addr == c->ports[i].pcmsk) {
+            *byte = gpio->pcmsk[i];
+            return 1;
+        }
+    }
+
+    if (addr == c->pcicr) {
+        *byte = gpio->pcicr;
+    }
+    else if (addr == c->pcifr) {
+        *byte = gpio->pcifr;
+    }
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+int gpio_store(struct gpio *gpio, unsigned addr, uint8_t byte)
+{
+    const struct gpio_config *c = gpio->config;
+    uint8_t ports = (1 << c->port_count) - 1;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        uint8_t pins = c->ports[i].pins;
+
+        if (addr == c->ports[i].pin) {
+            /* Writing ones to PINx toggles the bits of PORTx. */
+            gpio->port[i] ^= byte & pins;
+        }
+        else if (addr == c->ports[i].ddr) {
+            gpio->ddr[i] = byte & pins;
+        }
+        else if (addr == c->ports[i].port) {
+            gpio->port[i] = byte & pins;
+        }
+        else if (addr == c->ports[i].pcmsk) {
+            gpio->pcmsk[i] = byte & pins;
+            return 1;
+        }
+        else {
+            continue;
+        }
+        update_port(gpio, i, gpio->cpu->cycle_count);
+        return 1;
+    }
+
+    if (addr == c->pcicr) {
+        gpio->pcicr = byte & ports;
+    }
+    else if (addr == c->pcifr) {
+        /* Flags are cleared by writing ones to them. */
+        gpio->pcifr &= ~byte;
+    }
+    else {
+        return 0;
+    }
+
+    gpio_update_irq(gpio);
+    return 1;
+}
+
+uint64_t gpio_next_change(struct gpio *gpio, unsigned addr)
+{
+    const struct gpio_config *c = gpio->config;
+    _Bool input = addr == c->pcifr;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        input |= addr == c->ports[i].pin;
+    }
+    if (input && gpio->input_event.index) {
+        return gpio->input_event.time;
+    }
+    return EVENT_NEVER;
+}
+
+int gpio_ack(struct gpio *gpio, unsigned vector)
+{
+    const struct gpio_config *c = gpio->config;
+
+    for (unsigned i = 0; i < c->port_count; i++) {
+        if (vector == c->ports[i].vector) {
+            BITCLR(gpio->pcifr, i);
+            gpio_update_irq(gpio);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void gpio_log_init(struct gpio_log *log,
+                   void (*write)(void *ctx, const struct gpio_change *changes,
+                                 unsigned count),
+                   void *ctx)
+{
+    memset(log, 0, sizeof(*log));
+    log->write = write;
+    log->ctx = ctx;
+}
+
+void gpio_log_flush(struct gpio_log *log)
+{
+    if (log->count > 0) {
+        log->write(log->ctx, log->changes, log->count);
+        log->count = 0;
+    }
+}
+
+/* Parse an input from line, which has no comment. Returns 1 if it has one. */
+static int parse_input(const char *line, struct gpio_input *in)
+{
+    unsigned long long cycle;
+    char port, level;
+    unsigned pin;
+    int n;
+
+    if (line[strspn(line, " \t\r")] == '\0') {
+        return 0;
+    }
+    if (sscanf(line, "%llu %c%u %c %n", &cycle, &port, &pin, &level, &n) != 4 ||
+        line[n] != '\0' || !isupper((unsigned char) port) || pin > 7) {
+        return -1;
+    }
+
+    in->cycle = cycle;
+    in->port = port;
+    in->pin = pin;
+    switch (level) {
+    case '0':
+    case '1':
+        in->level = level - '0';
+        break;
+    case 'z':
+    case 'Z':
+        in->level = -1;
+        break;
+    default:
+        return -1;
+    }
+    return 1;
+}
+
+int gpio_stimulus_load(struct gpio_stimulus *stimulus, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    unsigned capacity = 0, line_number = 0;
+    char line[256];
+    int status = 0;
+
+    memset(stimulus, 0, sizeof(*stimulus));
+    if (!file) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        struct gpio_input in;
+
+        line_number++;
+        line[strcspn(line, "#\n")] = '\0';
+        status = parse_input(line, &in);
+        if (FAILED(status) || status > 0 && stimulus->count > 0 &&
+            in.cycle < stimulus->inputs[stimulus->count - 1].cycle) {
+            warn("%s:%u: expected <cycle> <port><pin> <0|1|z> in order\n",
+                 path, line_number);
+            status = -1;
+            break;
+        }
+        if (status == 0) {
+            continue;
+        }
+
+        if (stimulus->count == capacity) {
+            void *inputs;
+
+            capacity = capacity ? 2 * capacity : 64;
+            inputs = realloc(stimulus->inputs, capacity * sizeof(in));
+            if (!inputs) {
+                status = -1;
+                break;
+            }
+            stimulus->inputs = inputs;
+        }
+        stimulus->inputs[stimulus->count++] = in;
+        status = 0;
+    }
+
+    fclose(file);
+    if (FAILED(status)) {
+        gpio_stimulus_free(stimulus);
+    }
+    return status;
+}
+
+void gpio_stimulus_free(struct gpio_stimulus *stimulus)
+{
+    free(stimulus->inputs);
+    memset(stimulus, 0, sizeof(*stimulus));
+}
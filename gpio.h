@@ -0,0 +1,165 @@
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <stdint.h>
+#include "event.h"
+
+/* Most I/O ports of a GPIO model. */
+#define GPIO_MAX_PORTS      3
+
+/* Pin changes buffered by a log before it hands them to its writer. */
+#define GPIO_LOG_SIZE       1024
+
+/*
+ * A GPIO model. Register addresses are data addresses. Port i has the pin
+ * change interrupt enabled by bit i of PCICR, flagged in bit i of PCIFR and
+ * masked by pcmsk[i], as on the ATmega328P.
+ */
+struct gpio_config {
+    unsigned port_count;
+    struct {
+        char name; /* 'B' for PORTB */
+        uint16_t pin, ddr, port;
+        uint8_t pins; /* Bits of the port that are pins */
+        uint16_t pcmsk;
+        uint8_t vector; /* Pin change interrupt */
+    } ports[GPIO_MAX_PORTS];
+    uint16_t pcicr, pcifr;
+};
+
+/* The levels of the pins of a port after some of them changed. */
+struct gpio_change {
+    uint64_t cycle;
+    uint8_t port; /* Index in the config */
+    uint8_t levels;
+    uint8_t changed; /* Pins whose level changed */
+};
+
+/*
+ * Pin changes of a GPIO. They are collected in a buffer and handed to
+ * write() a buffer at a time, so logging a change costs little more than
+ * storing it. Their cycles never decrease.
+ */
+struct gpio_log {
+    void (*write)(void *ctx, const struct gpio_change *changes,
+                  unsigned count);
+    void *ctx;
+    const struct gpio_config *config; /* Of the GPIO logged */
+    uint64_t last_cycle; /* Of the last change */
+    unsigned count;
+    struct gpio_change changes[GPIO_LOG_SIZE];
+};
+
+/* A level driven onto a pin from outside at a cycle. */
+struct gpio_input {
+    uint64_t cycle;
+    char port; /* Name of the port, e.g. 'B' */
+    uint8_t pin;
+    int8_t level; /* 0 or 1, or -1 to stop driving the pin */
+};
+
+/* External inputs read from a stimulus file, in the order of their cycles. */
+struct gpio_stimulus {
+    struct gpio_input *inputs;
+    unsigned count;
+};
+
+/*
+ * General purpose I/O ports. The level of a pin is the PORTx bit if it is
+ * an output. An input is at the level driven from outside if any, else
+ * pulled up if its PORTx bit is set, else low. Inputs are driven by a
+ * stimulus, an event at a time, or by gpio_drive(). Nothing is done for a
+ * write that changes no level, so only actual pin changes are logged and
+ * flag interrupts.
+ */
+struct gpio {
+    const struct gpio_config *config;
+    struct event_queue *queue;
+    struct cpu *cpu;
+    struct event input_event;
+    const struct gpio_stimulus *stimulus; /* NULL if none */
+    unsigned next_input; /* Index of the next input of stimulus */
+    struct gpio_log *log; /* NULL if not logged */
+
+    uint8_t ddr[GPIO_MAX_PORTS], port[GPIO_MAX_PORTS];
+    uint8_t driven[GPIO_MAX_PORTS]; /* Pins driven from outside */
+    uint8_t input[GPIO_MAX_PORTS]; /* Levels they are driven to */
+    uint8_t levels[GPIO_MAX_PORTS];
+    uint8_t pcmsk[GPIO_MAX_PORTS];
+    uint8_t pcicr, pcifr;
+};
+
+/* Put gpio in its reset state, without stimulus or log. */
+void gpio_reset(struct gpio *gpio);
+
+/*
+ * Connect a GPIO in its reset state, or a copy of one, to its model, event
+ * queue and CPU.
+ */
+void gpio_attach(struct gpio *gpio, const struct gpio_config *config,
+                 struct event_queue *queue, struct cpu *cpu);
+
+/*
+ * Drive the inputs of gpio from stimulus from now on, or stop if stimulus
+ * is NULL. Inputs whose cycle has passed are applied at once, and inputs of
+ * ports gpio does not have are ignored. MCUs forked from each other share
+ * the stimulus.
+ */
+void gpio_set_stimulus(struct gpio *gpio, const struct gpio_stimulus *stimulus);
+
+/*
+ * Drive the pins in mask of the port whose PINx register is at data address
+ * addr to levels from outside now, e.g. from another MCU. Returns 1 if gpio
+ * has a PINx register there, 0 otherwise.
+ */
+int gpio_drive(struct gpio *gpio, unsigned addr, uint8_t levels, uint8_t mask);
+
+/*
+ * Log the pin changes of gpio, starting with the levels of all pins, or
+ * stop logging if log is NULL.
+ */
+void gpio_connect(struct gpio *gpio, struct gpio_log *log);
+
+/*
+ * Read and write the register of gpio at data address addr. Return 1 if
+ * the GPIO has a register there, 0 otherwise.
+ */
+int gpio_load(struct gpio *gpio, unsigned addr, uint8_t *byte);
+int gpio_store(struct gpio *gpio, unsigned addr, uint8_t byte);
+
+/*
+ * Returns the cycle at which the register of gpio at data address addr may
+ * next change by itself, or EVENT_NEVER.
+ */
+uint64_t gpio_next_change(struct gpio *gpio, unsigned addr);
+
+/*
+ * Clear the flag of interrupt vector when the CPU takes the interrupt.
+ * Returns 1 if the vector is one of gpio, 0 otherwise.
+ */
+int gpio_ack(struct gpio *gpio, unsigned vector);
+
+/* Initialize log to hand pin changes to write() with ctx. */
+void gpio_log_init(struct gpio_log *log,
+                   void (*write)(void *ctx, const struct gpio_change *changes,
+                                 unsigned count),
+                   void *ctx);
+
+/* Hand the changes buffered in log to its writer. */
+void gpio_log_flush(struct gpio_log *log);
+
+/*
+ * Read a stimulus from a text file with a line per input:
+ *
+ *     <cycle> <port><pin> <0|1|z>
+ *
+ * e.g. "16000 D2 0" drives PD2 low at cycle 16000, and z stops driving it.
+ * Cycles must not decrease. Blank lines and text after '#' are ignored.
+ * Returns 0 on success or a negative value on failure, with a message for
+ * a malformed line.
+ */
+int gpio_stimulus_load(struct gpio_stimulus *stimulus, const char *path);
+
+void gpio_stimulus_free(struct gpio_stimulus *stimulus);
+
+#endif
@@ -1,6 +1,7 @@
+#include <pthread.h>
+#include <stddef.h>
 #include "defines.h"
 #include "instruction_set.h"
-#include "log.h"
 
 static void get_params_adc_like(const uint16_t *opcode, uint8_t *Rd, uint8_t *Rr)
 {
@@ -61,465 +62,634 @@ static uint32_t get_params_call_like(const uint16_t *opcode)
     return addr;
 }
 
-int decode_instruction(const uint16_t *opcode, struct instruction *inst)
+static int get_no_operands(const uint16_t *opcode, struct instruction *inst)
 {
-    if ((opcode[0] & 0xff8f) == 0x9488) {
-        inst->op = OP_BCLR;
-        inst->s = get_param_bclr_like(opcode);
-    }
-    else if ((opcode[0] & 0xff8f) == 0x9408) {
-        inst->op = OP_BSET;
-        inst->s = get_param_bclr_like(opcode);
-    }
-    else if (opcode[0] == 0x9509) {
-        inst->op = OP_ICALL;
-    }
-    else if (opcode[0] == 0x9409) {
-        inst->op = OP_IJMP;
-    }
-    else if (opcode[0] == 0x95c8) {
-        inst->op = OP_LPM_R0;
-    }
-    else if ((opcode[0] & 0xfe0e) == 0x9004) {
-        inst->op = OP_LPM;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        inst->bp_operation = opcode[0] & 1 ? BP_POST_INC : BP_NO_OP;
-    }
-    else if (opcode[0] == 0x95d8) {
-        inst->op = OP_ELPM_R0;
+    return 0;
+}
+
+static int get_operands_s(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->s = get_param_bclr_like(opcode);
+    return 0;
+}
+
+static int get_operands_lpm(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = (opcode[0] >> 4) & 0x1f;
+    inst->bp_operation = opcode[0] & 1 ? BP_POST_INC : BP_NO_OP;
+    return 0;
+}
+
+static int get_operands_Rd_Rr(const uint16_t *opcode, struct instruction *inst)
+{
+    get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
+    return 0;
+}
+
+static int get_operands_Rd_K(const uint16_t *opcode, struct instruction *inst)
+{
+    get_params_andi_like(opcode, &inst->Rd, &inst->K);
+    return 0;
+}
+
+static int get_operands_Rd_b(const uint16_t *opcode, struct instruction *inst)
+{
+    get_params_sbrc_like(opcode, &inst->Rd, &inst->b);
+    return 0;
+}
+
+static int get_operands_in(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = (opcode[0] >> 4) & 0x1f;
+    inst->A = opcode[0] & 0xf;
+    inst->A |= (opcode[0] >> 5) & 0x30;
+    return 0;
+}
+
+static int get_operands_out(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rr = (opcode[0] >> 4) & 0x1f;
+    inst->A = opcode[0] & 0xf;
+    inst->A |= (opcode[0] >> 5) & 0x30;
+    return 0;
+}
+
+static int get_operands_adiw(const uint16_t *opcode, struct instruction *inst)
+{
+    get_params_adiw_like(opcode, &inst->Rd, &inst->K);
+    return 0;
+}
+
+static int get_operands_A_b(const uint16_t *opcode, struct instruction *inst)
+{
+    get_params_cbi_like(opcode, &inst->A, &inst->b);
+    return 0;
+}
+
+static int get_operands_branch(const uint16_t *opcode, struct instruction *inst)
+{
+    get_branch_no_sreg_params(opcode, &inst->k);
+    return 0;
+}
+
+static int get_operands_branch_s(const uint16_t *opcode, struct instruction *inst)
+{
+    get_branch_sreg_params(opcode, &inst->k, &inst->s);
+    return 0;
+}
+
+static int get_operands_rjmp(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->k = SIGNED_X_BITS(12, opcode[0] & 0xfff);
+    return 0;
+}
+
+static int get_operands_call(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->k = get_params_call_like(opcode);
+    return 0;
+}
+
+static int get_operands_Rd(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = get_param_asr_like(opcode);
+    return 0;
+}
+
+static int get_operands_movw(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = ((opcode[0] >> 4) & 0xf) * 2;
+    inst->Rr = (opcode[0] & 0xf) * 2;
+    return 0;
+}
+
+static int get_operands_muls(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = ((opcode[0] >> 4) & 0xf) + 16;
+    inst->Rr = (opcode[0] & 0xf) + 16;
+    return 0;
+}
+
+static int get_operands_mulsu(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = ((opcode[0] >> 4) & 0x7) + 16;
+    inst->Rr = (opcode[0] & 0x7) + 16;
+    return 0;
+}
+
+static int get_operands_sts(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rr = (opcode[0] >> 4) & 0x1f;
+    inst->k = opcode[1];
+    return 0;
+}
+
+static int get_operands_lds(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = (opcode[0] >> 4) & 0x1f;
+    inst->k = opcode[1];
+    return 0;
+}
+
+/* Base pointer and displacement q of LDD and STD. */
+static void get_params_ldd_like(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->bp = opcode[0] & 0x8 ? BP_Y : BP_Z;
+    inst->q = opcode[0] & 0x7;
+    inst->q |= (opcode[0] >> 7) & 0x18;
+    inst->q |= (opcode[0] >> 8) & 0x20;
+}
+
+/*
+ * Base pointer and base pointer operation of LD and ST.
+ * Returns a negative value if the encoding is reserved.
+ */
+static int get_params_ld_like(const uint16_t *opcode, struct instruction *inst)
+{
+    int rc = 0;
+
+    switch (opcode[0] & 0xc) {
+    case 0:
+        inst->bp = BP_Z;
+        break;
+    case 8:
+        inst->bp = BP_Y;
+        break;
+    case 12:
+        inst->bp = BP_X;
+        break;
+    default:
+        rc = -1;
+        break;
+    }
+    switch (opcode[0] & 0x3) {
+    case 0:
+        inst->bp_operation = BP_NO_OP;
+        break;
+    case 1:
+        inst->bp_operation = BP_POST_INC;
+        break;
+    case 2:
+        inst->bp_operation = BP_PRE_DEC;
+        break;
+    default:
+        rc = -1;
+        break;
     }
-    else if ((opcode[0] & 0xfe0e) == 0x9006) {
-        inst->op = OP_ELPM;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        inst->bp_operation = opcode[0] & 1 ? BP_POST_INC : BP_NO_OP;
+
+    return rc;
+}
+
+static int get_operands_ldd(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = (opcode[0] >> 4) & 0x1f;
+    get_params_ldd_like(opcode, inst);
+    return 0;
+}
+
+static int get_operands_ld(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rd = (opcode[0] >> 4) & 0x1f;
+    return get_params_ld_like(opcode, inst);
+}
+
+static int get_operands_std(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rr = (opcode[0] >> 4) & 0x1f;
+    get_params_ldd_like(opcode, inst);
+    return 0;
+}
+
+static int get_operands_st(const uint16_t *opcode, struct instruction *inst)
+{
+    inst->Rr = (opcode[0] >> 4) & 0x1f;
+    return get_params_ld_like(opcode, inst);
+}
+
+struct opcode_pattern {
+    uint16_t mask;
+    uint16_t value; /* An opcode matches if (opcode & mask) == value */
+    enum operation op;
+    uint8_t length; /* Opcode length in words */
+    /* Extract operands. Returns a negative value on a reserved encoding. */
+    int (*get_operands)(const uint16_t *opcode, struct instruction *inst);
+};
+
+/*
+ * Opcode specification. When several patterns match an opcode, the one that
+ * is listed first is used (e.g. ORI shadows SBR and BRCS shadows BRLO).
+ */
+static const struct opcode_pattern opcode_patterns[] = {
+    { 0xff8f, 0x9488, OP_BCLR,     1, get_operands_s },
+    { 0xff8f, 0x9408, OP_BSET,     1, get_operands_s },
+    { 0xffff, 0x9509, OP_ICALL,    1, get_no_operands },
+    { 0xffff, 0x9409, OP_IJMP,     1, get_no_operands },
+    { 0xffff, 0x95c8, OP_LPM_R0,   1, get_no_operands },
+    { 0xfe0e, 0x9004, OP_LPM,      1, get_operands_lpm },
+    { 0xffff, 0x95d8, OP_ELPM_R0,  1, get_no_operands },
+    { 0xfe0e, 0x9006, OP_ELPM,     1, get_operands_lpm },
+    { 0xffff, 0x0000, OP_NOP,      1, get_no_operands },
+    { 0xffff, 0x9508, OP_RET,      1, get_no_operands },
+    { 0xffff, 0x9518, OP_RETI,     1, get_no_operands },
+    { 0xffff, 0x9588, OP_SLEEP,    1, get_no_operands },
+    { 0xffff, 0x9598, OP_BREAK,    1, get_no_operands },
+    { 0xffff, 0x95a8, OP_WDR,      1, get_no_operands },
+    { 0xffff, 0x95e8, OP_SPM,      1, get_no_operands },
+    { 0xfc00, 0x1c00, OP_ADC,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x0c00, OP_ADD,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x2000, OP_AND,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x1400, OP_CP,       1, get_operands_Rd_Rr },
+    { 0xfc00, 0x0400, OP_CPC,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x1000, OP_CPSE,     1, get_operands_Rd_Rr },
+    { 0xfc00, 0x2400, OP_EOR,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x2c00, OP_MOV,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x9c00, OP_MUL,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x2800, OP_OR,       1, get_operands_Rd_Rr },
+    { 0xfc00, 0x0800, OP_SBC,      1, get_operands_Rd_Rr },
+    { 0xfc00, 0x1800, OP_SUB,      1, get_operands_Rd_Rr },
+    { 0xf000, 0x7000, OP_ANDI,     1, get_operands_Rd_K },
+    { 0xf000, 0xe000, OP_LDI,      1, get_operands_Rd_K },
+    { 0xf000, 0x6000, OP_ORI,      1, get_operands_Rd_K },
+    { 0xf000, 0x6000, OP_SBR,      1, get_operands_Rd_K },
+    { 0xf000, 0x3000, OP_CPI,      1, get_operands_Rd_K },
+    { 0xf000, 0x4000, OP_SBCI,     1, get_operands_Rd_K },
+    { 0xf000, 0x5000, OP_SUBI,     1, get_operands_Rd_K },
+    { 0xfe08, 0xfc00, OP_SBRC,     1, get_operands_Rd_b },
+    { 0xfe08, 0xfe00, OP_SBRS,     1, get_operands_Rd_b },
+    { 0xfe08, 0xf800, OP_BLD,      1, get_operands_Rd_b },
+    { 0xfe08, 0xfa00, OP_BST,      1, get_operands_Rd_b },
+    { 0xf800, 0xb000, OP_IN,       1, get_operands_in },
+    { 0xf800, 0xb800, OP_OUT,      1, get_operands_out },
+    { 0xff00, 0x9600, OP_ADIW,     1, get_operands_adiw },
+    { 0xff00, 0x9700, OP_SBIW,     1, get_operands_adiw },
+    { 0xff00, 0x9800, OP_CBI,      1, get_operands_A_b },
+    { 0xff00, 0x9a00, OP_SBI,      1, get_operands_A_b },
+    { 0xff00, 0x9900, OP_SBIC,     1, get_operands_A_b },
+    { 0xff00, 0x9b00, OP_SBIS,     1, get_operands_A_b },
+    { 0xfc07, 0xf400, OP_BRCC,     1, get_operands_branch },
+    { 0xfc07, 0xf000, OP_BRCS,     1, get_operands_branch },
+    { 0xfc07, 0xf001, OP_BREQ,     1, get_operands_branch },
+    { 0xfc07, 0xf404, OP_BRGE,     1, get_operands_branch },
+    { 0xfc07, 0xf405, OP_BRHC,     1, get_operands_branch },
+    { 0xfc07, 0xf005, OP_BRHS,     1, get_operands_branch },
+    { 0xfc07, 0xf407, OP_BRID,     1, get_operands_branch },
+    { 0xfc07, 0xf007, OP_BRIE,     1, get_operands_branch },
+    { 0xfc07, 0xf000, OP_BRLO,     1, get_operands_branch },
+    { 0xfc07, 0xf004, OP_BRLT,     1, get_operands_branch },
+    { 0xfc07, 0xf002, OP_BRMI,     1, get_operands_branch },
+    { 0xfc07, 0xf401, OP_BRNE,     1, get_operands_branch },
+    { 0xfc07, 0xf402, OP_BRPL,     1, get_operands_branch },
+    { 0xfc07, 0xf400, OP_BRSH,     1, get_operands_branch },
+    { 0xfc07, 0xf406, OP_BRTC,     1, get_operands_branch },
+    { 0xfc07, 0xf006, OP_BRTS,     1, get_operands_branch },
+    { 0xfc07, 0xf403, OP_BRVC,     1, get_operands_branch },
+    { 0xfc07, 0xf003, OP_BRVS,     1, get_operands_branch },
+    { 0xfc00, 0xf400, OP_BRBC,     1, get_operands_branch_s },
+    { 0xfc00, 0xf000, OP_BRBS,     1, get_operands_branch_s },
+    { 0xf000, 0xd000, OP_RCALL,    1, get_operands_rjmp },
+    { 0xf000, 0xc000, OP_RJMP,     1, get_operands_rjmp },
+    { 0xfe0e, 0x940e, OP_CALL,     2, get_operands_call },
+    { 0xfe0e, 0x940c, OP_JMP,      2, get_operands_call },
+    { 0xfe0f, 0x9405, OP_ASR,      1, get_operands_Rd },
+    { 0xfe0f, 0x9400, OP_COM,      1, get_operands_Rd },
+    { 0xfe0f, 0x940a, OP_DEC,      1, get_operands_Rd },
+    { 0xfe0f, 0x9403, OP_INC,      1, get_operands_Rd },
+    { 0xfe0f, 0x9406, OP_LSR,      1, get_operands_Rd },
+    { 0xfe0f, 0x9401, OP_NEG,      1, get_operands_Rd },
+    { 0xfe0f, 0x900f, OP_POP,      1, get_operands_Rd },
+    { 0xfe0f, 0x920f, OP_PUSH,     1, get_operands_Rd },
+    { 0xfe0f, 0x9407, OP_ROR,      1, get_operands_Rd },
+    { 0xfe0f, 0x9402, OP_SWAP,     1, get_operands_Rd },
+    { 0xff00, 0x0100, OP_MOVW,     1, get_operands_movw },
+    { 0xff00, 0x0200, OP_MULS,     1, get_operands_muls },
+    { 0xff88, 0x0300, OP_MULSU,    1, get_operands_mulsu },
+    { 0xff88, 0x0308, OP_FMUL,     1, get_operands_mulsu },
+    { 0xff88, 0x0380, OP_FMULS,    1, get_operands_mulsu },
+    { 0xff88, 0x0388, OP_FMULSU,   1, get_operands_mulsu },
+    { 0xfe0f, 0x9200, OP_STS,      2, get_operands_sts },
+    { 0xfe0f, 0x9000, OP_LDS,      2, get_operands_lds },
+    { 0xd200, 0x8000, OP_LDD,      1, get_operands_ldd },
+    { 0xee00, 0x8000, OP_LD,       1, get_operands_ld },
+    { 0xd200, 0x8200, OP_STD,      1, get_operands_std },
+    { 0xee00, 0x8200, OP_ST,       1, get_operands_st },
+    { 0xffff, 0x9519, OP_EICALL,   1, get_no_operands },
+    { 0xffff, 0x9419, OP_EIJMP,    1, get_no_operands },
+};
+
+/*
+ * For every 16-bit opcode, one plus the index of the first pattern in
+ * opcode_patterns that matches it, or 0 if the opcode is illegal.
+ */
+static uint8_t decode_table[0x10000];
+static pthread_once_t decode_table_once = PTHREAD_ONCE_INIT;
+
+static void build_decode_table(void)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(opcode_patterns); ++i) {
+        const struct opcode_pattern *p = &opcode_patterns[i];
+        uint16_t dont_care = ~p->mask;
+        uint16_t bits = dont_care;
+
+        /* Visit every opcode matching p by enumerating the don't care bits. */
+        for (;;) {
+            uint16_t opcode = p->value | bits;
+
+            if (decode_table[opcode] == 0) {
+                decode_table[opcode] = i + 1;
+            }
+            if (bits == 0) {
+                break;
+            }
+            bits = (bits - 1) & dont_care;
+        }
     }
-    else if (opcode[0] == 0x0) {
+
+}
+
+static const struct opcode_pattern *lookup_opcode(uint16_t opcode)
+{
+    uint8_t index;
+
+    pthread_once(&decode_table_once, build_decode_table);
+
+    index = decode_table[opcode];
+    return index ? &opcode_patterns[index - 1] : NULL;
+}
+
+int decode_instruction(const uint16_t *opcode, struct instruction *inst)
+{
+    const struct opcode_pattern *pattern;
+
+    pattern = lookup_opcode(opcode[0]);
+    if (!pattern) {
         inst->op = OP_NOP;
+        return -1;
     }
-    else if (opcode[0] == 0x9508) {
-        inst->op = OP_RET;
-    }
-    else if (opcode[0] == 0x9518) {
-        inst->op = OP_RETI;
-    }
-    else if (opcode[0] == 0x9588) {
-        inst->op = OP_SLEEP;
-    }
-    else if (opcode[0] == 0x9598) {
-        inst->op = OP_BREAK;
-    }
-    else if (opcode[0] == 0x95a8) {
-        inst->op = OP_WDR;
-    }
-    else if (opcode[0] == 0x95e8) {
-        inst->op = OP_SPM;
-    }
-    else if ((opcode[0] & 0xfc00) == 0x1c00) {
-        inst->op = OP_ADC;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0xc00) {
-        inst->op = OP_ADD;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x2000) {
-        inst->op = OP_AND;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x1400) {
-        inst->op = OP_CP;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x400) {
-        inst->op = OP_CPC;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x1000) {
-        inst->op = OP_CPSE;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x2400) {
-        inst->op = OP_EOR;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x2c00) {
-        inst->op = OP_MOV;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x9c00) {
-        inst->op = OP_MUL;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x2800) {
-        inst->op = OP_OR;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x800) {
-        inst->op = OP_SBC;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xfc00) == 0x1800) {
-        inst->op = OP_SUB;
-        get_params_adc_like(opcode, &inst->Rd, &inst->Rr);
-    }
-    else if ((opcode[0] & 0xf000) == 0x7000) {
-        inst->op = OP_ANDI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0xe000) {
-        inst->op = OP_LDI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0x6000) {
-        inst->op = OP_ORI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0x6000) {
-        inst->op = OP_SBR;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0x3000) {
-        inst->op = OP_CPI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0x4000) {
-        inst->op = OP_SBCI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xf000) == 0x5000) {
-        inst->op = OP_SUBI;
-        get_params_andi_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xfe08) == 0xfc00) {
-        inst->op = OP_SBRC;
-        get_params_sbrc_like(opcode, &inst->Rd, &inst->b);
-    }
-    else if ((opcode[0] & 0xfe08) == 0xfe00) {
-        inst->op = OP_SBRS;
-        get_params_sbrc_like(opcode, &inst->Rd, &inst->b);
-    }
-    else if ((opcode[0] & 0xfe08) == 0xf800) {
-        inst->op = OP_BLD;
-        get_params_sbrc_like(opcode, &inst->Rd, &inst->b);
-    }
-    else if ((opcode[0] & 0xfe08) == 0xfa00) {
-        inst->op = OP_BST;
-        get_params_sbrc_like(opcode, &inst->Rd, &inst->b);
-    }
-    else if ((opcode[0] & 0xf800) == 0xb000) {
-        inst->op = OP_IN;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        inst->A = opcode[0] & 0xf;
-        inst->A |= (opcode[0] >> 5) & 0x30;
-    }
-    else if ((opcode[0] & 0xf800) == 0xb800) {
-        inst->op = OP_OUT;
-        inst->Rr = (opcode[0] >> 4) & 0x1f;
-        inst->A = opcode[0] & 0xf;
-        inst->A |= (opcode[0] >> 5) & 0x30;
-    }
-    else if ((opcode[0] & 0xff00) == 0x9600) {
-        inst->op = OP_ADIW;
-        get_params_adiw_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xff00) == 0x9700) {
-        inst->op = OP_SBIW;
-        get_params_adiw_like(opcode, &inst->Rd, &inst->K);
-    }
-    else if ((opcode[0] & 0xff00) == 0x9800) {
-        inst->op = OP_CBI;
-        get_params_cbi_like(opcode, &inst->A, &inst->b);
-    }
-    else if ((opcode[0] & 0xff00) == 0x9a00) {
-        inst->op = OP_SBI;
-        get_params_cbi_like(opcode, &inst->A, &inst->b);
-    }
-    else if ((opcode[0] & 0xff00) == 0x9900) {
-        inst->op = OP_SBIC;
-        get_params_cbi_like(opcode, &inst->A, &inst->b);
-    }
-    else if ((opcode[0] & 0xff00) == 0x9b00) {
-        inst->op = OP_SBIS;
-        get_params_cbi_like(opcode, &inst->A, &inst->b);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf400) {
-        inst->op = OP_BRCC;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf000) {
-        inst->op = OP_BRCS;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf001) {
-        inst->op = OP_BREQ;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf404) {
-        inst->op = OP_BRGE;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf405) {
-        inst->op = OP_BRHC;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf005) {
-        inst->op = OP_BRHS;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf407) {
-        inst->op = OP_BRID;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf007) {
-        inst->op = OP_BRIE;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf000) {
-        inst->op = OP_BRLO;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf004) {
-        inst->op = OP_BRLT;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf002) {
-        inst->op = OP_BRMI;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf401) {
-        inst->op = OP_BRNE;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf402) {
-        inst->op = OP_BRPL;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf400) {
-        inst->op = OP_BRSH;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf406) {
-        inst->op = OP_BRTC;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf006) {
-        inst->op = OP_BRTS;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf403) {
-        inst->op = OP_BRVC;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc07) == 0xf003) {
-        inst->op = OP_BRVS;
-        get_branch_no_sreg_params(opcode, &inst->k);
-    }
-    else if ((opcode[0] & 0xfc00) == 0xf400) {
-        inst->op = OP_BRBC;
-        get_branch_sreg_params(opcode, &inst->k, &inst->s);
-    }
-    else if ((opcode[0] & 0xfc00) == 0xf000) {
-        inst->op = OP_BRBS;
-        get_branch_sreg_params(opcode, &inst->k, &inst->s);
-    }
-    else if ((opcode[0] & 0xf000) == 0xd000) {
-        inst->op = OP_RCALL;
-        inst->k = opcode[0] & 0xfff;
-    }
-    else if ((opcode[0] & 0xf000) == 0xc000) {
-        inst->op = OP_RJMP;
-        inst->k = opcode[0] & 0xfff;
-    }
-    else if ((opcode[0] & 0xfe0e) == 0x940e) {
-        inst->op = OP_CALL;
-        inst->k = get_params_call_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0e) == 0x940c) {
-        inst->op = OP_JMP;
-        inst->k = get_params_call_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9405) {
-        inst->op = OP_ASR;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9400) {
-        inst->op = OP_COM;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x940a) {
-        inst->op = OP_DEC;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9403) {
-        inst->op = OP_INC;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9406) {
-        inst->op = OP_LSR;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9401) {
-        inst->op = OP_NEG;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x900f) {
-        inst->op = OP_POP;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x920f) {
-        inst->op = OP_PUSH;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9407) {
-        inst->op = OP_ROR;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9402) {
-        inst->op = OP_SWAP;
-        inst->Rd = get_param_asr_like(opcode);
-    }
-    else if ((opcode[0] & 0xff00) == 0x100) {
-        inst->op = OP_MOVW;
-        inst->Rd = ((opcode[0] >> 4) & 0xf) * 2;
-        inst->Rr = (opcode[0] & 0xf) * 2;
-    }
-    else if ((opcode[0] & 0xff00) == 0x200) {
-        inst->op = OP_MULS;
-        inst->Rd = ((opcode[0] >> 4) & 0xf) + 16;
-        inst->Rr = (opcode[0] & 0xf) + 16;
-    }
-    else if ((opcode[0] & 0xff88) == 0x300) {
-        inst->op = OP_MULSU;
-        inst->Rd = ((opcode[0] >> 4) & 0x7) + 16;
-        inst->Rr = (opcode[0] & 0x7) + 16;
-    }
-    else if ((opcode[0] & 0xff88) == 0x308) {
-        inst->op = OP_FMUL;
-        inst->Rd = ((opcode[0] >> 4) & 0x7) + 16;
-        inst->Rr = (opcode[0] & 0x7) + 16;
-    }
-    else if ((opcode[0] & 0xff88) == 0x380) {
-        inst->op = OP_FMULS;
-        inst->Rd = ((opcode[0] >> 4) & 0x7) + 16;
-        inst->Rr = (opcode[0] & 0x7) + 16;
-    }
-    else if ((opcode[0] & 0xff88) == 0x388) {
-        inst->op = OP_FMULSU;
-        inst->Rd = ((opcode[0] >> 4) & 0x7) + 16;
-        inst->Rr = (opcode[0] & 0x7) + 16;
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9200) {
-        inst->op = OP_STS;
-        inst->Rr = (opcode[0] >> 4) & 0x1f;
-        inst->k = opcode[1];
-    }
-    else if ((opcode[0] & 0xfe0f) == 0x9000) {
-        inst->op = OP_LDS;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        inst->k = opcode[1];
-    }
-    else if ((opcode[0] & 0xd200) == 0x8000) {
-        inst->op = OP_LDD;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        inst->bp = opcode[0] & 0x8 ? BP_Y : BP_Z;
-        inst->q = opcode[0] & 0x3;
-        inst->q |= (opcode[0] >> 7) & 0x18;
-        inst->q |= (opcode[0] >> 8) & 0x20;
-    }
-    else if ((opcode[0] & 0xee00) == 0x8000) {
-        inst->op = OP_LD;
-        inst->Rd = (opcode[0] >> 4) & 0x1f;
-        switch (opcode[0] & 0xc) {
-        case 0:
-            inst->bp = BP_Z;
-            break;
-        case 8:
-            inst->bp = BP_Y;
-            break;
-        case 12:
-            inst->bp = BP_X;
-            break;
-        default:
-            // illegal
-            break;
-        }
-        switch (opcode[0] & 0x3) {
-        case 0:
-            inst->bp_operation = BP_NO_OP;
-            break;
-        case 1:
-            inst->bp_operation = BP_POST_INC;
-            break;
-        case 2:
-            inst->bp_operation = BP_PRE_DEC;
-            break;
-        default:
-            // illegal
-            break;
-        }
+
+    inst->op = pattern->op;
+    return pattern->get_operands(opcode, inst);
+}
+
+int opcode_length(uint16_t opcode_begin)
+{
+    const struct opcode_pattern *pattern;
+
+    pattern = lookup_opcode(opcode_begin);
+    return pattern ? pattern->length : 1;
+}
+
+/*
+ * Cycles taken by each operation on each core, from the AVR Instruction Set
+ * Manual. 0 means the operation is not available on that core.
+ */
+static const uint8_t operation_cycles[OPERATION_COUNT][CORE_COUNT] = {
+    /*              AVR AVRe AVRe+ AVRxm AVRxt AVRrc */
+    [OP_ADC]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_ADD]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_ADIW]    = { 2,  2,   2,    2,    2,    0 },
+    [OP_AND]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_ANDI]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_ASR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_BCLR]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BLD]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRBC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRBS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRCC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRCS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BREAK]   = { 1,  1,   1,    1,    1,    1 },
+    [OP_BREQ]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRGE]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRHC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRHS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRID]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRIE]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRLO]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRLT]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRMI]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRNE]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRPL]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRSH]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRTC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRTS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRVC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BRVS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BSET]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_BST]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_CALL]    = { 4,  4,   4,    3,    3,    0 },
+    [OP_CBI]     = { 2,  2,   2,    1,    1,    1 },
+    [OP_COM]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_CP]      = { 1,  1,   1,    1,    1,    1 },
+    [OP_CPC]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_CPI]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_CPSE]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_DEC]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_DES]     = { 0,  0,   0,    1,    0,    0 },
+    [OP_EICALL]  = { 0,  0,   4,    3,    3,    0 },
+    [OP_EIJMP]   = { 0,  0,   2,    2,    2,    0 },
+    [OP_ELPM_R0] = { 0,  0,   3,    3,    3,    0 },
+    [OP_ELPM]    = { 0,  0,   3,    3,    3,    0 },
+    [OP_EOR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_FMUL]    = { 0,  2,   2,    2,    2,    0 },
+    [OP_FMULS]   = { 0,  2,   2,    2,    2,    0 },
+    [OP_FMULSU]  = { 0,  2,   2,    2,    2,    0 },
+    [OP_ICALL]   = { 3,  3,   3,    2,    2,    3 },
+    [OP_IJMP]    = { 2,  2,   2,    2,    2,    2 },
+    [OP_IN]      = { 1,  1,   1,    1,    1,    1 },
+    [OP_INC]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_JMP]     = { 3,  3,   3,    3,    3,    0 },
+    [OP_LAC]     = { 0,  0,   0,    2,    0,    0 },
+    [OP_LAS]     = { 0,  0,   0,    2,    0,    0 },
+    [OP_LAT]     = { 0,  0,   0,    2,    0,    0 },
+    [OP_LDD]     = { 2,  2,   2,    2,    2,    0 },
+    [OP_LD]      = { 2,  2,   2,    1,    2,    1 },
+    [OP_LDI]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_LDS]     = { 2,  2,   2,    2,    3,    1 },
+    [OP_LPM_R0]  = { 3,  3,   3,    3,    3,    0 },
+    [OP_LPM]     = { 0,  3,   3,    3,    3,    0 },
+    [OP_LSR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_MOV]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_MOVW]    = { 0,  1,   1,    1,    1,    0 },
+    [OP_MUL]     = { 0,  2,   2,    2,    2,    0 },
+    [OP_MULS]    = { 0,  2,   2,    2,    2,    0 },
+    [OP_MULSU]   = { 0,  2,   2,    2,    2,    0 },
+    [OP_NEG]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_NOP]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_OR]      = { 1,  1,   1,    1,    1,    1 },
+    [OP_ORI]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_OUT]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_POP]     = { 2,  2,   2,    2,    2,    3 },
+    [OP_PUSH]    = { 2,  2,   2,    1,    1,    1 },
+    [OP_RCALL]   = { 3,  3,   3,    2,    2,    3 },
+    [OP_RET]     = { 4,  4,   4,    4,    4,    6 },
+    [OP_RETI]    = { 4,  4,   4,    4,    4,    6 },
+    [OP_RJMP]    = { 2,  2,   2,    2,    2,    2 },
+    [OP_ROR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_SBC]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_SBCI]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_SBI]     = { 2,  2,   2,    1,    1,    1 },
+    [OP_SBIC]    = { 1,  1,   1,    2,    1,    1 },
+    [OP_SBIS]    = { 1,  1,   1,    2,    1,    1 },
+    [OP_SBIW]    = { 2,  2,   2,    2,    2,    0 },
+    [OP_SBR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_SBRC]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_SBRS]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_SLEEP]   = { 1,  1,   1,    1,    1,    1 },
+    [OP_SPM]     = { 0,  1,   1,    1,    1,    0 },
+    [OP_STD]     = { 2,  2,   2,    2,    1,    0 },
+    [OP_ST]      = { 2,  2,   2,    1,    1,    1 },
+    [OP_STS]     = { 2,  2,   2,    2,    2,    1 },
+    [OP_SUB]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_SUBI]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_SWAP]    = { 1,  1,   1,    1,    1,    1 },
+    [OP_WDR]     = { 1,  1,   1,    1,    1,    1 },
+    [OP_XCH]     = { 0,  0,   0,    2,    0,    0 },
+};
+
+unsigned instruction_cycles(const struct instruction *inst, enum cpu_core core,
+                            unsigned pc_width)
+{
+    unsigned cycles;
+
+    if (inst->op >= OPERATION_COUNT || core >= CORE_COUNT) {
+        return 1;
     }
-    else if ((opcode[0] & 0xd200) == 0x8200) {
-        inst->op = OP_STD;
-        inst->Rr = (opcode[0] >> 4) & 0x1f;
-        inst->bp = opcode[0] & 0x8 ? BP_Y : BP_Z;
-        inst->q = opcode[0] & 0x3;
-        inst->q |= (opcode[0] >> 7) & 0x18;
-        inst->q |= (opcode[0] >> 8) & 0x20;
+
+    cycles = operation_cycles[inst->op][core];
+    if (cycles == 0) {
+        /* Not available on this core; charge a single cycle. */
+        return 1;
     }
-    else if ((opcode[0] & 0xee00) == 0x8200) {
-        inst->op = OP_ST;
-        inst->Rr = (opcode[0] >> 4) & 0x1f;
-        switch (opcode[0] & 0xc) {
-        case 0:
-            inst->bp = BP_Z;
-            break;
-        case 8:
-            inst->bp = BP_Y;
-            break;
-        case 12:
-            inst->bp = BP_X;
-            break;
-        default:
-            // illegal
-            break;
+
+    switch (inst->op) {
+    case OP_CALL:
+    case OP_ICALL:
+    case OP_RCALL:
+    case OP_RET:
+    case OP_RETI:
+        /* A 22-bit program counter takes one more stack access. */
+        if (pc_width > 16 && core != CORE_AVRRC) {
+            cycles++;
         }
-        switch (opcode[0] & 0x3) {
-        case 0:
-            inst->bp_operation = BP_NO_OP;
-            break;
-        case 1:
-            inst->bp_operation = BP_POST_INC;
-            break;
-        case 2:
-            inst->bp_operation = BP_PRE_DEC;
-            break;
-        default:
-            // illegal
-            break;
+        break;
+    case OP_LD:
+    case OP_ST:
+        /* Pre-decrement takes an extra cycle on reduced-latency cores. */
+        if (inst->bp_operation == BP_PRE_DEC &&
+            (core == CORE_AVRXM || core == CORE_AVRRC)) {
+            cycles++;
         }
-    }
-    else if (opcode[0] == 0x9519) {
-        inst->op = OP_EICALL;
-    }
-    else if (opcode[0] == 0x9419) {
-        inst->op = OP_EIJMP;
-    }
-    else {
-        warn("unimplemented opcode 0x%x, interpret as nop\n", opcode[0]);
-        inst->op = OP_NOP;
+        break;
+    default:
+        break;
     }
 
-    return 0;
+    return cycles;
 }
 
-int opcode_length(uint16_t opcode_begin)
-{
-    if (((opcode_begin & 0xfe0e) == 0x940e) || // CALL
-        ((opcode_begin & 0xfe0e) == 0x940c) || // JMP
-        ((opcode_begin & 0xfe0f) == 0x9000) || // LDS
-        ((opcode_begin & 0xfe0f) == 0x9200)) { // STS
-        return 2;
-    }
+/* Mnemonics of the operations. */
+static const char *const operation_names[OPERATION_COUNT] = {
+    [OP_ADC]       = "adc",
+    [OP_ADD]       = "add",
+    [OP_ADIW]      = "adiw",
+    [OP_AND]       = "and",
+    [OP_ANDI]      = "andi",
+    [OP_ASR]       = "asr",
+    [OP_BCLR]      = "bclr",
+    [OP_BLD]       = "bld",
+    [OP_BRBC]      = "brbc",
+    [OP_BRBS]      = "brbs",
+    [OP_BRCC]      = "brcc",
+    [OP_BRCS]      = "brcs",
+    [OP_BREAK]     = "break",
+    [OP_BREQ]      = "breq",
+    [OP_BRGE]      = "brge",
+    [OP_BRHC]      = "brhc",
+    [OP_BRHS]      = "brhs",
+    [OP_BRID]      = "brid",
+    [OP_BRIE]      = "brie",
+    [OP_BRLO]      = "brlo",
+    [OP_BRLT]      = "brlt",
+    [OP_BRMI]      = "brmi",
+    [OP_BRNE]      = "brne",
+    [OP_BRPL]      = "brpl",
+    [OP_BRSH]      = "brsh",
+    [OP_BRTC]      = "brtc",
+    [OP_BRTS]      = "brts",
+    [OP_BRVC]      = "brvc",
+    [OP_BRVS]      = "brvs",
+    [OP_BSET]      = "bset",
+    [OP_BST]       = "bst",
+    [OP_CALL]      = "call",
+    [OP_CBI]       = "cbi",
+    [OP_COM]       = "com",
+    [OP_CP]        = "cp",
+    [OP_CPC]       = "cpc",
+    [OP_CPI]       = "cpi",
+    [OP_CPSE]      = "cpse",
+    [OP_DEC]       = "dec",
+    [OP_DES]       = "des",
+    [OP_EICALL]    = "eicall",
+    [OP_EIJMP]     = "eijmp",
+    [OP_ELPM_R0]   = "elpm",
+    [OP_ELPM]      = "elpm",
+    [OP_EOR]       = "eor",
+    [OP_FMUL]      = "fmul",
+    [OP_FMULS]     = "fmuls",
+    [OP_FMULSU]    = "fmulsu",
+    [OP_ICALL]     = "icall",
+    [OP_IJMP]      = "ijmp",
+    [OP_IN]        = "in",
+    [OP_INC]       = "inc",
+    [OP_JMP]       = "jmp",
+    [OP_LAC]       = "lac",
+    [OP_LAS]       = "las",
+    [OP_LAT]       = "lat",
+    [OP_LDD]       = "ldd",
+    [OP_LD]        = "ld",
+    [OP_LDI]       = "ldi",
+    [OP_LDS]       = "lds",
+    [OP_LPM_R0]    = "lpm",
+    [OP_LPM]       = "lpm",
+    [OP_LSR]       = "lsr",
+    [OP_MOV]       = "mov",
+    [OP_MOVW]      = "movw",
+    [OP_MUL]       = "mul",
+    [OP_MULS]      = "muls",
+    [OP_MULSU]     = "mulsu",
+    [OP_NEG]       = "neg",
+    [OP_NOP]       = "nop",
+    [OP_OR]        = "or",
+    [OP_ORI]       = "ori",
+    [OP_OUT]       = "out",
+    [OP_POP]       = "pop",
+    [OP_PUSH]      = "push",
+    [OP_RCALL]     = "rcall",
+    [OP_RET]       = "ret",
+    [OP_RETI]      = "reti",
+    [OP_RJMP]      = "rjmp",
+    [OP_ROR]       = "ror",
+    [OP_SBC]       = "sbc",
+    [OP_SBCI]      = "sbci",
+    [OP_SBI]       = "sbi",
+    [OP_SBIC]      = "sbic",
+    [OP_SBIS]      = "sbis",
+    [OP_SBIW]      = "sbiw",
+    [OP_SBR]       = "sbr",
+    [OP_SBRC]      = "sbrc",
+    [OP_SBRS]      = "sbrs",
+    [OP_SLEEP]     = "sleep",
+    [OP_SPM]       = "spm",
+    [OP_STD]       = "std",
+    [OP_ST]        = "st",
+    [OP_STS]       = "sts",
+    [OP_SUB]       = "sub",
+    [OP_SUBI]      = "subi",
+    [OP_SWAP]      = "swap",
+    [OP_WDR]       = "wdr",
+    [OP_XCH]       = "xch",
+};
 
-    return 1;
+const char *operation_name(enum operation op)
+{
+    return op < OPERATION_COUNT ? operation_names[op] : "?";
 }
@@ -103,6 +103,19 @@ enum operation {
     OP_SWAP,
     OP_WDR,
     OP_XCH,
+
+    OPERATION_COUNT /* Number of operations */
+};
+
+enum cpu_core {
+    CORE_AVR,   /* AVR */
+    CORE_AVRE,  /* AVRe */
+    CORE_AVREP, /* AVRe+ */
+    CORE_AVRXM, /* AVRxm*/
+    CORE_AVRXT, /* AVRxt */
+    CORE_AVRRC, /* AVRrc */
+
+    CORE_COUNT /* Number of cores */
 };
 
 enum base_pointer {
@@ -134,9 +147,26 @@ struct instruction {
     } bp_operation;
 };
 
+/*
+ * Decode the instruction whose opcode starts at opcode[0]; opcode[1] is read
+ * only by two-word instructions. Returns 0 on success or a negative value if
+ * the opcode is illegal or reserved, in which case inst->op is OP_NOP for an
+ * opcode that does not match any instruction.
+ */
 int decode_instruction(const uint16_t *opcode, struct instruction *inst);
 
 /* Return opcode length (1 or 2) in words. */
 int opcode_length(uint16_t opcode_beginning);
 
+/*
+ * Return the number of cycles inst takes on core with a program counter of
+ * pc_width bits. A taken branch takes one cycle more and a skip takes one
+ * more cycle per word skipped; these are not included.
+ */
+unsigned instruction_cycles(const struct instruction *inst, enum cpu_core core,
+                            unsigned pc_width);
+
+/* Returns the mnemonic of op, e.g. "adc". */
+const char *operation_name(enum operation op);
+
 #endif
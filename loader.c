@@ -0,0 +1,408 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "defines.h"
+#include "loader.h"
+#include "log.h"
+
+#define FAILED(status) ((status) < 0)
+
+/* Addresses of memories other than flash in AVR ELF files. */
+#define ELF_DATA_BASE   0x800000
+#define ELF_EEPROM_BASE 0x810000
+#define ELF_EEPROM_END  0x820000
+
+static int load_flash(struct firmware *fw, struct atmega328p *mcu,
+                      unsigned addr, const void *data, unsigned size)
+{
+    if (FAILED(mcu->flash_bus.write(mcu, addr, data, size))) {
+        warn("firmware does not fit in flash (0x%x..0x%x)\n", addr,
+             addr + size);
+        return -1;
+    }
+    if (addr + size > fw->flash_size) {
+        fw->flash_size = addr + size;
+    }
+    return 0;
+}
+
+static int load_eeprom(struct firmware *fw, struct atmega328p *mcu,
+                       unsigned addr, const void *data, unsigned size)
+{
+    if (addr + size > ATMEGA328P_EEPROM_SIZE || addr + size < addr) {
+        warn("firmware does not fit in EEPROM (0x%x..0x%x)\n", addr,
+             addr + size);
+        return -1;
+    }
+    memcpy(&mcu->eeprom[addr], data, size);
+    if (addr + size > fw->eeprom_size) {
+        fw->eeprom_size = addr + size;
+    }
+    return 0;
+}
+
+/* Returns 1 if offset..offset+size-1 lies within the mapped file. */
+static _Bool in_map(const struct firmware *fw, uint64_t offset, uint64_t size)
+{
+    return offset <= fw->map_size && size <= fw->map_size - offset;
+}
+
+/*
+ * Returns the load address of an allocated section, which differs from its
+ * address for initialized data that is copied from flash to RAM at startup.
+ */
+static uint32_t section_lma(const Elf32_Ehdr *eh, const Elf32_Phdr *ph,
+                            const Elf32_Shdr *sh)
+{
+    for (unsigned i = 0; ph && i < eh->e_phnum; i++) {
+        if (ph[i].p_type == PT_LOAD &&
+            sh->sh_offset >= ph[i].p_offset &&
+            sh->sh_offset - ph[i].p_offset < ph[i].p_filesz) {
+            return ph[i].p_paddr + (sh->sh_offset - ph[i].p_offset);
+        }
+    }
+    return sh->sh_addr;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const struct firmware_symbol *x = a, *y = b;
+
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+static int load_symbols(struct firmware *fw, const Elf32_Ehdr *eh,
+                        const Elf32_Shdr *sh)
+{
+    const Elf32_Shdr *symtab = NULL, *strtab;
+    const Elf32_Sym *syms;
+    const char *strings;
+    unsigned count;
+
+    for (unsigned i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == SHT_SYMTAB) {
+            symtab = &sh[i];
+            break;
+        }
+    }
+    if (!symtab) {
+        return 0;
+    }
+    if (symtab->sh_link >= eh->e_shnum) {
+        return -1;
+    }
+    strtab = &sh[symtab->sh_link];
+    if (!in_map(fw, symtab->sh_offset, symtab->sh_size) ||
+        !in_map(fw, strtab->sh_offset, strtab->sh_size) ||
+        strtab->sh_size == 0) {
+        return -1;
+    }
+
+    syms = (const Elf32_Sym *)((const char *) fw->map + symtab->sh_offset);
+    strings = (const char *) fw->map + strtab->sh_offset;
+    count = symtab->sh_size / sizeof(*syms);
+    /* Symbol names must be terminated within the string table. */
+    if (strings[strtab->sh_size - 1] != '\0') {
+        return -1;
+    }
+
+    fw->symbols = malloc(count * sizeof(*fw->symbols));
+    if (count > 0 && !fw->symbols) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        struct firmware_symbol *sym = &fw->symbols[fw->symbol_count];
+        unsigned type = ELF32_ST_TYPE(syms[i].st_info);
+
+        if (syms[i].st_name == 0 || syms[i].st_name >= strtab->sh_size ||
+            type == STT_SECTION || type == STT_FILE) {
+            continue;
+        }
+        sym->name = strings + syms[i].st_name;
+        sym->value = syms[i].st_value;
+        sym->size = syms[i].st_size;
+        sym->type = type;
+        fw->symbol_count++;
+    }
+
+    qsort(fw->symbols, fw->symbol_count, sizeof(*fw->symbols),
+          compare_symbols);
+    return 0;
+}
+
+static int load_elf(struct firmware *fw, struct atmega328p *mcu)
+{
+    const Elf32_Ehdr *eh = fw->map;
+    const Elf32_Phdr *ph = NULL;
+    const Elf32_Shdr *sh;
+
+    if (!in_map(fw, 0, sizeof(*eh)) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+        eh->e_machine != EM_AVR) {
+        warn("not an AVR ELF file\n");
+        return -1;
+    }
+
+    if (eh->e_phnum > 0) {
+        if (eh->e_phentsize != sizeof(*ph) ||
+            !in_map(fw, eh->e_phoff, (uint64_t) eh->e_phnum * sizeof(*ph))) {
+            goto corrupt;
+        }
+        ph = (const Elf32_Phdr *)((const char *) fw->map + eh->e_phoff);
+    }
+    if (eh->e_shentsize != sizeof(*sh) ||
+        !in_map(fw, eh->e_shoff, (uint64_t) eh->e_shnum * sizeof(*sh))) {
+        goto corrupt;
+    }
+    sh = (const Elf32_Shdr *)((const char *) fw->map + eh->e_shoff);
+
+    for (unsigned i = 0; i < eh->e_shnum; i++) {
+        const void *data = (const char *) fw->map + sh[i].sh_offset;
+        uint32_t lma;
+        int status;
+
+        if (sh[i].sh_type != SHT_PROGBITS || !(sh[i].sh_flags & SHF_ALLOC) ||
+            sh[i].sh_size == 0) {
+            continue;
+        }
+        if (!in_map(fw, sh[i].sh_offset, sh[i].sh_size)) {
+            goto corrupt;
+        }
+
+        /* Copy straight from the mapped file into the memory. */
+        lma = section_lma(eh, ph, &sh[i]);
+        if (lma < ELF_DATA_BASE) {
+            status = load_flash(fw, mcu, lma, data, sh[i].sh_size);
+        }
+        else if (lma >= ELF_EEPROM_BASE && lma < ELF_EEPROM_END) {
+            status = load_eeprom(fw, mcu, lma - ELF_EEPROM_BASE, data,
+                                 sh[i].sh_size);
+        }
+        else {
+            /* Sections loaded into RAM or fuses, lock bits, signature... */
+            debug("ignoring section at 0x%x\n", lma);
+            status = 0;
+        }
+        if (FAILED(status)) {
+            return status;
+        }
+    }
+
+    if (FAILED(load_symbols(fw, eh, sh))) {
+        goto corrupt;
+    }
+    return 0;
+
+corrupt:
+    warn("corrupt ELF file\n");
+    return -1;
+}
+
+/* Returns the value of a hex digit or -1 if c is not one. */
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20; /* Lower case */
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Decode count hex digit pairs at text into bytes. */
+static int decode_hex(const char *text, uint8_t *bytes, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        int hi = hex_digit(text[2 * i]);
+        int lo = hex_digit(text[2 * i + 1]);
+
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        bytes[i] = hi << 4 | lo;
+    }
+    return 0;
+}
+
+static int load_ihex(struct firmware *fw, struct atmega328p *mcu)
+{
+    const char *p = fw->map;
+    const char *end = p + fw->map_size;
+    uint32_t base = 0; /* From extended address records */
+    unsigned line = 1;
+
+    while (p < end) {
+        /* Record: ':' count(1) address(2) type(1) data(count) checksum(1) */
+        uint8_t record[5 + 255];
+        uint8_t sum = 0;
+        unsigned count, addr;
+
+        if (*p == '\n') {
+            line++;
+            p++;
+            continue;
+        }
+        if (*p == '\r') {
+            p++;
+            continue;
+        }
+        if (*p != ':' || end - p < 11 ||
+            FAILED(decode_hex(p + 1, record, 1))) {
+            goto corrupt;
+        }
+        count = record[0];
+        if (end - p < 11 + 2 * count ||
+            FAILED(decode_hex(p + 1, record, 5 + count))) {
+            goto corrupt;
+        }
+        p += 11 + 2 * count;
+
+        for (unsigned i = 0; i < 5 + count; i++) {
+            sum += record[i];
+        }
+        if (sum != 0) {
+            warn("bad checksum on line %u of Intel HEX file\n", line);
+            return -1;
+        }
+
+        addr = base + (record[1] << 8 | record[2]);
+        switch (record[3]) {
+        case 0x00: /* Data */
+            if (FAILED(load_flash(fw, mcu, addr, &record[4], count))) {
+                return -1;
+            }
+            break;
+        case 0x01: /* End of file */
+            return 0;
+        case 0x02: /* Extended segment address */
+            if (count != 2) {
+                goto corrupt;
+            }
+            base = (record[4] << 8 | record[5]) << 4;
+            break;
+        case 0x04: /* Extended linear address */
+            if (count != 2) {
+                goto corrupt;
+            }
+            base = (uint32_t)(record[4] << 8 | record[5]) << 16;
+            break;
+        case 0x03: /* Start segment address */
+        case 0x05: /* Start linear address */
+            break;
+        default:
+            goto corrupt;
+        }
+    }
+
+    warn("Intel HEX file has no end of file record\n");
+    return -1;
+
+corrupt:
+    warn("malformed record on line %u of Intel HEX file\n", line);
+    return -1;
+}
+
+int firmware_load(struct firmware *fw, struct atmega328p *mcu,
+                  const char *path)
+{
+    struct stat st;
+    int fd, status;
+
+    memset(fw, 0, sizeof(*fw));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        warn("cannot open %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    fw->map_size = st.st_size;
+    fw->map = mmap(NULL, fw->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (fw->map == MAP_FAILED) {
+        warn("cannot map %s\n", path);
+        fw->map = NULL;
+        return -1;
+    }
+
+    if (fw->map_size >= SELFMAG && memcmp(fw->map, ELFMAG, SELFMAG) == 0) {
+        status = load_elf(fw, mcu);
+    }
+    else if (*(const char *) fw->map == ':') {
+        status = load_ihex(fw, mcu);
+    }
+    else {
+        status = load_flash(fw, mcu, 0, fw->map, fw->map_size);
+    }
+
+    if (FAILED(status)) {
+        firmware_free(fw);
+    }
+    return status;
+}
+
+void firmware_free(struct firmware *fw)
+{
+    free(fw->symbols);
+    if (fw->map) {
+        munmap(fw->map, fw->map_size);
+    }
+    memset(fw, 0, sizeof(*fw));
+}
+
+const struct firmware_symbol *firmware_find_symbol(const struct firmware *fw,
+                                                   const char *name)
+{
+    for (unsigned i = 0; i < fw->symbol_count; i++) {
+        if (strcmp(fw->symbols[i].name, name) == 0) {
+            return &fw->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+const struct firmware_symbol *firmware_function_at(const struct firmware *fw,
+                                                   uint32_t addr)
+{
+    unsigned low = 0, high = fw->symbol_count;
+
+    /* Find the first symbol above addr. */
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+
+        if (fw->symbols[mid].value <= addr) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    /*
+     * Functions do not overlap, so the nearest one at or below addr is the
+     * only candidate. Other kinds of symbols may lie in between.
+     */
+    while (low-- > 0) {
+        const struct firmware_symbol *sym = &fw->symbols[low];
+
+        if (sym->type == STT_FUNC) {
+            return addr < sym->value + sym->size ? sym : NULL;
+        }
+    }
+    return NULL;
+}
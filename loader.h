@@ -0,0 +1,53 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "atmega328p.h"
+
+/* A symbol of an ELF image. */
+struct firmware_symbol {
+    const char *name;
+    uint32_t value; /* Address; flash addresses are in bytes */
+    uint32_t size;
+    uint8_t type; /* STT_FUNC, STT_OBJECT, ... */
+};
+
+/* A loaded firmware image. */
+struct firmware {
+    /* Symbols sorted by value; empty unless the image is an ELF file. */
+    struct firmware_symbol *symbols;
+    unsigned symbol_count;
+
+    unsigned flash_size; /* Bytes up to the end of the last loaded to flash */
+    unsigned eeprom_size; /* Likewise for EEPROM */
+
+    /* The mapped file, which symbol names point into. */
+    void *map;
+    size_t map_size;
+};
+
+/*
+ * Load the firmware in the file at path into the flash and EEPROM of mcu.
+ * ELF files (.text, .data, .eeprom and other loadable sections), Intel HEX
+ * and raw binaries are recognized by their content. Returns 0 on success or
+ * a negative value on failure. fw must be freed with firmware_free() when
+ * loading succeeds.
+ */
+int firmware_load(struct firmware *fw, struct atmega328p *mcu,
+                  const char *path);
+
+void firmware_free(struct firmware *fw);
+
+/* Returns the symbol with the given name or NULL if there is none. */
+const struct firmware_symbol *firmware_find_symbol(const struct firmware *fw,
+                                                   const char *name);
+
+/*
+ * Returns the function symbol whose code contains the flash byte address
+ * addr, or NULL if there is none.
+ */
+const struct firmware_symbol *firmware_function_at(const struct firmware *fw,
+                                                   uint32_t addr);
+
+#endif
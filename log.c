@@ -1,22 +1,132 @@
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "log.h"
 
-void warn(const char *fmt, ...)
+/*
+ * Debug messages are collected here and written to stderr in large chunks.
+ * log_lock serializes the buffer and the output of whole messages, which
+ * may come from several threads.
+ */
+static char debug_buffer[1 << 16];
+static size_t debug_buffer_len;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t flush_registered = PTHREAD_ONCE_INIT;
+
+/* Trace ring buffer; the number of records must be a power of two. */
+struct trace_record {
+    const char *func;
+    const char *fmt;
+    uint32_t a;
+    uint32_t b;
+};
+
+static struct trace_record trace_ring[1 << 16];
+static atomic_uint_fast32_t trace_head; /* Number of records ever written */
+
+_Bool log_trace_enabled;
+
+/* Write out the debug buffer; log_lock must be held. */
+static void flush_locked(void)
 {
+    if (debug_buffer_len > 0) {
+        fwrite(debug_buffer, 1, debug_buffer_len, stderr);
+        debug_buffer_len = 0;
+    }
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&log_lock);
+    flush_locked();
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void register_flush(void)
+{
+    atexit(log_flush);
+}
+
+void log_warn_real(const char *fmt, ...)
+{
+    char line[512];
     va_list va;
+    int len;
 
     va_start(va, fmt);
-    vfprintf(stderr, fmt, va);
+    len = vsnprintf(line, sizeof(line), fmt, va);
     va_end(va);
+    if (len >= (int) sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    /* Keep warnings in order with the debug messages before them. */
+    flush_locked();
+    fwrite(line, 1, len, stderr);
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_debug_real(const char *func, const char *fmt, ...)
 {
+    char line[512];
     va_list va;
+    int len, n;
+
+    pthread_once(&flush_registered, register_flush);
 
-    /* FIXME: in multithreaded env, printed text may not be consecutive */
-    fprintf(stderr, "debug[%s]: ", func);
+    len = snprintf(line, sizeof(line), "debug[%s]: ", func);
     va_start(va, fmt);
-    vfprintf(stderr, fmt, va);
+    n = vsnprintf(line + len, sizeof(line) - len, fmt, va);
     va_end(va);
+    len += n;
+    if (len >= (int) sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    if (debug_buffer_len + len > sizeof(debug_buffer)) {
+        flush_locked();
+    }
+    memcpy(&debug_buffer[debug_buffer_len], line, len);
+    debug_buffer_len += len;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_trace_real(const char *func, const char *fmt, uint32_t a, uint32_t b)
+{
+    uint_fast32_t seq;
+    struct trace_record *record;
+
+    seq = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    record = &trace_ring[seq & (ARRAY_SIZE(trace_ring) - 1)];
+    record->func = func;
+    record->fmt = fmt;
+    record->a = a;
+    record->b = b;
+}
+
+void log_trace_enable(_Bool enable)
+{
+    log_trace_enabled = enable;
+}
+
+void log_trace_dump(FILE *stream)
+{
+    uint_fast32_t head, first;
+
+    head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    first = head > ARRAY_SIZE(trace_ring) ? head - ARRAY_SIZE(trace_ring) : 0;
+
+    for (uint_fast32_t seq = first; seq != head; ++seq) {
+        const struct trace_record *record;
+
+        record = &trace_ring[seq & (ARRAY_SIZE(trace_ring) - 1)];
+        fprintf(stream, "trace[%s]: ", record->func);
+        fprintf(stream, record->fmt, record->a, record->b);
+    }
 }
@@ -1,9 +1,62 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Compile-time log levels. Messages above LOG_LEVEL are compiled out; by
+ * default release builds (NDEBUG) keep warnings only.
+ */
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_WARN
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define warn(fmt, ...) log_warn_real(fmt, ##__VA_ARGS__)
+#else
+#define warn(fmt, ...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 #define debug(fmt, ...) log_debug_real(__func__, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...) ((void) 0)
+#endif
+
+/*
+ * Record an event in the trace ring buffer if tracing is enabled. Only fmt
+ * (which must be a string literal) and the two arguments are stored; the
+ * message is formatted when the buffer is dumped.
+ */
+#define trace(fmt, a, b)                                        \
+    do {                                                        \
+        if (log_trace_enabled) {                                \
+            log_trace_real(__func__, fmt, (a), (b));            \
+        }                                                       \
+    } while (0)
+
+extern _Bool log_trace_enabled;
 
-void warn(const char *fmt, ...);
+void log_warn_real(const char *fmt, ...);
 void log_debug_real(const char *func, const char *fmt, ...);
+void log_trace_real(const char *func, const char *fmt, uint32_t a, uint32_t b);
+
+/* Write buffered debug messages to stderr. */
+void log_flush(void);
+
+/* Enable or disable the tracer. */
+void log_trace_enable(_Bool enable);
+
+/* Write the recorded trace, oldest event first, to stream. */
+void log_trace_dump(FILE *stream);
 
 #endif
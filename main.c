@@ -3,21 +3,395 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "atmega328p.h"
 #include "cpu.h"
+#include "defines.h"
+#include "gdbstub.h"
+#include "loader.h"
+#include "log.h"
+#include "profile.h"
+#include "runner.h"
+#include "tracer.h"
+#include "usart.h"
+#include "vcd.h"
 
-int main(int argc, char *argv[])
+/* Cycles between writes of USART0 output to the host, at most. */
+#define FLUSH_INTERVAL_CYCLES 0x10000
+
+/* An MCU simulated with one firmware image, and the result. */
+struct instance {
+    const char *path; /* Firmware file; NULL for a raw binary on stdin */
+    int status; /* Negative if the firmware could not be loaded */
+    enum cpu_stop_reason reason;
+    uint64_t cycles;
+    uint16_t pc;
+};
+
+struct simulation {
+    struct instance *instances;
+    uint64_t max_cycles; /* 0 to run for a cycle per firmware word + 20 */
+    struct usart_stream *stream; /* Host side of USART0, NULL if none */
+    struct tracer *tracer; /* Execution trace recorder, NULL if none */
+    struct profile *profile; /* Profile to take, NULL if none */
+    FILE *folded; /* Where to write the folded stacks of profile */
+    struct gdb_stub *gdb; /* Debugger controlling the run, NULL if none */
+    struct nvm_image *eeprom, *flash; /* Files persisted to, NULL if none */
+    struct gpio_stimulus *stimulus; /* Inputs of the GPIO pins, NULL if none */
+    struct vcd_writer *vcd; /* Waveform of the GPIO pins, NULL if none */
+};
+
+static const char *const stop_reason_names[] = {
+    [CPU_STOP_NONE]         = "none",
+    [CPU_STOP_BUDGET]       = "budget",
+    [CPU_STOP_BREAKPOINT]   = "breakpoint",
+    [CPU_STOP_WATCHPOINT]   = "watchpoint",
+    [CPU_STOP_SLEEP]        = "sleep",
+    [CPU_STOP_BREAK]        = "break",
+    [CPU_STOP_ERROR]        = "error",
+};
+
+static void run_instance(unsigned index, void *arg)
 {
+    struct simulation *sim = arg;
+    struct instance *instance = &sim->instances[index];
     struct atmega328p mcu;
+    struct firmware fw;
+    uint64_t max_cycles = sim->max_cycles;
+    uint64_t end, slice;
+    int actual, loaded = 0;
+
+    if (atmega328p_init(&mcu) < 0) {
+        instance->status = -1;
+        return;
+    }
+
+    if (instance->path) {
+        instance->status = firmware_load(&fw, &mcu, instance->path);
+        if (instance->status < 0) {
+            atmega328p_destroy(&mcu);
+            return;
+        }
+        actual = fw.flash_size / 2;
+        loaded = 1;
+    }
+    else {
+        /* Raw binary from standard input. */
+        actual = fread(mcu.flash, 2, ATMEGA328P_FLASH_SIZE / 2, stdin);
+    }
+
+    if (max_cycles == 0) {
+        max_cycles = actual + 20;
+    }
+    atmega328p_persist(&mcu, sim->eeprom, sim->flash);
+
+    /* Run in slices so that USART0 output reaches the host as it goes. */
+    slice = max_cycles;
+    if (sim->stream) {
+        usart_connect(&mcu.usart0, sim->stream);
+        slice = FLUSH_INTERVAL_CYCLES;
+    }
+    if (sim->stimulus) {
+        gpio_set_stimulus(&mcu.gpio, sim->stimulus);
+    }
+    if (sim->vcd) {
+        gpio_connect(&mcu.gpio, &sim->vcd->log);
+    }
+    mcu.cpu.tracer = sim->tracer;
+    mcu.cpu.profile = sim->profile;
+    if (sim->gdb) {
+        /* Run until GDB is done, or for -c cycles only. */
+        instance->reason = gdb_stub_serve(sim->gdb, &mcu, sim->max_cycles);
+    }
+    else {
+        end = mcu.cpu.cycle_count + max_cycles;
+        do {
+            uint64_t left = end - mcu.cpu.cycle_count;
+
+            instance->reason = atmega328p_run(&mcu,
+                                              left < slice ? left : slice);
+        } while (instance->reason == CPU_STOP_BUDGET &&
+                 mcu.cpu.cycle_count < end);
+    }
+    instance->cycles = mcu.cpu.cycle_count;
+    instance->pc = mcu.cpu.pc;
+
+    if (sim->profile) {
+        /* Name functions by the symbols of an ELF image. */
+        profile_write_folded(sim->profile, loaded ? &fw : NULL, sim->folded);
+        profile_write_flat(sim->profile, loaded ? &fw : NULL, stderr);
+    }
+    if (loaded) {
+        firmware_free(&fw);
+    }
+    atmega328p_destroy(&mcu);
+}
 
-    atmega328p_init(&mcu);
+int main(int argc, char *argv[])
+{
+    struct simulation sim = { 0 };
+    struct instance stdin_instance = { 0 };
+    struct usart_stream stream;
+    struct tracer tracer;
+    struct profile profile;
+    struct gdb_stub gdb;
+    struct nvm_image eeprom, flash;
+    struct gpio_stimulus stimulus;
+    struct vcd_writer vcd;
+    const char *trace_path = NULL, *profile_path = NULL, *gdb_port = NULL;
+    const char *eeprom_path = NULL, *flash_path = NULL;
+    const char *stimulus_path = NULL, *vcd_path = NULL;
+    char pty_name[64];
+    unsigned count, threads = 0;
+    int opt, failed = 0, bridge = 0;
+
+    while ((opt = getopt(argc, argv, "c:e:f:g:i:j:pP:tT:uw:")) != -1) {
+        switch (opt) {
+        case 'c':
+            sim.max_cycles = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            /* Keep EEPROM in a file, which is loaded if it exists. */
+            eeprom_path = optarg;
+            break;
+        case 'f':
+            /* Keep flash memory in a file as it is programmed by SPM. */
+            flash_path = optarg;
+            break;
+        case 'g':
+            /* Debug with GDB on a TCP port, or on stdin and stdout if "-". */
+            gdb_port = optarg;
+            break;
+        case 'i':
+            /* Drive GPIO input pins as a stimulus file says. */
+            stimulus_path = optarg;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+        case 'u':
+            /* Connect USART0 to a new pty or to stdin and stdout. */
+            bridge = opt;
+            break;
+        case 'P':
+            /*
+             * Profile the firmware, writing folded stacks for flamegraphs
+             * to a file and the cycles per function to stderr.
+             */
+            profile_path = optarg;
+            break;
+        case 't':
+            /* Trace executed instructions and print the last ones at exit. */
+            log_trace_enable(1);
+            break;
+        case 'T':
+            /* Record a binary execution trace for avrtrace. */
+            trace_path = optarg;
+            break;
+        case 'w':
+            /* Write the waveforms of the GPIO pins to a VCD file. */
+            vcd_path = optarg;
+            break;
+        default:
+            eprintf("usage: %s [-t] [-p|-u] [-g port|-] [-T trace] "
+                    "[-P profile] [-e eeprom] [-f flash] [-i stimulus] "
+                    "[-w waves.vcd] [-c cycles] [-j threads] "
+                    "[firmware.elf|firmware.hex|firmware.bin...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* Firmware files are simulated in parallel, each on its own MCU. */
+    count = argc - optind;
+    if (count > 0) {
+        sim.instances = calloc(count, sizeof(*sim.instances));
+        if (!sim.instances) {
+            eprintf("out of memory\n");
+            return 1;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            sim.instances[i].path = argv[optind + i];
+        }
+    }
+    else {
+        sim.instances = &stdin_instance;
+        count = 1;
+    }
 
-    int actual = fread(mcu.flash, 2, 1000, stdin);
+    if (bridge) {
+        if (count != 1 || sim.instances == &stdin_instance) {
+            eprintf("USART0 can be connected for one firmware file only\n");
+            return 1;
+        }
+        if (bridge == 'u') {
+            usart_stream_init(&stream, STDIN_FILENO, STDOUT_FILENO);
+        }
+        else if (usart_stream_open_pty(&stream, pty_name,
+                                       sizeof(pty_name)) < 0) {
+            eprintf("cannot open a pty: %s\n", strerror(errno));
+            return 1;
+        }
+        else {
+            eprintf("USART0 is on %s\n", pty_name);
+        }
+        sim.stream = &stream;
+    }
+
+    if (gdb_port) {
+        if (count != 1 || sim.instances == &stdin_instance) {
+            eprintf("GDB can debug one firmware file only\n");
+            return 1;
+        }
+        if (strcmp(gdb_port, "-") == 0) {
+            if (bridge == 'u') {
+                eprintf("GDB and USART0 cannot both use stdin and stdout\n");
+                return 1;
+            }
+            gdb_stub_init(&gdb, STDIN_FILENO, STDOUT_FILENO);
+        }
+        else {
+            eprintf("waiting for GDB on port %s\n", gdb_port);
+            if (gdb_stub_listen(&gdb, strtoul(gdb_port, NULL, 0)) < 0) {
+                eprintf("cannot accept GDB on port %s: %s\n", gdb_port,
+                        strerror(errno));
+                return 1;
+            }
+        }
+        sim.gdb = &gdb;
+    }
+
+    if (trace_path) {
+        if (count != 1) {
+            eprintf("a trace can be recorded of one firmware only\n");
+            return 1;
+        }
+        if (tracer_open(&tracer, trace_path) < 0) {
+            eprintf("cannot create %s: %s\n", trace_path, strerror(errno));
+            return 1;
+        }
+        sim.tracer = &tracer;
+    }
+
+    if (profile_path) {
+        if (count != 1) {
+            eprintf("one firmware can be profiled at a time\n");
+            return 1;
+        }
+        sim.folded = fopen(profile_path, "w");
+        if (!sim.folded) {
+            eprintf("cannot create %s: %s\n", profile_path, strerror(errno));
+            return 1;
+        }
+        if (profile_init(&profile, ATMEGA328P_FLASH_SIZE / 2) < 0) {
+            eprintf("out of memory\n");
+            return 1;
+        }
+        sim.profile = &profile;
+    }
+
+    if (eeprom_path || flash_path) {
+        if (count != 1) {
+            eprintf("memories can be persisted for one firmware only\n");
+            return 1;
+        }
+        if (eeprom_path) {
+            if (nvm_image_open(&eeprom, eeprom_path, ATMEGA328P_EEPROM_SIZE,
+                               ATMEGA328P_EEPROM_PAGE_SIZE) < 0) {
+                eprintf("cannot open %s: %s\n", eeprom_path, strerror(errno));
+                return 1;
+            }
+            sim.eeprom = &eeprom;
+        }
+        if (flash_path) {
+            if (nvm_image_open(&flash, flash_path, ATMEGA328P_FLASH_SIZE,
+                               ATMEGA328P_FLASH_PAGE_SIZE) < 0) {
+                eprintf("cannot open %s: %s\n", flash_path, strerror(errno));
+                return 1;
+            }
+            sim.flash = &flash;
+        }
+    }
+
+    if (stimulus_path) {
+        if (gpio_stimulus_load(&stimulus, stimulus_path) < 0) {
+            eprintf("cannot read stimulus %s\n", stimulus_path);
+            return 1;
+        }
+        sim.stimulus = &stimulus;
+    }
+
+    if (vcd_path) {
+        if (count != 1) {
+            eprintf("waveforms can be written of one firmware only\n");
+            return 1;
+        }
+        if (vcd_open(&vcd, vcd_path, ATMEGA328P_CLOCK_HZ) < 0) {
+            eprintf("cannot create %s: %s\n", vcd_path, strerror(errno));
+            return 1;
+        }
+        sim.vcd = &vcd;
+    }
+
+    if (runner_run(count, threads, run_instance, &sim) < 0) {
+        eprintf("out of memory\n");
+        return 1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        const struct instance *instance = &sim.instances[i];
+
+        if (instance->status < 0) {
+            failed = 1;
+        }
+        if (count > 1) {
+            printf("%s: ", instance->path);
+            if (instance->status < 0) {
+                printf("failed to load\n");
+            }
+            else {
+                printf("%s after %llu cycles at pc 0x%x\n",
+                       stop_reason_names[instance->reason],
+                       (unsigned long long) instance->cycles,
+                       instance->pc * 2);
+            }
+        }
+    }
+
+    if (sim.stream) {
+        usart_stream_close(sim.stream);
+    }
+    if (sim.gdb) {
+        gdb_stub_close(sim.gdb);
+    }
+    if (sim.tracer) {
+        tracer_close(sim.tracer);
+    }
+    if (sim.profile) {
+        fclose(sim.folded);
+        profile_destroy(sim.profile);
+    }
+    if (sim.eeprom) {
+        nvm_image_close(sim.eeprom);
+    }
+    if (sim.flash) {
+        nvm_image_close(sim.flash);
+    }
+    if (sim.stimulus) {
+        gpio_stimulus_free(sim.stimulus);
+    }
+    if (sim.vcd) {
+        vcd_close(sim.vcd);
+    }
+
+    if (log_trace_enabled) {
+        log_trace_dump(stderr);
+    }
 
-    for (int i = 0; i < actual + 20; ++i) {
-        cpu_cycle(&mcu.cpu);
+    if (sim.instances != &stdin_instance) {
+        free(sim.instances);
     }
 
-    return 0;
+    return failed;
 }
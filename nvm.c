@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "defines.h"
+#include "log.h"
+#include "nvm.h"
+
+#define FAILED(status) ((status) < 0)
+
+/* SPMCSR bits that select what SPM does. */
+#define SPM_COMMAND (BIT2MASK(NVM_PGERS) | BIT2MASK(NVM_PGWRT) | \
+                     BIT2MASK(NVM_BLBSET) | BIT2MASK(NVM_RWWSRE) | \
+                     BIT2MASK(NVM_SIGRD))
+
+/* Request the interrupts of the controller that is ready. */
+static void nvm_update_irq(struct nvm *nvm)
+{
+    const struct nvm_config *c = nvm->config;
+
+    cpu_set_irq(nvm->cpu, c->ee_ready_vector, BITVAL(nvm->eecr, NVM_EERIE) &&
+                                              !BITVAL(nvm->eecr, NVM_EEPE));
+    cpu_set_irq(nvm->cpu, c->spm_ready_vector,
+                BITVAL(nvm->spmcsr, NVM_SPMIE) &&
+                !BITVAL(nvm->spmcsr, NVM_SPMEN));
+}
+
+static void eeprom_event(struct event *event, void *ctx)
+{
+    struct nvm *nvm = ctx;
+    uint8_t *byte = &nvm->eeprom[nvm->eeprom_addr];
+
+    switch (nvm->eecr >> NVM_EEPM0 & 3) {
+    case 0:
+        *byte = nvm->eeprom_data;
+        break;
+    case 1:
+        *byte = 0xff;
+        break;
+    case 2:
+        /* Writing without erasing can only clear bits. */
+        *byte &= nvm->eeprom_data;
+        break;
+    }
+    if (nvm->eeprom_image) {
+        nvm_image_mark(nvm->eeprom_image, nvm->eeprom_addr, 1);
+    }
+
+    BITCLR(nvm->eecr, NVM_EEPE);
+    nvm_update_irq(nvm);
+}
+
+/* Clear SPMEN and the command if no SPM followed in time. */
+static void spm_expire(struct nvm *nvm)
+{
+    if (!nvm->flash_busy && BITVAL(nvm->spmcsr, NVM_SPMEN) &&
+        nvm->cpu->cycle_count >= nvm->spmen_end) {
+        nvm->spmcsr &= ~(BIT2MASK(NVM_SPMEN) | SPM_COMMAND);
+        event_cancel(nvm->queue, &nvm->flash_event);
+        nvm_update_irq(nvm);
+    }
+}
+
+static void flash_event(struct event *event, void *ctx)
+{
+    struct nvm *nvm = ctx;
+    struct cpu *cpu = nvm->cpu;
+    unsigned size = nvm->config->page_size;
+    uint8_t page[NVM_MAX_PAGE_SIZE];
+
+    if (!nvm->flash_busy) {
+        spm_expire(nvm);
+        return;
+    }
+
+    if (BITVAL(nvm->spmcsr, NVM_PGERS)) {
+        memset(page, 0xff, size);
+    }
+    else {
+        /* Writing without erasing can only clear bits. */
+        (void) cpu->flash_bus->read(cpu->mcu, nvm->flash_page, page, size);
+        for (unsigned i = 0; i < size; i++) {
+            page[i] &= nvm->buffer[i];
+        }
+        memset(nvm->buffer, 0xff, sizeof(nvm->buffer));
+    }
+    if (FAILED(cpu->flash_bus->write(cpu->mcu, nvm->flash_page, page, size))) {
+        warn("programming flash page 0x%x failed\n", nvm->flash_page);
+    }
+    else if (nvm->flash_image) {
+        nvm_image_mark(nvm->flash_image, nvm->flash_page, size);
+    }
+
+    nvm->flash_busy = 0;
+    nvm->spmcsr &= ~(BIT2MASK(NVM_SPMEN) | SPM_COMMAND);
+    nvm_update_irq(nvm);
+}
+
+void nvm_reset(struct nvm *nvm)
+{
+    memset(nvm, 0, sizeof(*nvm));
+    memset(nvm->buffer, 0xff, sizeof(nvm->buffer));
+}
+
+void nvm_attach(struct nvm *nvm, const struct nvm_config *config,
+                struct event_queue *queue, struct cpu *cpu, uint8_t *eeprom)
+{
+    nvm->config = config;
+    nvm->queue = queue;
+    nvm->cpu = cpu;
+    nvm->eeprom = eeprom;
+    nvm->eeprom_event.handler = eeprom_event;
+    nvm->eeprom_event.ctx = nvm;
+    nvm->flash_event.handler = flash_event;
+    nvm->flash_event.ctx = nvm;
+}
+
+/* Store into EECR, starting a read or the programming of a byte. */
+static void store_eecr(struct nvm *nvm, uint8_t byte)
+{
+    const struct nvm_config *c = nvm->config;
+    uint64_t now = nvm->cpu->cycle_count;
+    _Bool master = now < nvm->eempe_end;
+    unsigned mode;
+
+    if (BITVAL(nvm->eecr, NVM_EEPE)) {
+        /* Only the interrupt can be enabled while programming. */
+        nvm->eecr = nvm->eecr & ~BIT2MASK(NVM_EERIE) |
+                    byte & BIT2MASK(NVM_EERIE);
+        return;
+    }
+    nvm->eecr = byte & (BIT2MASK(NVM_EERIE) | BIT2MASK(NVM_EEPM0) |
+                        BIT2MASK(NVM_EEPM1));
+    mode = nvm->eecr >> NVM_EEPM0 & 3;
+
+    if (BITVAL(byte, NVM_EEPE) && master && mode < ARRAY_SIZE(c->eeprom_cycles)) {
+        nvm->eeprom_addr = nvm->eear;
+        nvm->eeprom_data = nvm->eedr;
+        nvm->eempe_end = 0;
+        BITSET(nvm->eecr, NVM_EEPE);
+        event_schedule(nvm->queue, &nvm->eeprom_event,
+                       now + c->eeprom_cycles[mode]);
+        /* The CPU is halted for two cycles. */
+        nvm->cpu->cycle_count += 2;
+    }
+    else if (BITVAL(byte, NVM_EEMPE) && !master) {
+        nvm->eempe_end = now + NVM_ENABLE_CYCLES;
+    }
+    else if (BITVAL(byte, NVM_EERE)) {
+        nvm->eedr = nvm->eeprom[nvm->eear];
+        /* The CPU is halted for four cycles. */
+        nvm->cpu->cycle_count += 4;
+    }
+}
+
+int nvm_load(struct nvm *nvm, unsigned addr, uint8_t *byte)
+{
+    const struct nvm_config *c = nvm->config;
+
+    if (addr == c->eecr) {
+        *byte = nvm->eecr;
+        if (nvm->cpu->cycle_count < nvm->eempe_end) {
+            BITSET(*byte, NVM_EEMPE);
+        }
+    }
+    else if (addr == c->eedr) {
+        *byte = nvm->eedr;
+    }
+    else if (addr == c->eear) {
+        *byte = nvm->eear;
+    }
+    else if (addr == c->eear + 1) {
+        *byte = nvm->eear >> 8;
+    }
+    else if (addr == c->spmcsr) {
+        spm_expire(nvm);
+        *byte = nvm->spmcsr;
+    }
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+int nvm_store(struct nvm *nvm, unsigned addr, uint8_t byte)
+{
+    const struct nvm_config *c = nvm->config;
+    unsigned mask = c->eeprom_size - 1;
+
+    /* The address and data cannot change while a byte is programmed. */
+    if (addr == c->eecr) {
+        store_eecr(nvm, byte);
+    }
+    else if (addr == c->eedr) {
+        if (!BITVAL(nvm->eecr, NVM_EEPE)) {
+            nvm->eedr = byte;
+        }
+    }
+    else if (addr == c->eear) {
+        if (!BITVAL(nvm->eecr, NVM_EEPE)) {
+            nvm->eear = (nvm->eear & 0xff00 | byte) & mask;
+        }
+    }
+    else if (addr == c->eear + 1) {
+        if (!BITVAL(nvm->eecr, NVM_EEPE)) {
+            nvm->eear = (byte << 8 | nvm->eear & 0xff) & mask;
+        }
+    }
+    else if (addr == c->spmcsr) {
+        spm_expire(nvm);
+        if (nvm->flash_busy || BITVAL(nvm->spmcsr, NVM_SPMEN)) {
+            /* Only the interrupt can be enabled until SPM is done. */
+            nvm->spmcsr = nvm->spmcsr & ~BIT2MASK(NVM_SPMIE) |
+                          byte & BIT2MASK(NVM_SPMIE);
+        }
+        else {
+            /* RWWSB is read-only. */
+            nvm->spmcsr = nvm->spmcsr & BIT2MASK(NVM_RWWSB) |
+                          byte & ~BIT2MASK(NVM_RWWSB);
+            if (BITVAL(byte, NVM_SPMEN)) {
+                nvm->spmen_end = nvm->cpu->cycle_count + NVM_ENABLE_CYCLES;
+                event_schedule(nvm->queue, &nvm->flash_event,
+                               nvm->spmen_end);
+            }
+        }
+    }
+    else {
+        return 0;
+    }
+
+    nvm_update_irq(nvm);
+    return 1;
+}
+
+void nvm_spm(struct nvm *nvm, unsigned pc, uint16_t z, uint16_t data)
+{
+    const struct nvm_config *c = nvm->config;
+    struct cpu *cpu = nvm->cpu;
+    unsigned offset = z & (c->page_size - 1) & ~1u;
+
+    spm_expire(nvm);
+    if (!BITVAL(nvm->spmcsr, NVM_SPMEN) || nvm->flash_busy) {
+        return;
+    }
+    if (pc < c->boot_start) {
+        debug("SPM at 0x%x outside the boot loader section\n", pc);
+        return;
+    }
+
+    switch (nvm->spmcsr & SPM_COMMAND) {
+    case 0:
+        /* Fill a word of the temporary page buffer. */
+        nvm->buffer[offset] = data;
+        nvm->buffer[offset + 1] = data >> 8;
+        break;
+    case BIT2MASK(NVM_PGERS):
+    case BIT2MASK(NVM_PGWRT):
+        nvm->flash_busy = 1;
+        nvm->flash_page = z & (c->flash_size - 1) & ~(c->page_size - 1);
+        event_schedule(nvm->queue, &nvm->flash_event,
+                       cpu->cycle_count + c->flash_cycles);
+        if (nvm->flash_page >= c->nrww_start) {
+            /* The CPU is halted until the page is done. */
+            cpu->cycle_count += c->flash_cycles;
+        }
+        else {
+            BITSET(nvm->spmcsr, NVM_RWWSB);
+        }
+        return;
+    case BIT2MASK(NVM_RWWSRE):
+        BITCLR(nvm->spmcsr, NVM_RWWSB);
+        memset(nvm->buffer, 0xff, sizeof(nvm->buffer));
+        break;
+    default:
+        /* Lock bits and the signature row are not modeled. */
+        break;
+    }
+
+    nvm->spmcsr &= ~(BIT2MASK(NVM_SPMEN) | SPM_COMMAND);
+    event_cancel(nvm->queue, &nvm->flash_event);
+    nvm_update_irq(nvm);
+}
+
+uint64_t nvm_next_change(struct nvm *nvm, unsigned addr)
+{
+    const struct nvm_config *c = nvm->config;
+    uint64_t next = EVENT_NEVER;
+
+    if (addr == c->eecr) {
+        if (nvm->eeprom_event.index) {
+            next = nvm->eeprom_event.time;
+        }
+        if (nvm->eempe_end > nvm->cpu->cycle_count && nvm->eempe_end < next) {
+            next = nvm->eempe_end;
+        }
+    }
+    else if (addr == c->spmcsr && nvm->flash_event.index) {
+        next = nvm->flash_event.time;
+    }
+    return next;
+}
+
+int nvm_ack(struct nvm *nvm, unsigned vector)
+{
+    const struct nvm_config *c = nvm->config;
+
+    return vector == c->ee_ready_vector || vector == c->spm_ready_vector;
+}
+
+int nvm_image_open(struct nvm_image *image, const char *path, unsigned size,
+                   unsigned page_size)
+{
+    struct stat st;
+
+    memset(image, 0, sizeof(*image));
+    if (size / page_size > NVM_IMAGE_MAX_PAGES) {
+        errno = EINVAL;
+        return -1;
+    }
+    image->size = size;
+    image->page_size = page_size;
+
+    image->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (image->fd < 0) {
+        return -1;
+    }
+    if (fstat(image->fd, &st) < 0) {
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        if (ftruncate(image->fd, size) < 0) {
+            goto fail;
+        }
+        image->created = 1;
+    }
+    else if (st.st_size != size) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    image->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      image->fd, 0);
+    if (image->map == MAP_FAILED) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(image->fd);
+    return -1;
+}
+
+void nvm_image_load(struct nvm_image *image, uint8_t *mem)
+{
+    if (image->created) {
+        memcpy(image->map, mem, image->size);
+    }
+    else {
+        memcpy(mem, image->map, image->size);
+    }
+}
+
+void nvm_image_mark(struct nvm_image *image, unsigned addr, unsigned size)
+{
+    unsigned last = (addr + size - 1) / image->page_size;
+
+    for (unsigned page = addr / image->page_size; page <= last; page++) {
+        BITSET(image->dirty[page / 8], page % 8);
+    }
+}
+
+void nvm_image_sync(struct nvm_image *image, const uint8_t *mem)
+{
+    unsigned pages = image->size / image->page_size;
+
+    for (unsigned page = 0; page < pages; page++) {
+        unsigned offset = page * image->page_size;
+
+        if (BITVAL(image->dirty[page / 8], page % 8)) {
+            memcpy(image->map + offset, mem + offset, image->page_size);
+            BITCLR(image->dirty[page / 8], page % 8);
+        }
+    }
+}
+
+void nvm_image_close(struct nvm_image *image)
+{
+    if (msync(image->map, image->size, MS_SYNC) < 0) {
+        warn("writing back a memory image failed: %s\n", strerror(errno));
+    }
+    munmap(image->map, image->size);
+    close(image->fd);
+}
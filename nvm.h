@@ -0,0 +1,154 @@
+#ifndef NVM_H
+#define NVM_H
+
+#include <stdint.h>
+#include "event.h"
+
+/* Bits of EECR. */
+#define NVM_EERE    0 /* Read enable */
+#define NVM_EEPE    1 /* Program enable */
+#define NVM_EEMPE   2 /* Master program enable */
+#define NVM_EERIE   3 /* Ready interrupt enable */
+#define NVM_EEPM0   4 /* Programming mode */
+#define NVM_EEPM1   5
+
+/* Bits of SPMCSR. */
+#define NVM_SPMEN   0 /* Self-programming enable */
+#define NVM_PGERS   1 /* Page erase */
+#define NVM_PGWRT   2 /* Page write */
+#define NVM_BLBSET  3 /* Boot lock bit set */
+#define NVM_RWWSRE  4 /* Read-while-write section read enable */
+#define NVM_SIGRD   5 /* Signature row read */
+#define NVM_RWWSB   6 /* Read-while-write section busy */
+#define NVM_SPMIE   7 /* Ready interrupt enable */
+
+/* Cycles after EEMPE or SPMEN is set in which EEPE or SPM must follow. */
+#define NVM_ENABLE_CYCLES   4
+
+#define NVM_MAX_PAGE_SIZE   128
+
+/* Most pages whose changes an image keeps track of. */
+#define NVM_IMAGE_MAX_PAGES 256
+
+/*
+ * An EEPROM and flash self-programming controller model. Register addresses
+ * are data addresses and eear is the low byte of EEAR; flash addresses are
+ * byte addresses. Programming times are in CPU cycles.
+ */
+struct nvm_config {
+    uint16_t eecr, eedr, eear;
+    uint16_t spmcsr;
+    uint8_t ee_ready_vector, spm_ready_vector;
+
+    unsigned eeprom_size;
+    unsigned flash_size;
+    unsigned page_size; /* Of flash, at most NVM_MAX_PAGE_SIZE */
+    unsigned boot_start; /* Boot loader section, the only one to run SPM */
+    unsigned nrww_start; /* No-read-while-write section */
+
+    /* Erase and write, erase only and write only, by EEPM1:0 */
+    uint32_t eeprom_cycles[3];
+    uint32_t flash_cycles; /* Page erase or page write */
+};
+
+/*
+ * A host file that a non-volatile memory persists to, mapped into memory.
+ * Writes of the memory mark the pages they change, and only those are copied
+ * into the mapping, so only the file pages they fall in are written back.
+ */
+struct nvm_image {
+    int fd;
+    uint8_t *map;
+    unsigned size;
+    unsigned page_size; /* Bytes per bit of dirty */
+    _Bool created; /* The file was empty when opened */
+    uint8_t dirty[NVM_IMAGE_MAX_PAGES / 8];
+};
+
+/*
+ * The EEPROM and flash self-programming controller. Erasing and writing take
+ * the time they would, ending with an event, during which EEPE or SPMEN
+ * stays set; the CPU only halts while a page of the no-read-while-write
+ * section, where the boot loader runs, is programmed.
+ */
+struct nvm {
+    const struct nvm_config *config;
+    struct event_queue *queue;
+    struct cpu *cpu;
+    struct event eeprom_event, flash_event;
+    uint8_t *eeprom; /* config->eeprom_size bytes */
+    struct nvm_image *eeprom_image, *flash_image; /* NULL if not persisted */
+
+    uint8_t eecr, eedr;
+    uint16_t eear;
+    uint64_t eempe_end; /* EEMPE reads as set before this cycle */
+    uint16_t eeprom_addr; /* Byte being programmed while EEPE is set */
+    uint8_t eeprom_data;
+
+    uint8_t spmcsr;
+    uint64_t spmen_end; /* SPMEN is cleared at this cycle unless busy */
+    _Bool flash_busy; /* A page is being erased or written */
+    uint16_t flash_page; /* Page being erased or written */
+    uint8_t buffer[NVM_MAX_PAGE_SIZE]; /* Temporary page buffer */
+};
+
+/* Put nvm in its reset state, not persisted. */
+void nvm_reset(struct nvm *nvm);
+
+/*
+ * Connect an NVM controller in its reset state, or a copy of one, to its
+ * model, event queue, CPU and EEPROM.
+ */
+void nvm_attach(struct nvm *nvm, const struct nvm_config *config,
+                struct event_queue *queue, struct cpu *cpu, uint8_t *eeprom);
+
+/*
+ * Read and write the register of nvm at data address addr. Return 1 if the
+ * controller has a register there, 0 otherwise.
+ */
+int nvm_load(struct nvm *nvm, unsigned addr, uint8_t *byte);
+int nvm_store(struct nvm *nvm, unsigned addr, uint8_t byte);
+
+/*
+ * Execute SPM at flash address pc with Z pointer z and data R1:R0 as
+ * selected by SPMCSR.
+ */
+void nvm_spm(struct nvm *nvm, unsigned pc, uint16_t z, uint16_t data);
+
+/*
+ * Returns the cycle at which the register of nvm at data address addr may
+ * next change by itself, or EVENT_NEVER.
+ */
+uint64_t nvm_next_change(struct nvm *nvm, unsigned addr);
+
+/*
+ * Returns 1 if interrupt vector is one of nvm, 0 otherwise. Its interrupts
+ * stay pending while the controller is ready.
+ */
+int nvm_ack(struct nvm *nvm, unsigned vector);
+
+/*
+ * Open or create the file at path as an image of a memory of size bytes,
+ * keeping track of changes in pages of page_size bytes. Returns 0 on
+ * success or a negative value with errno set on failure, e.g. if the file
+ * is not empty and not size bytes long.
+ */
+int nvm_image_open(struct nvm_image *image, const char *path, unsigned size,
+                   unsigned page_size);
+
+/*
+ * Load memory mem from image, or if the file was created empty, save mem
+ * into it instead.
+ */
+void nvm_image_load(struct nvm_image *image, uint8_t *mem);
+
+/* Note that size bytes of the memory from addr have been written. */
+void nvm_image_mark(struct nvm_image *image, unsigned addr, unsigned size);
+
+/* Copy the pages of mem marked since the last sync into the file. */
+void nvm_image_sync(struct nvm_image *image, const uint8_t *mem);
+
+/* Write the file back and close it. */
+void nvm_image_close(struct nvm_image *image);
+
+#endif
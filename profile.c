@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "loader.h"
+#include "profile.h"
+
+#define FAILED(status) ((status) < 0)
+
+static unsigned hash(uint32_t parent, uint32_t site, unsigned size)
+{
+    uint64_t key = (uint64_t) parent << 32 | site;
+
+    return (key * 0x9e3779b97f4a7c15ull) >> 32 & (size - 1);
+}
+
+/* Rebuild the hash table of nodes with size slots. */
+static int resize_index(struct profile *p, unsigned size)
+{
+    uint32_t *index = calloc(size, sizeof(*index));
+
+    if (!index) {
+        return -1;
+    }
+    for (uint32_t i = 1; i < p->node_count; i++) {
+        unsigned slot = hash(p->nodes[i].parent, p->nodes[i].site, size);
+
+        while (index[slot]) {
+            slot = (slot + 1) & (size - 1);
+        }
+        index[slot] = i;
+    }
+    free(p->index);
+    p->index = index;
+    p->index_size = size;
+    return 0;
+}
+
+/* Returns the node of site called from parent, added if new, or -1. */
+static int64_t child_node(struct profile *p, uint32_t parent, uint32_t site)
+{
+    struct profile_node *node;
+    unsigned slot;
+
+    /* Keep the table at most half full. */
+    if (2 * (p->node_count + 1) > p->index_size &&
+        FAILED(resize_index(p, 2 * p->index_size))) {
+        return -1;
+    }
+
+    slot = hash(parent, site, p->index_size);
+    for (; p->index[slot]; slot = (slot + 1) & (p->index_size - 1)) {
+        node = &p->nodes[p->index[slot]];
+        if (node->parent == parent && node->site == site) {
+            return p->index[slot];
+        }
+    }
+
+    if (p->node_count == p->node_capacity) {
+        unsigned capacity = 2 * p->node_capacity;
+        void *nodes = realloc(p->nodes, capacity * sizeof(*node));
+
+        if (!nodes) {
+            return -1;
+        }
+        p->nodes = nodes;
+        p->node_capacity = capacity;
+    }
+    node = &p->nodes[p->node_count];
+    node->parent = parent;
+    node->site = site;
+    node->cycles = 0;
+    p->index[slot] = p->node_count;
+    return p->node_count++;
+}
+
+int profile_init(struct profile *profile, unsigned words)
+{
+    memset(profile, 0, sizeof(*profile));
+    profile->words = words;
+    profile->counts = calloc(words, sizeof(*profile->counts));
+    profile->cycles = calloc(words, sizeof(*profile->cycles));
+    profile->node_capacity = 64;
+    profile->nodes = malloc(profile->node_capacity * sizeof(*profile->nodes));
+    if (!profile->counts || !profile->cycles || !profile->nodes ||
+        FAILED(resize_index(profile, 2 * profile->node_capacity))) {
+        profile_destroy(profile);
+        return -1;
+    }
+
+    /* The root, for code that runs outside of any call seen. */
+    profile->nodes[0] = (struct profile_node) { 0, 0, 0 };
+    profile->node_count = 1;
+    return 0;
+}
+
+void profile_destroy(struct profile *profile)
+{
+    free(profile->counts);
+    free(profile->cycles);
+    free(profile->nodes);
+    free(profile->index);
+    memset(profile, 0, sizeof(*profile));
+}
+
+void profile_call(struct profile *p, uint32_t site, uint16_t sp,
+                  uint64_t now)
+{
+    int64_t node;
+
+    profile_update(p, now);
+
+    /* Deeper calls, and calls that run out of memory, stay in the caller. */
+    if (p->depth == PROFILE_MAX_DEPTH) {
+        return;
+    }
+    node = child_node(p, p->current, site);
+    if (node < 0) {
+        return;
+    }
+    p->stack[p->depth].node = node;
+    p->stack[p->depth].sp = sp;
+    p->depth++;
+    p->current = node;
+}
+
+void profile_return(struct profile *p, uint16_t sp, uint64_t now)
+{
+    profile_update(p, now);
+    while (p->depth > 0 && p->stack[p->depth - 1].sp < sp) {
+        p->depth--;
+    }
+    p->current = p->depth > 0 ? p->stack[p->depth - 1].node : 0;
+}
+
+/* Write the name of the frame of node. */
+static void write_frame(const struct profile *p, uint32_t node,
+                        const struct firmware *fw, FILE *stream)
+{
+    uint32_t site = p->nodes[node].site;
+    const struct firmware_symbol *sym = NULL;
+
+    if (node == 0) {
+        fputs("[reset]", stream);
+        return;
+    }
+    if (site & PROFILE_IRQ) {
+        fprintf(stream, "[interrupt %u]", site & ~PROFILE_IRQ);
+        return;
+    }
+    if (fw) {
+        sym = firmware_function_at(fw, site * 2);
+    }
+    if (sym) {
+        fputs(sym->name, stream);
+    }
+    else {
+        fprintf(stream, "0x%04x", site * 2);
+    }
+}
+
+void profile_write_folded(const struct profile *p, const struct firmware *fw,
+                          FILE *stream)
+{
+    uint32_t path[PROFILE_MAX_DEPTH + 1];
+
+    for (uint32_t i = 0; i < p->node_count; i++) {
+        unsigned depth = 0;
+
+        if (p->nodes[i].cycles == 0) {
+            continue;
+        }
+        for (uint32_t n = i; n != 0; n = p->nodes[n].parent) {
+            path[depth++] = n;
+        }
+        path[depth++] = 0;
+
+        while (depth-- > 0) {
+            write_frame(p, path[depth], fw, stream);
+            putc(depth > 0 ? ';' : ' ', stream);
+        }
+        fprintf(stream, "%llu\n", (unsigned long long) p->nodes[i].cycles);
+    }
+}
+
+/* Instructions of a function, or a single instruction outside functions. */
+struct flat_entry {
+    const struct firmware_symbol *sym; /* NULL outside functions */
+    uint32_t addr;
+    uint64_t count;
+    uint64_t cycles;
+};
+
+static int compare_cycles(const void *a, const void *b)
+{
+    const struct flat_entry *x = a, *y = b;
+
+    return (x->cycles < y->cycles) - (x->cycles > y->cycles);
+}
+
+void profile_write_flat(const struct profile *p, const struct firmware *fw,
+                        FILE *stream)
+{
+    struct flat_entry *entries;
+    unsigned count = 0;
+    uint64_t total = 0;
+
+    /* At most one entry per instruction executed. */
+    entries = malloc(p->words * sizeof(*entries));
+    if (!entries) {
+        return;
+    }
+
+    for (uint32_t pc = 0; pc < p->words; pc++) {
+        const struct firmware_symbol *sym = NULL;
+
+        if (p->counts[pc] == 0) {
+            continue;
+        }
+        if (fw) {
+            sym = firmware_function_at(fw, pc * 2);
+        }
+        if (!sym || count == 0 || entries[count - 1].sym != sym) {
+            entries[count++] = (struct flat_entry) { sym, pc * 2, 0, 0 };
+        }
+        entries[count - 1].count += p->counts[pc];
+        entries[count - 1].cycles += p->cycles[pc];
+        total += p->cycles[pc];
+    }
+    qsort(entries, count, sizeof(*entries), compare_cycles);
+
+    fprintf(stream, "%14s %6s %14s  %s\n",
+            "cycles", "%", "instructions", "function");
+    for (unsigned i = 0; i < count; i++) {
+        const struct flat_entry *e = &entries[i];
+
+        fprintf(stream, "%14llu %6.2f %14llu  ",
+                (unsigned long long) e->cycles,
+                total ? 100.0 * e->cycles / total : 0.0,
+                (unsigned long long) e->count);
+        if (e->sym) {
+            fprintf(stream, "%s\n", e->sym->name);
+        }
+        else {
+            fprintf(stream, "0x%04x\n", e->addr);
+        }
+    }
+
+    free(entries);
+}
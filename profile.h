@@ -0,0 +1,111 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Calls deeper than this are attributed to the deepest frame. */
+#define PROFILE_MAX_DEPTH   256
+
+/* Set in profile_node.site of the frame of an interrupt handler. */
+#define PROFILE_IRQ         0x10000
+
+struct firmware;
+
+/*
+ * A node of the calling context tree: a function, or interrupt handler,
+ * called along one path of calls from the reset.
+ */
+struct profile_node {
+    uint32_t parent; /* Index of the caller's node; the root is its own */
+    uint32_t site; /* Program address entered, or PROFILE_IRQ | vector */
+    uint64_t cycles; /* Cycles spent in the node itself, not its callees */
+};
+
+/* A frame of the shadow call stack. */
+struct profile_frame {
+    uint32_t node;
+    uint16_t sp; /* Stack pointer right after the call pushed its return */
+};
+
+/*
+ * An exact execution profile. Every executed instruction is counted, and
+ * its cycles added, in flat arrays indexed by program address. Calls and
+ * returns move along a calling context tree; each node is credited with the
+ * cycles that pass while it is current, including interrupt entry and
+ * sleep. Returns are matched to calls by stack pointer, so frames left by
+ * longjmp() or by RCALL used to reserve stack space are dropped when the
+ * stack unwinds past them.
+ *
+ * While cpu.profile is set, cpu_run() executes instructions one at a time
+ * and does not skip busy-wait loops, so a profiled run is slower than an
+ * unprofiled one.
+ */
+struct profile {
+    unsigned words; /* Size of the arrays, in flash words */
+    uint64_t *counts; /* Executions of the instruction at each address */
+    uint64_t *cycles; /* Cycles spent in the instruction at each address */
+
+    struct profile_node *nodes;
+    unsigned node_count, node_capacity;
+    uint32_t *index; /* Hash table of nodes by parent and site, 0 if free */
+    unsigned index_size; /* Power of two */
+
+    struct profile_frame stack[PROFILE_MAX_DEPTH];
+    unsigned depth;
+    uint32_t current; /* Node of the frame on top of the stack */
+    uint64_t since; /* Cycle up to which current has been credited */
+};
+
+/*
+ * Initialize an empty profile of a program memory of words words. Returns 0
+ * on success or a negative value if memory could not be allocated.
+ */
+int profile_init(struct profile *profile, unsigned words);
+
+void profile_destroy(struct profile *profile);
+
+/* Account an instruction at pc that took cycles. */
+static inline void profile_instruction(struct profile *profile, uint16_t pc,
+                                       unsigned cycles)
+{
+    if (pc < profile->words) {
+        profile->counts[pc]++;
+        profile->cycles[pc] += cycles;
+    }
+}
+
+/* Credit the current node with the cycles up to now. */
+static inline void profile_update(struct profile *profile, uint64_t now)
+{
+    profile->nodes[profile->current].cycles += now - profile->since;
+    profile->since = now;
+}
+
+/*
+ * Enter a call to site at cycle now, e.g. after a call instruction or when
+ * entering an interrupt, with sp the stack pointer after the return address
+ * was pushed.
+ */
+void profile_call(struct profile *profile, uint32_t site, uint16_t sp,
+                  uint64_t now);
+
+/* Leave, at cycle now, the frames that a return to stack pointer sp unwinds. */
+void profile_return(struct profile *profile, uint16_t sp, uint64_t now);
+
+/*
+ * Write the cycles of each calling context as folded stacks, one
+ * "caller;callee;... cycles" line each, as read by flamegraph.pl. Functions
+ * are named by the symbols of fw, which may be NULL.
+ */
+void profile_write_folded(const struct profile *profile,
+                          const struct firmware *fw, FILE *stream);
+
+/*
+ * Write the instructions executed and cycles spent per function of fw, or
+ * per instruction address if fw has no symbols, most cycles first.
+ */
+void profile_write_flat(const struct profile *profile,
+                        const struct firmware *fw, FILE *stream);
+
+#endif
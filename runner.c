@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "runner.h"
+
+struct runner;
+
+struct worker {
+    pthread_mutex_t lock;
+    unsigned next, end; /* Job indices next..end-1 are left to this worker */
+    pthread_t thread;
+    struct runner *runner;
+};
+
+struct runner {
+    struct worker *workers;
+    unsigned worker_count;
+    runner_job job;
+    void *arg;
+};
+
+/* Take the next job of worker w. Returns 0 if it has none left. */
+static _Bool take_job(struct worker *w, unsigned *index)
+{
+    _Bool taken = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->next < w->end) {
+        *index = w->next++;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return taken;
+}
+
+/*
+ * Move half of the jobs left to another worker to w, taken from the end of
+ * its range. Returns 0 if no worker has jobs left.
+ */
+static _Bool steal_jobs(struct worker *w)
+{
+    struct runner *r = w->runner;
+    unsigned self = w - r->workers;
+
+    for (unsigned i = 1; i < r->worker_count; i++) {
+        struct worker *victim = &r->workers[(self + i) % r->worker_count];
+        unsigned count, end;
+
+        pthread_mutex_lock(&victim->lock);
+        count = (victim->end - victim->next + 1) / 2;
+        end = victim->end;
+        victim->end -= count;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (count > 0) {
+            pthread_mutex_lock(&w->lock);
+            w->next = end - count;
+            w->end = end;
+            pthread_mutex_unlock(&w->lock);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    unsigned index;
+
+    do {
+        while (take_job(w, &index)) {
+            w->runner->job(index, w->runner->arg);
+        }
+    } while (steal_jobs(w));
+
+    return NULL;
+}
+
+int runner_run(unsigned job_count, unsigned thread_count, runner_job job,
+               void *arg)
+{
+    struct runner r = { .job = job, .arg = arg };
+    unsigned started;
+
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        thread_count = cpus > 0 ? cpus : 1;
+    }
+    if (thread_count > job_count) {
+        thread_count = job_count;
+    }
+    if (thread_count == 0) {
+        return 0;
+    }
+
+    r.workers = calloc(thread_count, sizeof(*r.workers));
+    if (!r.workers) {
+        return -1;
+    }
+    r.worker_count = thread_count;
+
+    for (unsigned i = 0; i < thread_count; i++) {
+        struct worker *w = &r.workers[i];
+
+        pthread_mutex_init(&w->lock, NULL);
+        w->next = (unsigned long long) job_count * i / thread_count;
+        w->end = (unsigned long long) job_count * (i + 1) / thread_count;
+        w->runner = &r;
+    }
+
+    /* Worker 0 runs on the calling thread. */
+    for (started = 1; started < thread_count; started++) {
+        struct worker *w = &r.workers[started];
+
+        if (pthread_create(&w->thread, NULL, work, w) != 0) {
+            /* The started workers steal the jobs of the others. */
+            break;
+        }
+    }
+    work(&r.workers[0]);
+
+    for (unsigned i = 1; i < started; i++) {
+        pthread_join(r.workers[i].thread, NULL);
+    }
+    for (unsigned i = 0; i < thread_count; i++) {
+        pthread_mutex_destroy(&r.workers[i].lock);
+    }
+    free(r.workers);
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+/* A job of a parallel run, called with the index of the job. */
+typedef void (*runner_job)(unsigned index, void *arg);
+
+/*
+ * Call job(index, arg) for every index in 0..job_count-1 on thread_count
+ * threads, or one per online CPU if thread_count is 0, and return when all
+ * calls have returned. The calling thread is one of the threads.
+ *
+ * Each thread starts with an equal share of the indices. A thread that runs
+ * out of jobs steals half of the remaining indices of another thread, so
+ * jobs of very different lengths keep all threads busy.
+ *
+ * Returns 0 on success or a negative value if memory could not be allocated,
+ * in which case no job is run. If threads cannot be created, the jobs are
+ * run on fewer threads.
+ */
+int runner_run(unsigned job_count, unsigned thread_count, runner_job job,
+               void *arg);
+
+#endif
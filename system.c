@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "system.h"
+
+#define FAILED(status) ((status) < 0)
+
+static void publish(struct system_node *node, unsigned addr, uint8_t byte)
+{
+    struct system_event *event;
+
+    if (addr >= SYSTEM_PUBLISHED_ADDR_LIMIT ||
+        !BITVAL(node->published[addr / 8], addr % 8)) {
+        return;
+    }
+
+    if (node->event_count == node->event_capacity) {
+        unsigned capacity = node->event_capacity ? 2 * node->event_capacity
+                                                 : 64;
+        void *events = realloc(node->events, capacity * sizeof(*event));
+
+        if (!events) {
+            /* Lose the event rather than the simulation. */
+            return;
+        }
+        node->events = events;
+        node->event_capacity = capacity;
+    }
+
+    event = &node->events[node->event_count++];
+    event->time = node->mcu.cpu.cycle_count;
+    event->addr = addr;
+    event->value = byte;
+}
+
+static int publishing_store(void *m, unsigned addr, uint8_t byte)
+{
+    struct system_node *node = m;
+    int rc;
+
+    rc = node->mcu_bus->store(m, addr, byte);
+    if (!FAILED(rc)) {
+        publish(node, addr, byte);
+    }
+    return rc;
+}
+
+static int publishing_io_store(void *m, unsigned addr, uint8_t byte)
+{
+    struct system_node *node = m;
+    int rc;
+
+    rc = node->mcu_io_bus->store(m, addr, byte);
+    if (!FAILED(rc)) {
+        /* Publish by data address. */
+        publish(node, addr + 0x20, byte);
+    }
+    return rc;
+}
+
+/* Interpose on the stores of the MCU of node. */
+static void wrap_buses(struct system_node *node)
+{
+    struct cpu *cpu = &node->mcu.cpu;
+
+    node->mcu_bus = cpu->bus;
+    node->mcu_io_bus = cpu->io_bus;
+    node->bus = *cpu->bus;
+    node->bus.store = publishing_store;
+    node->io_bus = *cpu->io_bus;
+    node->io_bus.store = publishing_io_store;
+    cpu->bus = &node->bus;
+    cpu->io_bus = &node->io_bus;
+}
+
+int system_init(struct system *sys, unsigned node_count, uint64_t quantum,
+                unsigned threads)
+{
+    memset(sys, 0, sizeof(*sys));
+    sys->quantum = quantum > 0 ? quantum : 1;
+    sys->threads = threads == 0 ? 1 : threads > node_count ? node_count
+                                                           : threads;
+
+    sys->nodes = calloc(node_count, sizeof(*sys->nodes));
+    if (!sys->nodes) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < node_count; i++) {
+        struct system_node *node = calloc(1, sizeof(*node));
+
+        if (!node) {
+            system_destroy(sys);
+            return -1;
+        }
+        if (FAILED(atmega328p_init(&node->mcu))) {
+            free(node);
+            system_destroy(sys);
+            return -1;
+        }
+        wrap_buses(node);
+        sys->nodes[sys->node_count++] = node;
+    }
+
+    return 0;
+}
+
+void system_destroy(struct system *sys)
+{
+    for (unsigned i = 0; i < sys->node_count; i++) {
+        atmega328p_destroy(&sys->nodes[i]->mcu);
+        free(sys->nodes[i]->events);
+        free(sys->nodes[i]);
+    }
+    free(sys->nodes);
+    free(sys->links);
+    memset(sys, 0, sizeof(*sys));
+}
+
+struct atmega328p *system_mcu(struct system *sys, unsigned node)
+{
+    return node < sys->node_count ? &sys->nodes[node]->mcu : NULL;
+}
+
+int system_connect(struct system *sys, unsigned from, uint16_t from_addr,
+                   unsigned to, uint16_t to_addr)
+{
+    struct system_link *links;
+
+    if (from >= sys->node_count || to >= sys->node_count ||
+        from_addr >= SYSTEM_PUBLISHED_ADDR_LIMIT) {
+        return -1;
+    }
+
+    links = realloc(sys->links, (sys->link_count + 1) * sizeof(*links));
+    if (!links) {
+        return -1;
+    }
+    sys->links = links;
+    sys->links[sys->link_count++] = (struct system_link) {
+        from, from_addr, to, to_addr
+    };
+    BITSET(sys->nodes[from]->published[from_addr / 8], from_addr % 8);
+
+    return 0;
+}
+
+/*
+ * Run the MCU of node until the end of the quantum or until it stops. An
+ * MCU that sleeps with nothing to wake it idles until the end of the
+ * quantum, as a value delivered to it then may wake it.
+ */
+static void run_node(struct system_node *node, uint64_t end)
+{
+    struct cpu *cpu = &node->mcu.cpu;
+
+    while (node->stopped == CPU_STOP_NONE && cpu->cycle_count < end) {
+        enum cpu_stop_reason reason;
+
+        reason = atmega328p_run(&node->mcu, end - cpu->cycle_count);
+        if (reason == CPU_STOP_SLEEP) {
+            atmega328p_idle(&node->mcu, end - cpu->cycle_count);
+        }
+        else if (reason != CPU_STOP_BUDGET) {
+            node->stopped = reason;
+        }
+    }
+}
+
+/* Deliver the events of the quantum in the order they were published. */
+static void exchange(struct system *sys)
+{
+    unsigned next[sys->node_count];
+
+    memset(next, 0, sizeof(next));
+
+    for (;;) {
+        struct system_node *from = NULL;
+        const struct system_event *event;
+        unsigned index;
+
+        /* Earliest undelivered event; ties go to the lower node. */
+        for (unsigned i = 0; i < sys->node_count; i++) {
+            struct system_node *node = sys->nodes[i];
+
+            if (next[i] < node->event_count &&
+                (!from || node->events[next[i]].time <
+                          from->events[next[index]].time)) {
+                from = node;
+                index = i;
+            }
+        }
+        if (!from) {
+            break;
+        }
+        event = &from->events[next[index]++];
+
+        for (unsigned i = 0; i < sys->link_count; i++) {
+            const struct system_link *link = &sys->links[i];
+            struct system_node *to;
+
+            if (link->from != index || link->from_addr != event->addr) {
+                continue;
+            }
+            /*
+             * A value sent to a PINx register drives the pins, which a store
+             * would toggle. Store bypassing the wrapper so values are not
+             * passed on.
+             */
+            to = sys->nodes[link->to];
+            if (!gpio_drive(&to->mcu.gpio, link->to_addr, event->value, 0xff)) {
+                (void) to->mcu_bus->store(&to->mcu, link->to_addr,
+                                          event->value);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < sys->node_count; i++) {
+        sys->nodes[i]->event_count = 0;
+    }
+}
+
+/* Threads of system_run(), which run every stride'th MCU each quantum. */
+struct system_pool {
+    struct system *sys;
+    pthread_mutex_t lock;
+    pthread_cond_t start; /* Signalled when a quantum starts */
+    pthread_cond_t done; /* Signalled when a thread finishes a quantum */
+    unsigned quantum; /* Number of quanta started */
+    unsigned finished; /* Threads done with the current quantum */
+    unsigned stride; /* Threads including the calling one */
+    _Bool exit;
+    uint64_t quantum_end;
+};
+
+struct system_worker {
+    struct system_pool *pool;
+    unsigned first;
+    pthread_t thread;
+};
+
+static void run_quantum(struct system_pool *pool, unsigned first)
+{
+    struct system *sys = pool->sys;
+
+    for (unsigned i = first; i < sys->node_count; i += pool->stride) {
+        run_node(sys->nodes[i], pool->quantum_end);
+    }
+}
+
+static void *work(void *arg)
+{
+    struct system_worker *w = arg;
+    struct system_pool *pool = w->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->quantum == seen && !pool->exit) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->exit) {
+            break;
+        }
+        seen = pool->quantum;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_quantum(pool, w->first);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static unsigned count_running(const struct system *sys)
+{
+    unsigned running = 0;
+
+    for (unsigned i = 0; i < sys->node_count; i++) {
+        running += sys->nodes[i]->stopped == CPU_STOP_NONE;
+    }
+    return running;
+}
+
+unsigned system_run(struct system *sys, uint64_t cycles)
+{
+    struct system_worker workers[sys->threads];
+    struct system_pool pool = {
+        .sys = sys,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .start = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .stride = 1,
+    };
+    uint64_t end = sys->time + cycles;
+
+    /* The calling thread is the first of the pool. */
+    while (pool.stride < sys->threads) {
+        struct system_worker *w = &workers[pool.stride];
+
+        w->pool = &pool;
+        w->first = pool.stride;
+        if (pthread_create(&w->thread, NULL, work, w) != 0) {
+            break;
+        }
+        pool.stride++;
+    }
+
+    while (sys->time < end && count_running(sys) > 0) {
+        pool.quantum_end = sys->time + sys->quantum < end
+                           ? sys->time + sys->quantum : end;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.quantum++;
+        pool.finished = 0;
+        pthread_cond_broadcast(&pool.start);
+        pthread_mutex_unlock(&pool.lock);
+
+        run_quantum(&pool, 0);
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.finished < pool.stride - 1) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        exchange(sys);
+        sys->time = pool.quantum_end;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.exit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (unsigned i = 1; i < pool.stride; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    return count_running(sys);
+}
@@ -0,0 +1,100 @@
+#ifndef SYSTEM_H
+#define SYSTEM_H
+
+#include <stdint.h>
+#include "atmega328p.h"
+
+/* Stores to data addresses below this can be published to other MCUs. */
+#define SYSTEM_PUBLISHED_ADDR_LIMIT 0x100
+
+/* A store published by an MCU. */
+struct system_event {
+    uint64_t time; /* cycle_count of the MCU when it stored the value */
+    uint16_t addr;
+    uint8_t value;
+};
+
+/*
+ * An MCU of a system. Its data buses are wrapped so that stores to linked
+ * addresses are recorded as events.
+ */
+struct system_node {
+    struct atmega328p mcu; /* Must be first; bus callbacks get &mcu */
+    struct data_bus bus;
+    struct data_bus io_bus;
+    const struct data_bus *mcu_bus; /* The buses of the MCU itself */
+    const struct data_bus *mcu_io_bus;
+
+    /* Bit set for each data address that is the source of a link */
+    uint8_t published[SYSTEM_PUBLISHED_ADDR_LIMIT / 8];
+
+    /* Events of the current quantum */
+    struct system_event *events;
+    unsigned event_count;
+    unsigned event_capacity;
+
+    /* Why the MCU stopped running, CPU_STOP_NONE while it runs or sleeps */
+    enum cpu_stop_reason stopped;
+};
+
+/*
+ * A connection from a data address of one MCU to a data address of another,
+ * e.g. from PORTB of one to PINB of the other. Values stored at the source
+ * are stored at the destination at the end of the quantum, except that the
+ * pins of a PINx destination are driven to them, as if wired to the source.
+ */
+struct system_link {
+    unsigned from;
+    uint16_t from_addr;
+    unsigned to;
+    uint16_t to_addr;
+};
+
+/*
+ * MCUs simulated in lock step. Each MCU runs for a quantum of cycles on its
+ * own, after which the values published during the quantum are delivered
+ * to the linked MCUs in the order they were published. A value thus
+ * arrives up to a quantum late; smaller quanta are more accurate and larger
+ * ones faster.
+ */
+struct system {
+    struct system_node **nodes;
+    unsigned node_count;
+    struct system_link *links;
+    unsigned link_count;
+
+    uint64_t quantum; /* Cycles */
+    unsigned threads; /* Threads to run the MCUs on */
+    uint64_t time; /* Cycles simulated on every MCU */
+};
+
+/*
+ * Initialize a system of node_count MCUs, run threads at a time (at most
+ * one thread per MCU). Returns 0 on success or a negative value if memory
+ * could not be allocated.
+ */
+int system_init(struct system *sys, unsigned node_count, uint64_t quantum,
+                unsigned threads);
+
+void system_destroy(struct system *sys);
+
+/* Returns the MCU of a node, e.g. to load firmware into it. */
+struct atmega328p *system_mcu(struct system *sys, unsigned node);
+
+/*
+ * Link a data address of node from to a data address of node to. from_addr
+ * must be an I/O address (below SYSTEM_PUBLISHED_ADDR_LIMIT). Returns 0 on
+ * success or a negative value on failure.
+ */
+int system_connect(struct system *sys, unsigned from, uint16_t from_addr,
+                   unsigned to, uint16_t to_addr);
+
+/*
+ * Run the system for the given number of cycles or until every MCU has
+ * stopped (by BREAK, a breakpoint or an error). A sleeping MCU has not
+ * stopped, as a value delivered to it may wake it. Returns the number of
+ * MCUs still running.
+ */
+unsigned system_run(struct system *sys, uint64_t cycles);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Runs small systems of ATmega328Ps and checks that values published by one
+ * MCU reach the others.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "atmega328p.h"
+#include "cpu.h"
+#include "defines.h"
+#include "system.h"
+
+/* Encoders for the instructions used by the programs. */
+#define REG_IMM(base, d, K) \
+    ((base) | (((K) & 0xf0) << 4) | (((d) & 0xf) << 4) | ((K) & 0xf))
+#define ONE_REG(base, d)    ((base) | (((d) & 0x1f) << 4))
+#define IO_REG(base, A, r) \
+    ((base) | (((A) & 0x30) << 5) | (((r) & 0x1f) << 4) | ((A) & 0xf))
+
+#define LDI(d, K)       REG_IMM(0xe000, d, K)
+#define DEC(d)          ONE_REG(0x940a, d)
+#define INC(d)          ONE_REG(0x9403, d)
+#define STS(k, r)       ONE_REG(0x9200, r), (k)
+#define IN(d, A)        IO_REG(0xb000, A, d)
+#define OUT(A, r)       IO_REG(0xb800, A, r)
+#define BRNE(k)         (0xf401 | (((k) & 0x7f) << 3))
+#define RJMP(k)         (0xc000 | ((k) & 0xfff))
+#define SEI             0x9478
+#define RETI            0x9518
+#define SLEEP           0x9588
+#define BREAK           0x9598
+
+#define PINB            0x03 /* I/O address */
+#define PORTB           0x05 /* I/O address */
+#define GPIOR0          0x1e /* I/O address */
+#define SMCR            0x33 /* I/O address */
+#define TCCR0B          0x45
+#define PCICR           0x68
+#define PCMSK0          0x6b
+#define TIMSK0          0x6e
+
+/* Interrupt vectors, in words. */
+#define PCINT0          (3 * 2)
+#define TIMER0_OVF      (16 * 2)
+
+static int failures;
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                   #cond);                                          \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static void load(struct atmega328p *mcu, unsigned word, const uint16_t *program,
+                 unsigned words)
+{
+    mcu->flash_bus.write(mcu, word * 2, program, words * 2);
+}
+
+/*
+ * Node 0 starts Timer0 of node 1, which sleeps with nothing else to wake
+ * it, by a store to GPIOR0 linked to TCCR0B. The overflow interrupt must
+ * wake node 1.
+ */
+static void test_wake_sleeping_node(unsigned threads)
+{
+    static const uint16_t sender[] = {
+        LDI(16, 10),
+        DEC(16),                /* 1: */
+        BRNE(-2),               /* to 1 */
+        LDI(17, 1),
+        OUT(GPIOR0, 17),
+        BREAK,
+    };
+    static const uint16_t sleeper[] = {
+        LDI(16, 1),
+        STS(TIMSK0, 16),
+        OUT(SMCR, 16),          /* Idle mode, sleep enabled */
+        SEI,
+        SLEEP,
+        BREAK,
+    };
+    static const uint16_t sleeper_start[] = { RJMP(TIMER0_OVF + 2 - 1) };
+    static const uint16_t sleeper_overflow[] = { INC(20), RETI };
+    struct system sys;
+    struct atmega328p *mcu;
+
+    CHECK(system_init(&sys, 2, 100, threads) == 0);
+    load(system_mcu(&sys, 0), 0, sender, ARRAY_SIZE(sender));
+    mcu = system_mcu(&sys, 1);
+    load(mcu, 0, sleeper_start, ARRAY_SIZE(sleeper_start));
+    load(mcu, TIMER0_OVF, sleeper_overflow, ARRAY_SIZE(sleeper_overflow));
+    load(mcu, TIMER0_OVF + 2, sleeper, ARRAY_SIZE(sleeper));
+    CHECK(system_connect(&sys, 0, GPIOR0 + 0x20, 1, TCCR0B) == 0);
+
+    CHECK(system_run(&sys, 10000) == 0);
+    CHECK(sys.nodes[0]->stopped == CPU_STOP_BREAK);
+    CHECK(sys.nodes[1]->stopped == CPU_STOP_BREAK);
+    CHECK(mcu->gpwr[20] == 1);
+    /* Woken by the first overflow after the quantum of the store */
+    CHECK(mcu->cpu.cycle_count > 100 + 256);
+    CHECK(mcu->cpu.cycle_count < 200 + 256 + 20);
+
+    system_destroy(&sys);
+}
+
+/*
+ * PORTB of node 0 is wired to PINB of node 1, which sleeps until PB7 rises
+ * and reads PINB in the pin change interrupt. Values sent to PINB must
+ * drive the pins rather than toggle PORTB.
+ */
+static void test_drive_pins(unsigned threads)
+{
+    static const uint16_t sender[] = {
+        LDI(16, 0x55),
+        OUT(PORTB, 16),
+        LDI(17, 100),
+        DEC(17),                /* 3: */
+        BRNE(-2),               /* to 3 */
+        LDI(16, 0xaa),
+        OUT(PORTB, 16),
+        BREAK,
+    };
+    static const uint16_t receiver[] = {
+        LDI(16, 1),
+        STS(PCICR, 16),
+        OUT(SMCR, 16),          /* Idle mode, sleep enabled */
+        LDI(16, 0x80),
+        STS(PCMSK0, 16),
+        SEI,
+        SLEEP,
+        BREAK,
+    };
+    static const uint16_t receiver_start[] = { RJMP(PCINT0 + 2 - 1) };
+    static const uint16_t receiver_change[] = { IN(20, PINB), RETI };
+    struct system sys;
+    struct atmega328p *mcu;
+
+    CHECK(system_init(&sys, 2, 100, threads) == 0);
+    load(system_mcu(&sys, 0), 0, sender, ARRAY_SIZE(sender));
+    mcu = system_mcu(&sys, 1);
+    load(mcu, 0, receiver_start, ARRAY_SIZE(receiver_start));
+    load(mcu, PCINT0, receiver_change, ARRAY_SIZE(receiver_change));
+    load(mcu, PCINT0 + 2, receiver, ARRAY_SIZE(receiver));
+    CHECK(system_connect(&sys, 0, PORTB + 0x20, 1, PINB + 0x20) == 0);
+
+    CHECK(system_run(&sys, 10000) == 0);
+    CHECK(sys.nodes[1]->stopped == CPU_STOP_BREAK);
+    CHECK(mcu->gpwr[20] == 0xaa);
+    CHECK(mcu->gpio.port[0] == 0);
+
+    system_destroy(&sys);
+}
+
+int main(void)
+{
+    test_wake_sleeping_node(1);
+    test_wake_sleeping_node(2);
+    test_drive_pins(1);
+    test_drive_pins(2);
+
+    printf("%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,421 @@
+#include "defines.h"
+#include "log.h"
+#include "timer.h"
+
+/* Waveform generation modes, as far as counting is concerned. */
+enum timer_mode {
+    MODE_NORMAL,
+    MODE_CTC,           /* Clear timer on compare match */
+    MODE_FAST_PWM,
+    MODE_PHASE_CORRECT  /* Not supported; counts like MODE_NORMAL */
+};
+
+static unsigned timer_max(const struct timer *t)
+{
+    return (1u << t->config->bits) - 1;
+}
+
+static unsigned timer_wgm(const struct timer *t)
+{
+    if (t->config->bits == 8) {
+        return (t->tccra & 3) | (t->tccrb >> 1 & 4);
+    }
+    return (t->tccra & 3) | (t->tccrb >> 1 & 0xc);
+}
+
+/* Returns the counting mode and sets *top to the TOP value of the mode. */
+static enum timer_mode timer_mode(const struct timer *t, unsigned *top)
+{
+    unsigned wgm = timer_wgm(t);
+
+    *top = timer_max(t);
+
+    if (t->config->bits == 8) {
+        switch (wgm) {
+        case 0:
+            return MODE_NORMAL;
+        case 2:
+            *top = t->ocra;
+            return MODE_CTC;
+        case 3:
+            return MODE_FAST_PWM;
+        case 7:
+            *top = t->ocra;
+            return MODE_FAST_PWM;
+        default:
+            return MODE_PHASE_CORRECT;
+        }
+    }
+
+    switch (wgm) {
+    case 0:
+        return MODE_NORMAL;
+    case 4:
+        *top = t->ocra;
+        return MODE_CTC;
+    case 12:
+        *top = t->icr;
+        return MODE_CTC;
+    case 5:
+        *top = 0xff;
+        return MODE_FAST_PWM;
+    case 6:
+        *top = 0x1ff;
+        return MODE_FAST_PWM;
+    case 7:
+        *top = 0x3ff;
+        return MODE_FAST_PWM;
+    case 14:
+        *top = t->icr;
+        return MODE_FAST_PWM;
+    case 15:
+        *top = t->ocra;
+        return MODE_FAST_PWM;
+    default:
+        return MODE_PHASE_CORRECT;
+    }
+}
+
+static unsigned timer_prescaler(const struct timer *t)
+{
+    return t->config->prescalers[t->tccrb & 7];
+}
+
+/*
+ * Returns the number of ticks after which the counter next becomes value,
+ * or 0 if it never does.
+ */
+static uint64_t ticks_until(const struct timer *t, unsigned value)
+{
+    unsigned top, max = timer_max(t);
+    unsigned period;
+
+    (void) timer_mode(t, &top);
+
+    if (t->count > top) {
+        /* TOP was set below the counter, which counts on up to MAX. */
+        if (value > t->count) {
+            return value - t->count;
+        }
+        if (value > top) {
+            return 0;
+        }
+        return max + 1 - t->count + value;
+    }
+
+    if (value > top) {
+        return 0;
+    }
+    period = top + 1;
+    return (value + period - t->count - 1) % period + 1;
+}
+
+/* Returns the number of ticks until the next overflow, 0 if never. */
+static uint64_t ticks_until_overflow(const struct timer *t)
+{
+    unsigned top;
+    enum timer_mode mode = timer_mode(t, &top);
+
+    if (t->count > top) {
+        return timer_max(t) + 1 - t->count;
+    }
+    /* In CTC mode the counter is cleared at TOP before it overflows. */
+    if (mode == MODE_CTC && top != timer_max(t)) {
+        return 0;
+    }
+    return ticks_until(t, 0);
+}
+
+/* Advance the counter by ticks, setting the flags of events passed. */
+static void timer_count(struct timer *t, uint64_t ticks)
+{
+    unsigned top, max = timer_max(t);
+    uint64_t n;
+
+    (void) timer_mode(t, &top);
+
+    if (ticks == 0) {
+        return;
+    }
+
+    n = ticks_until(t, t->ocra);
+    if (n && n <= ticks) {
+        BITSET(t->tifr, TIMER_OCFA);
+    }
+    n = ticks_until(t, t->ocrb);
+    if (n && n <= ticks) {
+        BITSET(t->tifr, TIMER_OCFB);
+    }
+    n = ticks_until_overflow(t);
+    if (n && n <= ticks) {
+        BITSET(t->tifr, TIMER_TOV);
+    }
+
+    if (t->count > top) {
+        n = max + 1 - t->count;
+        if (ticks < n) {
+            t->count += ticks;
+            return;
+        }
+        t->count = 0;
+        ticks -= n;
+    }
+    t->count = (t->count + ticks) % (top + 1);
+}
+
+/* Request the interrupts whose flag is set and enabled. */
+static void timer_update_irq(struct timer *t)
+{
+    uint8_t requested = t->tifr & t->timsk;
+
+    for (unsigned bit = 0; bit < 8; bit++) {
+        if (t->config->vectors[bit]) {
+            cpu_set_irq(t->cpu, t->config->vectors[bit],
+                        BITVAL(requested, bit));
+        }
+    }
+}
+
+/* Bring the counter up to date with the clock. */
+static void timer_sync(struct timer *t)
+{
+    uint64_t now = t->cpu->cycle_count;
+    unsigned prescaler = timer_prescaler(t);
+
+    if (prescaler && !t->stopped && now > t->time) {
+        /* The prescaler runs freely; the counter ticks on its multiples. */
+        timer_count(t, now / prescaler - t->time / prescaler);
+        timer_update_irq(t);
+    }
+    t->time = now;
+}
+
+/* Schedule an event for the next interrupt flag that is enabled and clear. */
+static void timer_schedule(struct timer *t)
+{
+    unsigned prescaler = timer_prescaler(t);
+    uint8_t wanted = t->timsk & ~t->tifr;
+    uint64_t ticks = 0, n;
+
+    if (prescaler && !t->stopped) {
+        if (BITVAL(wanted, TIMER_OCFA)) {
+            ticks = ticks_until(t, t->ocra);
+        }
+        if (BITVAL(wanted, TIMER_OCFB)) {
+            n = ticks_until(t, t->ocrb);
+            if (n && (!ticks || n < ticks)) {
+                ticks = n;
+            }
+        }
+        if (BITVAL(wanted, TIMER_TOV)) {
+            n = ticks_until_overflow(t);
+            if (n && (!ticks || n < ticks)) {
+                ticks = n;
+            }
+        }
+    }
+
+    if (ticks) {
+        event_schedule(t->queue, &t->event,
+                       (t->time / prescaler + ticks) * prescaler);
+    }
+    else {
+        event_cancel(t->queue, &t->event);
+    }
+}
+
+static void timer_event(struct event *event, void *ctx)
+{
+    struct timer *t = ctx;
+
+    timer_sync(t);
+    timer_schedule(t);
+}
+
+void timer_attach(struct timer *timer, const struct timer_config *config,
+                  struct event_queue *queue, struct cpu *cpu)
+{
+    timer->config = config;
+    timer->queue = queue;
+    timer->cpu = cpu;
+    timer->event.handler = timer_event;
+    timer->event.ctx = timer;
+}
+
+/* Read the low byte of a 16-bit register, latching the high byte. */
+static uint8_t load_low(struct timer *t, uint16_t value)
+{
+    t->temp = value >> 8;
+    return value;
+}
+
+int timer_load(struct timer *t, unsigned addr, uint8_t *byte)
+{
+    const struct timer_config *c = t->config;
+    _Bool wide = c->bits == 16;
+
+    if (addr == c->tccra) {
+        *byte = t->tccra;
+    }
+    else if (addr == c->tccrb) {
+        *byte = t->tccrb;
+    }
+    else if (c->tccrc && addr == c->tccrc) {
+        *byte = t->tccrc;
+    }
+    else if (addr == c->tcnt) {
+        timer_sync(t);
+        *byte = wide ? load_low(t, t->count) : t->count;
+    }
+    else if (wide && (addr == c->tcnt + 1 || addr == c->icr + 1)) {
+        *byte = t->temp;
+    }
+    else if (wide && addr == c->icr) {
+        *byte = load_low(t, t->icr);
+    }
+    else if (addr == c->ocra) {
+        *byte = t->ocra;
+    }
+    else if (wide && addr == c->ocra + 1) {
+        *byte = t->ocra >> 8;
+    }
+    else if (addr == c->ocrb) {
+        *byte = t->ocrb;
+    }
+    else if (wide && addr == c->ocrb + 1) {
+        *byte = t->ocrb >> 8;
+    }
+    else if (addr == c->timsk) {
+        *byte = t->timsk;
+    }
+    else if (addr == c->tifr) {
+        timer_sync(t);
+        *byte = t->tifr;
+    }
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Write a register, taking the high byte of 16-bit ones from the latch. */
+static void store_register(struct timer *t, uint16_t *reg, uint8_t byte)
+{
+    *reg = t->config->bits == 16 ? t->temp << 8 | byte : byte;
+}
+
+int timer_store(struct timer *t, unsigned addr, uint8_t byte)
+{
+    const struct timer_config *c = t->config;
+    _Bool wide = c->bits == 16;
+    unsigned top;
+
+    if (wide && (addr == c->tcnt + 1 || addr == c->icr + 1 ||
+                 addr == c->ocra + 1 || addr == c->ocrb + 1)) {
+        t->temp = byte;
+        return 1;
+    }
+
+    if (addr != c->tccra && addr != c->tccrb && addr != c->tcnt &&
+        addr != c->ocra && addr != c->ocrb && addr != c->timsk &&
+        addr != c->tifr && !(wide && addr == c->icr) &&
+        !(c->tccrc && addr == c->tccrc)) {
+        return 0;
+    }
+
+    /* Count with the old settings up to now. */
+    timer_sync(t);
+
+    if (addr == c->tccra) {
+        t->tccra = byte;
+    }
+    else if (addr == c->tccrb) {
+        t->tccrb = byte;
+    }
+    else if (addr == c->tccrc) {
+        t->tccrc = byte;
+    }
+    else if (addr == c->tcnt) {
+        store_register(t, &t->count, byte);
+    }
+    else if (addr == c->icr) {
+        store_register(t, &t->icr, byte);
+    }
+    else if (addr == c->ocra) {
+        store_register(t, &t->ocra, byte);
+    }
+    else if (addr == c->ocrb) {
+        store_register(t, &t->ocrb, byte);
+    }
+    else if (addr == c->timsk) {
+        t->timsk = byte;
+    }
+    else if (addr == c->tifr) {
+        /* Flags are cleared by writing one to them. */
+        t->tifr &= ~byte;
+    }
+
+    /* TCCRnA is commonly written first, while the timer is stopped. */
+    if ((addr == c->tccra || addr == c->tccrb) && timer_prescaler(t) &&
+        timer_mode(t, &top) == MODE_PHASE_CORRECT) {
+        warn("unsupported timer mode %u\n", timer_wgm(t));
+    }
+
+    timer_update_irq(t);
+    timer_schedule(t);
+    return 1;
+}
+
+uint64_t timer_next_change(struct timer *t, unsigned addr)
+{
+    const struct timer_config *c = t->config;
+    unsigned prescaler = timer_prescaler(t);
+    uint64_t ticks = 0, n;
+
+    if (!prescaler || t->stopped) {
+        return EVENT_NEVER;
+    }
+
+    timer_sync(t);
+    if (addr == c->tcnt || c->bits == 16 && addr == c->tcnt + 1) {
+        ticks = 1;
+    }
+    else if (addr == c->tifr) {
+        /* The next flag set, whether or not its interrupt is enabled. */
+        if (!BITVAL(t->tifr, TIMER_OCFA)) {
+            ticks = ticks_until(t, t->ocra);
+        }
+        n = ticks_until(t, t->ocrb);
+        if (!BITVAL(t->tifr, TIMER_OCFB) && n && (!ticks || n < ticks)) {
+            ticks = n;
+        }
+        n = ticks_until_overflow(t);
+        if (!BITVAL(t->tifr, TIMER_TOV) && n && (!ticks || n < ticks)) {
+            ticks = n;
+        }
+    }
+
+    return ticks ? (t->time / prescaler + ticks) * prescaler : EVENT_NEVER;
+}
+
+void timer_set_stopped(struct timer *t, _Bool stopped)
+{
+    timer_sync(t);
+    t->stopped = stopped;
+    timer_schedule(t);
+}
+
+int timer_ack(struct timer *t, unsigned vector)
+{
+    for (unsigned bit = 0; bit < 8; bit++) {
+        if (vector && t->config->vectors[bit] == vector) {
+            timer_sync(t);
+            BITCLR(t->tifr, bit);
+            timer_update_irq(t);
+            timer_schedule(t);
+            return 1;
+        }
+    }
+    return 0;
+}
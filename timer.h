@@ -0,0 +1,83 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "event.h"
+
+/* Bits of the interrupt flag (TIFRn) and mask (TIMSKn) registers. */
+#define TIMER_TOV   0 /* Overflow */
+#define TIMER_OCFA  1 /* Output compare A match */
+#define TIMER_OCFB  2 /* Output compare B match */
+#define TIMER_ICF   5 /* Input capture */
+
+/*
+ * A Timer/Counter model. Register addresses are data addresses; an address
+ * of 0 means the timer has no such register.
+ */
+struct timer_config {
+    uint8_t bits; /* Counter width, 8 or 16 */
+    uint16_t prescalers[8]; /* Clock divider per CSn value, 0 if stopped */
+    uint16_t tccra, tccrb, tccrc;
+    uint16_t tcnt; /* Low byte of 16-bit registers */
+    uint16_t icr;
+    uint16_t ocra, ocrb;
+    uint16_t timsk, tifr;
+
+    /* Interrupt vector of each bit of TIFRn, 0 if none */
+    uint8_t vectors[8];
+};
+
+/*
+ * A Timer/Counter. The counter is not ticked every cycle. It is brought up
+ * to date from the CPU cycle count when its registers are accessed, and an
+ * event is scheduled only for the next change of an interrupt flag whose
+ * interrupt is enabled.
+ */
+struct timer {
+    const struct timer_config *config;
+    struct event_queue *queue;
+    struct cpu *cpu; /* Clocks the timer and takes its interrupts */
+    struct event event;
+
+    uint64_t time; /* Clock at which count was up to date */
+    uint16_t count;
+    uint16_t ocra, ocrb, icr;
+    uint8_t tccra, tccrb, tccrc;
+    uint8_t timsk, tifr;
+    uint8_t temp; /* High byte latch of 16-bit registers */
+    _Bool stopped; /* Clock stopped by a sleep mode */
+};
+
+/*
+ * Connect a timer in its reset state, or a copy of a timer, to its model,
+ * event queue and CPU.
+ */
+void timer_attach(struct timer *timer, const struct timer_config *config,
+                  struct event_queue *queue, struct cpu *cpu);
+
+/*
+ * Read and write the register of timer at data address addr. Return 1 if
+ * the timer has a register there, 0 otherwise.
+ */
+int timer_load(struct timer *timer, unsigned addr, uint8_t *byte);
+int timer_store(struct timer *timer, unsigned addr, uint8_t byte);
+
+/*
+ * Returns the cycle at which the register of timer at data address addr may
+ * next change by itself, or EVENT_NEVER.
+ */
+uint64_t timer_next_change(struct timer *timer, unsigned addr);
+
+/*
+ * Stop or restart the clock of timer, e.g. in a sleep mode. A stopped timer
+ * does not count and schedules no events.
+ */
+void timer_set_stopped(struct timer *timer, _Bool stopped);
+
+/*
+ * Clear the flag of interrupt vector when the CPU takes the interrupt.
+ * Returns 1 if the vector is one of timer, 0 otherwise.
+ */
+int timer_ack(struct timer *timer, unsigned vector);
+
+#endif
@@ -0,0 +1,143 @@
+/* Print a binary execution trace recorded by avrds -T as text. */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "defines.h"
+#include "instruction_set.h"
+#include "tracer.h"
+
+/* Reads a varint into *value. Returns 0 on success, -1 at the end of input. */
+static int get_varint(FILE *in, uint64_t *value)
+{
+    int c;
+
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        c = getc_unlocked(in);
+        if (c == EOF) {
+            return -1;
+        }
+        *value |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int get_signed(FILE *in, int64_t *value)
+{
+    uint64_t u;
+
+    if (get_varint(in, &u) < 0) {
+        return -1;
+    }
+    *value = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return 0;
+}
+
+static int dump(FILE *in, FILE *out)
+{
+    char header[sizeof(TRACE_MAGIC) - 1 + 1];
+    uint64_t cycle = 0, u, vector;
+    uint16_t next_pc = 0, addr = 0;
+    int64_t delta;
+    int tag, c;
+
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, sizeof(header) - 1) != 0) {
+        eprintf("not a trace file\n");
+        return -1;
+    }
+    if (header[sizeof(header) - 1] != TRACE_VERSION) {
+        eprintf("unsupported trace version %d\n", header[sizeof(header) - 1]);
+        return -1;
+    }
+
+    while ((tag = getc_unlocked(in)) != EOF) {
+        switch (tag & TRACE_TAG_MASK) {
+        case TRACE_SYNC:
+            if (get_varint(in, &cycle) < 0 || get_varint(in, &u) < 0) {
+                goto truncated;
+            }
+            next_pc = u;
+            addr = 0;
+            break;
+        case TRACE_INST:
+            if ((c = getc_unlocked(in)) == EOF) {
+                goto truncated;
+            }
+            if (tag & TRACE_INST_JUMP) {
+                if (get_signed(in, &delta) < 0) {
+                    goto truncated;
+                }
+                next_pc += delta;
+            }
+            u = 1;
+            if ((tag & TRACE_INST_CYCLES) && get_varint(in, &u) < 0) {
+                goto truncated;
+            }
+            cycle += u;
+            fprintf(out, "%llu 0x%04x %s\n", (unsigned long long) cycle,
+                    next_pc * 2, operation_name(c));
+            next_pc += tag & TRACE_INST_LONG ? 2 : 1;
+            break;
+        case TRACE_LOAD:
+        case TRACE_STORE:
+            if (get_signed(in, &delta) < 0 ||
+                (c = getc_unlocked(in)) == EOF) {
+                goto truncated;
+            }
+            addr += delta;
+            fprintf(out, "    %s 0x%04x 0x%02x\n",
+                    (tag & TRACE_TAG_MASK) == TRACE_LOAD ? "load " : "store",
+                    addr, c);
+            break;
+        case TRACE_IRQ:
+            if (get_varint(in, &vector) < 0 || get_varint(in, &u) < 0) {
+                goto truncated;
+            }
+            cycle += u;
+            fprintf(out, "%llu interrupt %u\n", (unsigned long long) cycle,
+                    (unsigned) vector);
+            break;
+        default:
+            eprintf("bad record tag 0x%02x\n", tag);
+            return -1;
+        }
+    }
+    return 0;
+
+truncated:
+    eprintf("trace ends in the middle of a record\n");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static char in_buffer[1 << 16], out_buffer[1 << 16];
+    FILE *in = stdin;
+    int rc;
+
+    if (argc > 2) {
+        eprintf("usage: %s [trace-file]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2) {
+        in = fopen(argv[1], "rb");
+        if (!in) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+    setvbuf(in, in_buffer, _IOFBF, sizeof(in_buffer));
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    rc = dump(in, stdout);
+    fflush(stdout);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return rc < 0;
+}
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "tracer.h"
+
+static inline void put_varint(struct tracer *t, uint64_t value)
+{
+    while (value >= 0x80) {
+        *t->pos++ = value | 0x80;
+        value >>= 7;
+    }
+    *t->pos++ = value;
+}
+
+static inline void put_signed(struct tracer *t, int64_t value)
+{
+    put_varint(t, (uint64_t) value << 1 ^ (uint64_t) (value >> 63));
+}
+
+/* Write all of data to fd. Returns 0 on success, -1 on failure. */
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void *write_buffers(void *arg)
+{
+    struct tracer *t = arg;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        struct tracer_buffer *buffer;
+
+        while (t->tail == t->head && !t->closing) {
+            pthread_cond_wait(&t->filled, &t->lock);
+        }
+        if (t->tail == t->head) {
+            break;
+        }
+        buffer = &t->buffers[t->tail % TRACER_BUFFER_COUNT];
+        pthread_mutex_unlock(&t->lock);
+
+        if (!t->failed && write_all(t->fd, buffer->data, buffer->len) < 0) {
+            warn("writing the trace failed: %s\n", strerror(errno));
+            t->failed = 1;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        t->tail++;
+        pthread_cond_signal(&t->emptied);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+/* Hand the current buffer to the writer thread and start filling the next. */
+static void next_buffer(struct tracer *t)
+{
+    struct tracer_buffer *buffer = &t->buffers[t->head % TRACER_BUFFER_COUNT];
+
+    pthread_mutex_lock(&t->lock);
+    buffer->len = t->pos - buffer->data;
+    t->head++;
+    pthread_cond_signal(&t->filled);
+    while (t->head - t->tail >= TRACER_BUFFER_COUNT) {
+        pthread_cond_wait(&t->emptied, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    buffer = &t->buffers[t->head % TRACER_BUFFER_COUNT];
+    t->pos = buffer->data;
+    t->end = buffer->data + TRACER_BUFFER_SIZE;
+    t->synced = 0;
+}
+
+/* Make room for a record, starting each buffer with a TRACE_SYNC. */
+static inline void reserve(struct tracer *t)
+{
+    if (t->end - t->pos < 2 * TRACE_MAX_RECORD) {
+        next_buffer(t);
+    }
+    if (!t->synced) {
+        *t->pos++ = TRACE_SYNC;
+        put_varint(t, t->cycle);
+        put_varint(t, t->next_pc);
+        t->addr = 0;
+        t->synced = 1;
+    }
+}
+
+int tracer_open(struct tracer *tracer, const char *path)
+{
+    static const char header[] = TRACE_MAGIC;
+
+    memset(tracer, 0, sizeof(*tracer));
+    tracer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tracer->fd < 0) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < TRACER_BUFFER_COUNT; i++) {
+        tracer->buffers[i].data = malloc(TRACER_BUFFER_SIZE);
+        if (!tracer->buffers[i].data) {
+            goto fail;
+        }
+    }
+    tracer->pos = tracer->buffers[0].data;
+    tracer->end = tracer->pos + TRACER_BUFFER_SIZE;
+    memcpy(tracer->pos, header, sizeof(header) - 1);
+    tracer->pos += sizeof(header) - 1;
+    *tracer->pos++ = TRACE_VERSION;
+
+    pthread_mutex_init(&tracer->lock, NULL);
+    pthread_cond_init(&tracer->filled, NULL);
+    pthread_cond_init(&tracer->emptied, NULL);
+    if (pthread_create(&tracer->thread, NULL, write_buffers, tracer) != 0) {
+        pthread_cond_destroy(&tracer->emptied);
+        pthread_cond_destroy(&tracer->filled);
+        pthread_mutex_destroy(&tracer->lock);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    for (unsigned i = 0; i < TRACER_BUFFER_COUNT; i++) {
+        free(tracer->buffers[i].data);
+    }
+    close(tracer->fd);
+    return -1;
+}
+
+void tracer_close(struct tracer *tracer)
+{
+    next_buffer(tracer);
+
+    pthread_mutex_lock(&tracer->lock);
+    tracer->closing = 1;
+    pthread_cond_signal(&tracer->filled);
+    pthread_mutex_unlock(&tracer->lock);
+    pthread_join(tracer->thread, NULL);
+
+    pthread_cond_destroy(&tracer->emptied);
+    pthread_cond_destroy(&tracer->filled);
+    pthread_mutex_destroy(&tracer->lock);
+    for (unsigned i = 0; i < TRACER_BUFFER_COUNT; i++) {
+        free(tracer->buffers[i].data);
+    }
+    close(tracer->fd);
+}
+
+void tracer_instruction(struct tracer *t, uint16_t pc, unsigned op,
+                        unsigned length, uint64_t cycle)
+{
+    uint8_t *tag;
+
+    reserve(t);
+    tag = t->pos++;
+    *tag = TRACE_INST | (length > 1 ? TRACE_INST_LONG : 0);
+    *t->pos++ = op;
+    if (pc != t->next_pc) {
+        *tag |= TRACE_INST_JUMP;
+        put_signed(t, (int16_t) (pc - t->next_pc));
+    }
+    if (cycle - t->cycle != 1) {
+        *tag |= TRACE_INST_CYCLES;
+        put_varint(t, cycle - t->cycle);
+    }
+    t->cycle = cycle;
+    t->next_pc = pc + length;
+}
+
+void tracer_access(struct tracer *t, unsigned kind, uint16_t addr,
+                   uint8_t value)
+{
+    reserve(t);
+    *t->pos++ = kind;
+    put_signed(t, (int16_t) (addr - t->addr));
+    *t->pos++ = value;
+    t->addr = addr;
+}
+
+void tracer_interrupt(struct tracer *t, unsigned vector, uint64_t cycle)
+{
+    reserve(t);
+    *t->pos++ = TRACE_IRQ;
+    put_varint(t, vector);
+    put_varint(t, cycle - t->cycle);
+    t->cycle = cycle;
+}
@@ -0,0 +1,98 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Binary execution trace format. A trace file starts with TRACE_MAGIC and
+ * TRACE_VERSION and is followed by records, each a tag byte and fields.
+ * Numbers are LEB128 varints; signed numbers are zigzag encoded first.
+ *
+ * TRACE_SYNC     cycle, pc: absolute values the following records are
+ *                relative to. Starts every chunk written, so a trace
+ *                cut short can be decoded up to its last chunk.
+ * TRACE_INST     op byte, then if TRACE_INST_JUMP is set the signed
+ *                difference of pc to the pc after the previous instruction,
+ *                and if TRACE_INST_CYCLES is set the cycles since the
+ *                previous instruction or interrupt; 1 if not set.
+ *                TRACE_INST_LONG is set on two-word instructions.
+ * TRACE_LOAD,    signed difference of the data address to the previous
+ * TRACE_STORE    access, then the value byte. Accesses belong to the
+ *                instruction or interrupt before them.
+ * TRACE_IRQ      vector, cycles since the previous instruction.
+ */
+#define TRACE_MAGIC         "AVRTRACE"
+#define TRACE_VERSION       1
+
+#define TRACE_TAG_MASK      0x07
+#define TRACE_SYNC          0
+#define TRACE_INST          1
+#define TRACE_LOAD          2
+#define TRACE_STORE         3
+#define TRACE_IRQ           4
+
+#define TRACE_INST_JUMP     0x08
+#define TRACE_INST_CYCLES   0x10
+#define TRACE_INST_LONG     0x20
+
+/* The largest record, a TRACE_SYNC. */
+#define TRACE_MAX_RECORD    (1 + 10 + 10)
+
+#define TRACER_BUFFER_SIZE  (1 << 20)
+#define TRACER_BUFFER_COUNT 4
+
+struct tracer_buffer {
+    uint8_t *data;
+    unsigned len;
+};
+
+/*
+ * Writes a trace to a file. Records are appended to a buffer of a ring,
+ * which a background thread writes out once it is full while the next one
+ * is filled. The CPU thread waits only if the writer falls a whole ring
+ * behind.
+ */
+struct tracer {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled; /* Signalled when a buffer is handed to the thread */
+    pthread_cond_t emptied; /* Signalled when the thread has written one */
+    struct tracer_buffer buffers[TRACER_BUFFER_COUNT];
+    unsigned head; /* Buffers handed to the thread, ever */
+    unsigned tail; /* Buffers written by the thread, ever */
+    _Bool closing;
+    _Bool failed; /* A write failed; the rest of the trace is dropped */
+
+    /* The buffer being filled, buffers[head % TRACER_BUFFER_COUNT] */
+    uint8_t *pos, *end;
+
+    /* State the next record is relative to */
+    uint64_t cycle;
+    uint16_t next_pc;
+    uint16_t addr;
+    _Bool synced; /* A TRACE_SYNC started the current buffer */
+};
+
+/*
+ * Create the trace file path and start its writer thread. Returns 0 on
+ * success or a negative value on failure.
+ */
+int tracer_open(struct tracer *tracer, const char *path);
+
+/* Write out the rest of the trace and release the resources of tracer. */
+void tracer_close(struct tracer *tracer);
+
+/* Record the instruction of length words at pc, executed at cycle. */
+void tracer_instruction(struct tracer *tracer, uint16_t pc, unsigned op,
+                        unsigned length, uint64_t cycle);
+
+/* Record a load or store (TRACE_LOAD or TRACE_STORE) of a data address. */
+void tracer_access(struct tracer *tracer, unsigned kind, uint16_t addr,
+                   uint8_t value);
+
+/* Record the entry of an interrupt at cycle. */
+void tracer_interrupt(struct tracer *tracer, unsigned vector, uint64_t cycle);
+
+#endif
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE /* posix_openpt(), cfmakeraw() */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "defines.h"
+#include "log.h"
+#include "usart.h"
+
+/* Frames after which a receiver waiting for host data looks for it again. */
+#define USART_POLL_FRAMES 16
+
+/* Returns the number of cycles a frame takes with the current settings. */
+static uint64_t frame_cycles(const struct usart *u)
+{
+    unsigned size = (u->ucsrc >> 1 & 3) | (u->ucsrb & 4);
+    unsigned bits = 1; /* Start bit */
+
+    bits += size == 7 ? 9 : size < 4 ? size + 5 : 8;
+    bits += (u->ucsrc >> 4 & 3) != 0; /* Parity bit */
+    bits += BITVAL(u->ucsrc, 3) ? 2 : 1; /* Stop bits */
+
+    return (uint64_t) bits * (BITVAL(u->ucsra, USART_U2X) ? 8 : 16) *
+           (u->ubrr + 1);
+}
+
+/* Request the interrupts whose flag is set and enabled. */
+static void usart_update_irq(struct usart *u)
+{
+    const struct usart_config *c = u->config;
+
+    cpu_set_irq(u->cpu, c->rx_vector, BITVAL(u->ucsra, USART_RXC) &&
+                                      BITVAL(u->ucsrb, USART_RXCIE));
+    cpu_set_irq(u->cpu, c->udre_vector, BITVAL(u->ucsra, USART_UDRE) &&
+                                        BITVAL(u->ucsrb, USART_UDRIE));
+    cpu_set_irq(u->cpu, c->tx_vector, BITVAL(u->ucsra, USART_TXC) &&
+                                      BITVAL(u->ucsrb, USART_TXCIE));
+}
+
+/* Returns 1 if the input buffer of stream has data, reading more if not. */
+static int stream_fill(struct usart_stream *st)
+{
+    struct pollfd pfd = { .fd = st->in_fd, .events = POLLIN };
+    ssize_t n;
+
+    if (st->in_pos < st->in_len) {
+        return 1;
+    }
+    if (st->in_fd < 0 || st->in_eof) {
+        return 0;
+    }
+
+    /* Never block the simulation waiting for the host. */
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLIN | POLLHUP))) {
+        return 0;
+    }
+    n = read(st->in_fd, st->in, sizeof(st->in));
+    if (n == 0) {
+        st->in_eof = 1;
+    }
+    if (n <= 0) {
+        /* A pty without a slave attached fails with EIO; try again later. */
+        return 0;
+    }
+    st->in_pos = 0;
+    st->in_len = n;
+    return 1;
+}
+
+static void stream_put(struct usart_stream *st, uint8_t byte)
+{
+    if (st->out_fd < 0) {
+        return;
+    }
+    if (st->out_len == sizeof(st->out)) {
+        usart_stream_flush(st);
+    }
+    st->out[st->out_len++] = byte;
+}
+
+/* Start sending byte, which ends a frame time from now. */
+static void start_transmit(struct usart *u, uint8_t byte)
+{
+    u->tx_shift = byte;
+    u->tx_busy = 1;
+    event_schedule(u->queue, &u->tx_event,
+                   u->cpu->cycle_count + frame_cycles(u));
+}
+
+static void tx_event(struct event *event, void *ctx)
+{
+    struct usart *u = ctx;
+
+    if (u->stream) {
+        stream_put(u->stream, u->tx_shift);
+    }
+
+    if (!BITVAL(u->ucsra, USART_UDRE)) {
+        /* The next frame moves from UDRn to the shift register. */
+        BITSET(u->ucsra, USART_UDRE);
+        start_transmit(u, u->tx_buffer);
+    }
+    else {
+        u->tx_busy = 0;
+        BITSET(u->ucsra, USART_TXC);
+    }
+    usart_update_irq(u);
+}
+
+/*
+ * Schedule the end of the next received frame, or a later look for data if
+ * the host has none.
+ */
+static void schedule_receive(struct usart *u, _Bool ready)
+{
+    struct usart_stream *st = u->stream;
+    uint64_t frame = frame_cycles(u);
+
+    if (!BITVAL(u->ucsrb, USART_RXEN) || !st) {
+        event_cancel(u->queue, &u->rx_event);
+    }
+    else if (ready) {
+        event_schedule(u->queue, &u->rx_event, u->cpu->cycle_count + frame);
+    }
+    else if (st->in_fd >= 0 && !st->in_eof) {
+        event_schedule(u->queue, &u->rx_event,
+                       u->cpu->cycle_count + USART_POLL_FRAMES * frame);
+    }
+    else {
+        event_cancel(u->queue, &u->rx_event);
+    }
+}
+
+static void rx_event(struct event *event, void *ctx)
+{
+    struct usart *u = ctx;
+    struct usart_stream *st = u->stream;
+
+    if (!stream_fill(st)) {
+        schedule_receive(u, 0);
+        return;
+    }
+
+    /* A frame that finds the receive buffer full is lost. */
+    if (u->rx_count < ARRAY_SIZE(u->rx_fifo)) {
+        u->rx_fifo[u->rx_count++] = st->in[st->in_pos];
+        BITSET(u->ucsra, USART_RXC);
+    }
+    else {
+        BITSET(u->ucsra, USART_DOR);
+    }
+    st->in_pos++;
+
+    /* The next frame is on the line if the host has one. */
+    schedule_receive(u, stream_fill(st));
+    usart_update_irq(u);
+}
+
+void usart_reset(struct usart *usart)
+{
+    memset(usart, 0, sizeof(*usart));
+    usart->ucsra = BIT2MASK(USART_UDRE);
+    usart->ucsrc = 0x06; /* 8 data bits */
+}
+
+void usart_attach(struct usart *usart, const struct usart_config *config,
+                  struct event_queue *queue, struct cpu *cpu)
+{
+    usart->config = config;
+    usart->queue = queue;
+    usart->cpu = cpu;
+    usart->tx_event.handler = tx_event;
+    usart->tx_event.ctx = usart;
+    usart->rx_event.handler = rx_event;
+    usart->rx_event.ctx = usart;
+}
+
+void usart_connect(struct usart *usart, struct usart_stream *stream)
+{
+    usart->stream = stream;
+    schedule_receive(usart, stream && stream_fill(stream));
+}
+
+int usart_load(struct usart *u, unsigned addr, uint8_t *byte)
+{
+    const struct usart_config *c = u->config;
+
+    if (addr == c->udr) {
+        *byte = u->rx_fifo[0];
+        if (u->rx_count > 0) {
+            u->rx_fifo[0] = u->rx_fifo[1];
+            u->rx_count--;
+        }
+        if (u->rx_count == 0) {
+            BITCLR(u->ucsra, USART_RXC);
+            BITCLR(u->ucsra, USART_DOR);
+        }
+        usart_update_irq(u);
+    }
+    else if (addr == c->ucsra) {
+        *byte = u->ucsra;
+    }
+    else if (addr == c->ucsrb) {
+        *byte = u->ucsrb;
+    }
+    else if (addr == c->ucsrc) {
+        *byte = u->ucsrc;
+    }
+    else if (addr == c->ubrr) {
+        *byte = u->ubrr;
+    }
+    else if (addr == c->ubrr + 1) {
+        *byte = u->ubrr >> 8;
+    }
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+int usart_store(struct usart *u, unsigned addr, uint8_t byte)
+{
+    const struct usart_config *c = u->config;
+    uint8_t changed;
+
+    if (addr == c->udr) {
+        /* Data written while UDRn is full is ignored. */
+        if (!BITVAL(u->ucsrb, USART_TXEN) || !BITVAL(u->ucsra, USART_UDRE)) {
+            return 1;
+        }
+        if (!u->tx_busy) {
+            start_transmit(u, byte);
+        }
+        else {
+            u->tx_buffer = byte;
+            BITCLR(u->ucsra, USART_UDRE);
+        }
+    }
+    else if (addr == c->ucsra) {
+        /* TXC is cleared by writing one to it. */
+        u->ucsra &= ~(byte & BIT2MASK(USART_TXC));
+        u->ucsra = u->ucsra & ~3 | byte & 3;
+    }
+    else if (addr == c->ucsrb) {
+        /* RXB8 is read-only. */
+        changed = (u->ucsrb ^ byte) & ~2;
+        u->ucsrb = u->ucsrb & 2 | byte & ~2;
+        if (BITVAL(changed, USART_RXEN)) {
+            if (!BITVAL(byte, USART_RXEN)) {
+                /* Disabling the receiver flushes its buffer. */
+                u->rx_count = 0;
+                u->ucsra &= ~(BIT2MASK(USART_RXC) | BIT2MASK(USART_DOR));
+            }
+            schedule_receive(u, u->stream && stream_fill(u->stream));
+        }
+    }
+    else if (addr == c->ucsrc) {
+        if (byte >> 6 != 0) {
+            warn("unsupported USART mode %u\n", byte >> 6);
+        }
+        u->ucsrc = byte;
+    }
+    else if (addr == c->ubrr) {
+        u->ubrr = u->ubrr & 0xf00 | byte;
+    }
+    else if (addr == c->ubrr + 1) {
+        u->ubrr = (byte & 0xf) << 8 | u->ubrr & 0xff;
+    }
+    else {
+        return 0;
+    }
+
+    usart_update_irq(u);
+    return 1;
+}
+
+uint64_t usart_next_change(struct usart *u, unsigned addr)
+{
+    const struct usart_config *c = u->config;
+    uint64_t next = EVENT_NEVER;
+
+    /* The flags and the received data change only at the end of frames. */
+    if (addr != c->ucsra && addr != c->udr) {
+        return EVENT_NEVER;
+    }
+    if (u->tx_event.index) {
+        next = u->tx_event.time;
+    }
+    if (u->rx_event.index && u->rx_event.time < next) {
+        next = u->rx_event.time;
+    }
+    return next;
+}
+
+/* Cancel event, keeping in *left the cycles it had to go. */
+static void pause_event(struct usart *u, struct event *event, uint64_t *left)
+{
+    *left = 0;
+    if (event->index) {
+        *left = event->time - u->cpu->cycle_count;
+        event_cancel(u->queue, event);
+    }
+}
+
+static void resume_event(struct usart *u, struct event *event, uint64_t left)
+{
+    if (left) {
+        event_schedule(u->queue, event, u->cpu->cycle_count + left);
+    }
+}
+
+void usart_set_stopped(struct usart *u, _Bool stopped)
+{
+    if (stopped == u->stopped) {
+        return;
+    }
+    u->stopped = stopped;
+    if (stopped) {
+        pause_event(u, &u->tx_event, &u->tx_left);
+        pause_event(u, &u->rx_event, &u->rx_left);
+    }
+    else {
+        resume_event(u, &u->tx_event, u->tx_left);
+        resume_event(u, &u->rx_event, u->rx_left);
+    }
+}
+
+int usart_ack(struct usart *u, unsigned vector)
+{
+    const struct usart_config *c = u->config;
+
+    if (vector == c->tx_vector) {
+        /* Only TXC is cleared by taking its interrupt. */
+        BITCLR(u->ucsra, USART_TXC);
+        usart_update_irq(u);
+        return 1;
+    }
+    return vector == c->rx_vector || vector == c->udre_vector;
+}
+
+void usart_stream_init(struct usart_stream *stream, int in_fd, int out_fd)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->in_fd = in_fd;
+    stream->out_fd = out_fd;
+}
+
+int usart_stream_open_pty(struct usart_stream *stream, char *name,
+                          size_t size)
+{
+    struct termios tio;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0 ||
+        ptsname_r(fd, name, size) != 0 || tcgetattr(fd, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* Pass bytes through unchanged. */
+    cfmakeraw(&tio);
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    usart_stream_init(stream, fd, fd);
+    stream->owned = 1;
+    return 0;
+}
+
+void usart_stream_flush(struct usart_stream *stream)
+{
+    unsigned done = 0;
+
+    while (done < stream->out_len) {
+        ssize_t n = write(stream->out_fd, stream->out + done,
+                          stream->out_len - done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* Lose the data rather than the simulation. */
+            debug("lost %u bytes of USART output\n", stream->out_len - done);
+            break;
+        }
+        done += n;
+    }
+    stream->out_len = 0;
+}
+
+void usart_stream_close(struct usart_stream *stream)
+{
+    usart_stream_flush(stream);
+    if (stream->owned) {
+        close(stream->in_fd);
+    }
+    stream->in_fd = -1;
+    stream->out_fd = -1;
+}
@@ -0,0 +1,133 @@
+#ifndef USART_H
+#define USART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+/* Bits of UCSRnA. */
+#define USART_MPCM  0 /* Multi-processor communication mode */
+#define USART_U2X   1 /* Double transmission speed */
+#define USART_UPE   2 /* Parity error */
+#define USART_DOR   3 /* Data overrun */
+#define USART_FE    4 /* Frame error */
+#define USART_UDRE  5 /* Data register empty */
+#define USART_TXC   6 /* Transmit complete */
+#define USART_RXC   7 /* Receive complete */
+
+/* Bits of UCSRnB. */
+#define USART_TXEN  3
+#define USART_RXEN  4
+#define USART_UDRIE 5
+#define USART_TXCIE 6
+#define USART_RXCIE 7
+
+/* Size of each buffer of a host stream. */
+#define USART_STREAM_BUFFER_SIZE 4096
+
+/*
+ * A USART model. Register addresses are data addresses; ubrr is the low
+ * byte of UBRRn.
+ */
+struct usart_config {
+    uint16_t ucsra, ucsrb, ucsrc;
+    uint16_t ubrr;
+    uint16_t udr;
+    uint8_t rx_vector, udre_vector, tx_vector;
+};
+
+/*
+ * Host file descriptors that a USART receives from and transmits to. Data
+ * is read into and written out of the buffers directly, a buffer at a time,
+ * so a system call moves many frames.
+ */
+struct usart_stream {
+    int in_fd, out_fd; /* -1 if none */
+    _Bool owned; /* The stream opened the descriptors and closes them */
+    _Bool in_eof;
+    unsigned in_pos, in_len;
+    unsigned out_len;
+    uint8_t in[USART_STREAM_BUFFER_SIZE];
+    uint8_t out[USART_STREAM_BUFFER_SIZE];
+};
+
+/*
+ * A USART in asynchronous mode. Frames take as many cycles as they would on
+ * the line at the configured baud rate; an event is scheduled for the end
+ * of each frame sent or received. Received frames come from the host
+ * stream as fast as the baud rate allows, whenever it has data.
+ */
+struct usart {
+    const struct usart_config *config;
+    struct event_queue *queue;
+    struct cpu *cpu;
+    struct event tx_event, rx_event;
+    struct usart_stream *stream; /* NULL if not connected */
+
+    uint8_t ucsra, ucsrb, ucsrc;
+    uint16_t ubrr;
+    uint8_t tx_buffer; /* Valid while UDRE is clear */
+    uint8_t tx_shift; /* Frame being sent, valid while tx_busy */
+    _Bool tx_busy;
+    uint8_t rx_fifo[2]; /* Received frames not read from UDRn */
+    unsigned rx_count;
+    _Bool stopped; /* Clock stopped by a sleep mode */
+    uint64_t tx_left, rx_left; /* Cycles left of the frames when stopped */
+};
+
+/* Put usart in its reset state, not connected to a host stream. */
+void usart_reset(struct usart *usart);
+
+/*
+ * Connect a USART in its reset state, or a copy of a USART, to its model,
+ * event queue and CPU.
+ */
+void usart_attach(struct usart *usart, const struct usart_config *config,
+                  struct event_queue *queue, struct cpu *cpu);
+
+/*
+ * Connect usart to a host stream, or disconnect it if stream is NULL. MCUs
+ * forked from an MCU are not connected to its stream.
+ */
+void usart_connect(struct usart *usart, struct usart_stream *stream);
+
+/*
+ * Read and write the register of usart at data address addr. Return 1 if
+ * the USART has a register there, 0 otherwise.
+ */
+int usart_load(struct usart *usart, unsigned addr, uint8_t *byte);
+int usart_store(struct usart *usart, unsigned addr, uint8_t byte);
+
+/*
+ * Returns the cycle at which the register of usart at data address addr may
+ * next change by itself, or EVENT_NEVER.
+ */
+uint64_t usart_next_change(struct usart *usart, unsigned addr);
+
+/* Stop or restart the clock of usart, e.g. in a sleep mode. */
+void usart_set_stopped(struct usart *usart, _Bool stopped);
+
+/*
+ * Clear the flag of interrupt vector when the CPU takes the interrupt.
+ * Returns 1 if the vector is one of usart, 0 otherwise.
+ */
+int usart_ack(struct usart *usart, unsigned vector);
+
+/* Initialize a stream on host file descriptors, -1 for none. */
+void usart_stream_init(struct usart_stream *stream, int in_fd, int out_fd);
+
+/*
+ * Initialize a stream on a new pseudo-terminal in raw mode and store the
+ * path of its slave side in name. Returns 0 on success or a negative value
+ * on failure.
+ */
+int usart_stream_open_pty(struct usart_stream *stream, char *name,
+                          size_t size);
+
+/* Write out the transmitted data buffered in stream. */
+void usart_stream_flush(struct usart_stream *stream);
+
+/* Flush stream and close its descriptors if it opened them. */
+void usart_stream_close(struct usart_stream *stream);
+
+#endif
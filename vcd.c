@@ -0,0 +1,73 @@
+#include <string.h>
+#include "defines.h"
+#include "vcd.h"
+
+/* Returns the identifier code of a pin, one printable character. */
+static char pin_code(unsigned port, unsigned pin)
+{
+    return '!' + port * 8 + pin;
+}
+
+static void write_header(struct vcd_writer *vcd, const struct gpio_config *c)
+{
+    fprintf(vcd->stream, "$version avrds $end\n"
+                         "$timescale 1 ps $end\n"
+                         "$scope module gpio $end\n");
+    for (unsigned i = 0; i < c->port_count; i++) {
+        for (unsigned pin = 0; pin < 8; pin++) {
+            if (BITVAL(c->ports[i].pins, pin)) {
+                fprintf(vcd->stream, "$var wire 1 %c P%c%u $end\n",
+                        pin_code(i, pin), c->ports[i].name, pin);
+            }
+        }
+    }
+    fprintf(vcd->stream, "$upscope $end\n"
+                         "$enddefinitions $end\n");
+}
+
+static void write_changes(void *ctx, const struct gpio_change *changes,
+                          unsigned count)
+{
+    struct vcd_writer *vcd = ctx;
+
+    if (!vcd->started) {
+        write_header(vcd, vcd->log.config);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        const struct gpio_change *change = &changes[i];
+        uint64_t time = change->cycle * vcd->ps_per_cycle;
+
+        if (!vcd->started || time != vcd->time) {
+            fprintf(vcd->stream, "#%llu\n", (unsigned long long) time);
+            vcd->time = time;
+            vcd->started = 1;
+        }
+        for (unsigned pin = 0; pin < 8; pin++) {
+            if (BITVAL(change->changed, pin)) {
+                putc('0' + BITVAL(change->levels, pin), vcd->stream);
+                putc(pin_code(change->port, pin), vcd->stream);
+                putc('\n', vcd->stream);
+            }
+        }
+    }
+}
+
+int vcd_open(struct vcd_writer *vcd, const char *path, unsigned clock_hz)
+{
+    memset(vcd, 0, sizeof(*vcd));
+    vcd->stream = fopen(path, "w");
+    if (!vcd->stream) {
+        return -1;
+    }
+    setvbuf(vcd->stream, vcd->buffer, _IOFBF, sizeof(vcd->buffer));
+    vcd->ps_per_cycle = 1000000000000ull / clock_hz;
+    gpio_log_init(&vcd->log, write_changes, vcd);
+    return 0;
+}
+
+void vcd_close(struct vcd_writer *vcd)
+{
+    gpio_log_flush(&vcd->log);
+    fclose(vcd->stream);
+}
@@ -0,0 +1,35 @@
+#ifndef VCD_H
+#define VCD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "gpio.h"
+
+/* Size of the stdio buffer of a VCD file. */
+#define VCD_BUFFER_SIZE (1 << 16)
+
+/*
+ * Writes the pin changes of a GPIO as a Value Change Dump, with a 1-bit
+ * wire per pin named after it, e.g. PB5, for waveform viewers. Only the
+ * pins that change are written, each time the log hands over a buffer of
+ * changes. Times are in picoseconds of the CPU clock.
+ */
+struct vcd_writer {
+    FILE *stream;
+    struct gpio_log log; /* Connect to a GPIO with gpio_connect() */
+    uint64_t ps_per_cycle;
+    uint64_t time; /* Last time written */
+    _Bool started; /* The header has been written */
+    char buffer[VCD_BUFFER_SIZE];
+};
+
+/*
+ * Create a VCD file at path for a CPU clocked at clock_hz. Returns 0 on
+ * success or a negative value with errno set on failure.
+ */
+int vcd_open(struct vcd_writer *vcd, const char *path, unsigned clock_hz);
+
+/* Write out the changes logged and close the file. */
+void vcd_close(struct vcd_writer *vcd);
+
+#endif